@@ -1,19 +1,38 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <elf.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
 
-#define PAE_MAXPHYADDR 52 // MAXPHYADDR for PAE
-#define LEGACY_MAXPHYADDR 32 // MAXPHYADDR from Legacy translations
-
-// Delete this block if no debug is supposed to be happening
-#ifndef VA2PA_DEBUG_ON
-    #define VA2PA_DEBUG_ON
+#if defined(__x86_64__) || defined(__i386__)
+    #define VA2PA_X86 // SIMD table classification kernels are available
+    #include <immintrin.h>
 #endif
 
-#ifdef VA2PA_DEBUG_ON
-    #include <time.h>
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define VA2PA_URING // io_uring backend of va2pa_async() is available
+        #include <sys/syscall.h>
+        #include <linux/io_uring.h>
+    #endif
 #endif
 
+#define PAE_MAXPHYADDR 52 // MAXPHYADDR for PAE
+#define LEGACY_MAXPHYADDR 32 // MAXPHYADDR from Legacy translations
+
+// Build with -DVA2PA_DEBUG_ON to print why translations fail, with -DVA2PA_BENCH for the benchmark suite main() (link with -lm)
+// and with -DVA2PA_TOOL for the streaming translation tool main()
+
 /* -------------------------------------------------------------------------- */
 /*                                 DEFINITIONS                                */
 /* -------------------------------------------------------------------------- */
@@ -36,7 +55,8 @@ typedef enum {
     ST_PML4E_SUPERVISOR_MODE_32, // PDE is in supervisor mode and cannot be accessed
     ST_PML4E_MBZ_32, // PML4E MustBeZero bits are set (not zero)
     ST_PTE_PAE_PAT_32, // PTE PAT Bit in PAE mode must be unset
-    ST_PDE_PSE_PAT_32 // PAT bit should be zero in PSE mode
+    ST_PDE_PSE_PAT_32, // PAT bit should be zero in PSE mode
+    ST_ADDRESS_WIDTH_32 // Virtual address is wider than the paging mode translates (above 4 GiB in legacy and PAE modes)
 } TranslationState32;
 
 /* -------------- PAE and Legacy Translation Entities Bit Maps -------------- */
@@ -166,45 +186,29 @@ static const CR3BitTable CR3Bits64 = {
 
 // Basically, PDPTE, PDE and PTE bit structures are the same fro PAE and Long mode paging
 
-/* -------------------------------------------------------------------------- */
-/*                                AUX FUNCTIONS                               */
-/* -------------------------------------------------------------------------- */
-
-#ifdef VA2PA_DEBUG_ON
-uint64_t randbits(int bytes) {
-    uint64_t result = 0;
-    uint64_t currand = 0;
-
-    for (int i = 0; i < bytes; i++) {
-        currand = (rand() & 0xff);
-        result |= currand << (i * 8);
-    }
+/* -------------------- Extended Page Tables Bit Maps ----------------------- */
 
-    return result;
-}
+// Struct represents EPT entry bit indices, entries of all four levels share them
+typedef struct {
+    const uint8_t read, write, exec, memtype, ps, accessed, dirty, addrstart, addrend;
+    const uint64_t reserved_pml4e, reserved_table, reserved_1g, reserved_2m;
+} EPTBitTable;
 
-// Dummy implementation of PREAD_FUNC just for debugging purposes
-unsigned int dbg_read_func(void *buf, const unsigned int size, const unsigned int physical_addr) {
-    uint64_t targetData = randbits(size);
-    targetData |= 0x5; // Setting present bit and user access bit
-    
-    if (size == sizeof(uint32_t)) {
-        *(uint32_t*) buf = targetData;    
-    } else if (size == sizeof(uint64_t)) {
-        *(uint64_t*) buf = targetData;
-    }
-    
-    return size;
-}
+// EPT Bit Table
+static const EPTBitTable EPTBits = {
+    .read = 0, .write = 1, .exec = 2, 
+    .memtype = 3, /* memory type of a page - bits 5:3, reserved in entries that reference a table */
+    .ps = 7, .accessed = 8, .dirty = 9,
+    .addrstart = 12, .addrend = 51,
+    .reserved_pml4e = 0xF8, // bits 7:3 of a PML4E
+    .reserved_table = 0x78, // bits 6:3 of a PDPTE or PDE that references a table
+    .reserved_1g = 0x3FFFF000, // bits 29:12 of a PDPTE that maps a 1 GiB page
+    .reserved_2m = 0x1FF000 // bits 20:12 of a PDE that maps a 2 MiB page
+};
 
-// Dummy implementation of PREAD_FUNC_64 just for debugging purposes
-unsigned int dbg_read_func_64(void *buf, const unsigned int size, const uint64_t physical_addr) {
-    uint64_t targetData = randbits(size);
-    targetData |= 0x5; // Setting present bit and user access bit
-    *(uint64_t*) buf = targetData;
-    return size;
-}
-#endif
+/* -------------------------------------------------------------------------- */
+/*                                AUX FUNCTIONS                               */
+/* -------------------------------------------------------------------------- */
 
 // Function prints a 4 byte uint in binary
 void printbits(uint64_t value, uint8_t length) {
@@ -235,602 +239,8326 @@ void printerr(TranslationState32 resultState) {
         "PML4E is in supervisor mode and cannot be accessed", // ST_PML4E_SUPERVISOR_MODE_3
         "PML4E MustBeZero bits are set (not zero)", // ST_PML4E_MBZ_32
         "PTE PAT Bit in PAE mode must be unset", // ST_PTE_PAE_PAT_32
-        "PAT bit should be zero in PSE mode" // ST_PDE_PSE_PAT_32
+        "PAT bit should be zero in PSE mode", // ST_PDE_PSE_PAT_32
+        "Virtual address is too wide for the paging mode" // ST_ADDRESS_WIDTH_32
     };
     
     printf("%s", errmsgs[resultState]);
 }
 
 /* -------------------------------------------------------------------------- */
-/*                           MAIN API IMPLEMENTATION                          */
+/*                                 DIAGNOSTICS                                */
 /* -------------------------------------------------------------------------- */
 
-/**
- * @name PREAD_FUNC
- * @param buf
- *  Buffer, that will hold the data, stored at a given physical address in RAM
- * @param size
- *  Amount of data in bytes that will be read from a given physical address in RAM
- * @param physical_addr
- *  4-byte physical memory address
- * @returns unsigned int 
- *  Returns an amount of bytes successfully read from RAM
- * @description:
- *  Function reads certaing amount of data from RAM at a certain address and stores 
- *  that data into a buffer, passed as an arguement. Function returns an amount of bytes, 
- *  successfully read from memory, 0 or less means an out of bounds exception or another error 
- */
-typedef unsigned int (*PREAD_FUNC)(void *buf, const unsigned int size, const unsigned int physical_addr);
+// Kinds of diagnostic events
+typedef enum {
+    DIAG_READ_ERROR, // paging-structure entries could not be read, size is the amount of bytes that were not read
+    DIAG_ENTRY_ERROR, // entry failed its integrity checks, state tells which one
+    DIAG_PTE_NOT_DIRTY, // translation ended in a PTE whose dirty bit is clear
+    DIAG_INCORRECT_LEVEL // va2pa() was called with a level other than 2 or 3, entry holds the level
+} DiagKind;
+
+// Struct represents one diagnostic event
+typedef struct {
+    DiagKind kind;
+    TranslationState32 state;
+    const char *name; // paging structure the entry belongs to ("pml4e", "pdpte", "pde", "pte"), NULL if not known
+    uint64_t addr; // physical address of the entry
+    uint64_t entry; // raw entry value, 0 for read errors
+    unsigned int size; // size of the entry in bytes
+} DiagEvent;
+
+// Diagnostic callback, events are delivered in the thread that caused them
+typedef void (*DIAG_FUNC)(const DiagEvent *event, void *ctx);
+
+// Struct represents a single producer single consumer ring of events filled by one thread
+typedef struct {
+    DiagEvent *events;
+    size_t mask; // capacity - 1, capacity is a power of two
+    size_t head; // next event the producer writes
+    size_t tail; // next event the consumer reads
+    uint64_t dropped; // events lost because the ring was full
+} DiagRing;
+
+static DIAG_FUNC diag_func = NULL;
+static void *diag_ctx = NULL;
+static int diag_consumers = 0; // callback plus bound rings, events are not even built without consumers
+static _Thread_local DiagRing *diag_ring_bound = NULL;
 
 /**
- * @name: PREAD_FUNC_64
+ * @name diag_print
  * @description:
- *  Same as PREAD_FUNC, just read memory address from 64-bit address
+ *  DIAG_FUNC that prints an event the way debug builds always did, it is what debug builds deliver events to
+ *  when there is no other consumer. va2pa_diag_set(diag_print, NULL) prints events in any build
  */
-typedef unsigned int (*PREAD_FUNC_64)(void *buf, const unsigned int size, const uint64_t physical_addr);
+void diag_print(const DiagEvent *event, void *ctx) {
+    (void) ctx;
 
-/**
- * @name va2pa
- * @param virt_addr
- *  4-byte virtual address to be tranlated into physical address
- * @param level
- *  Level of indirection w/ values 2 or 3 which stand for legacy translation and PAE translation respectively
- * @param root_addr
- *  Page directory root address (similar to CR3 register value in x86 architecture)
- * @param read_func
- *  Function pointer that accepts a PREAD_FUNC function that reads a certain amount of physical memory
- * @param phys_addr
- *  Integer pointer that will hold a resulting physical address after a given virtual address is 
- *  successfully translated (output buffer)
- * @returns int
- *  Function returns 0 if translation was carried out succesfully or returns value other than zero if errors occured
- * @description: 
- *  Function performs a translation of a given virtual address into physical address and stores it in an output buffer
- */
-int va2pa(
-    const unsigned int virt_addr, 
-    const unsigned int level, 
-    const unsigned int root_addr, 
-    const PREAD_FUNC read_func, 
-    //unsigned int *phys_addr
-    uint64_t *phys_addr // since PAE translations produce 52-bit physical address
-) {
-    if (level > 3 || level < 2) { // Return error if a wrong level is given
-#ifdef VA2PA_DEBUG_ON
-            printerr(ST_INCORRECT_LEVEL_32);
-#endif
+    switch (event->kind) {
+    case DIAG_READ_ERROR:
+        printerr(ST_RAM_READ_ERROR_32);
+        printf(" at addr: 0x%08llx bytes to read: %u\n", (unsigned long long) event->addr, event->size);
+        break;
+    case DIAG_ENTRY_ERROR:
+        printerr(event->state);
+        printf(" %s: ", event->name);
+        printbits(event->entry, event->size);
+        break;
+    case DIAG_PTE_NOT_DIRTY:
+        printf("WARNING: PTE dirty bit is set\n");
+        break;
+    case DIAG_INCORRECT_LEVEL:
+        printerr(ST_INCORRECT_LEVEL_32);
+        break;
+    }
+}
 
-        return ST_INCORRECT_LEVEL_32;
+// Function appends an event to a ring, an event that does not fit is counted as dropped
+static void diag_ring_push(DiagRing *ring, const DiagEvent *event) {
+    size_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
     }
-    
-#ifdef VA2PA_DEBUG_ON
-        uint32_t void_ptr_token_32 = 0;
-        uint64_t void_ptr_token_64 = 0;
-#endif
 
-    if (level == 2) {
-        // BEGINNING OF LEVEL 2 LEGACY TRANSLATION
+    ring->events[head & ring->mask] = *event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Function delivers an event to the consumers, only called when there are some (or in debug builds)
+static __attribute__((noinline, cold)) void diag_emit(
+    const DiagKind kind, const TranslationState32 state, const char *name,
+    const uint64_t addr, const uint64_t entry, const unsigned int size
+) {
+    DiagEvent event = { kind, state, name, addr, entry, size };
+    DIAG_FUNC func = __atomic_load_n(&diag_func, __ATOMIC_ACQUIRE);
 
-        // Init buffer to read PDE from memory
-        uint32_t* pde = malloc(sizeof(uint32_t));
+    if (diag_ring_bound != NULL) {
+        diag_ring_push(diag_ring_bound, &event);
+    }
 
-        // calculating pde address using CR3 (root addr) and virt_addr
-        uint32_t pde_addr = (root_addr >> CR3Bits32.addrstart) + (virt_addr >> 22) * sizeof(uint32_t);
+    if (func != NULL) {
+        (*func)(&event, __atomic_load_n(&diag_ctx, __ATOMIC_RELAXED));
+    }
 
-        // reading pde data from RAM
-        if ((*read_func)(pde, sizeof(uint32_t), pde_addr) < sizeof(uint32_t)) {
 #ifdef VA2PA_DEBUG_ON
-                printerr(ST_RAM_READ_ERROR_32);
-                printf(" at addr: 0x%08x bytes to read: %lu\n", pde_addr, sizeof(uint32_t));
+    if (diag_ring_bound == NULL && func == NULL) {
+        diag_print(&event, NULL);
+    }
 #endif
+}
 
-            free(pde);
-            return ST_RAM_READ_ERROR_32;
-        }
-
-        // uint32_t *pde = *((uint32_t*) pde); // Casting read PDE data to 4 byte int
-        TranslationState32 PDEIntegrityCheck = ST_SUCCESS_32;
-        
-        if (!(*pde & (1 << PDEBits.present))) {  // if pde present bit is not set
-            PDEIntegrityCheck = ST_PDE_NOT_PRESENT_32;
-        } else if (!(*pde & (1 << PDEBits.uaccess))) { // if pde is in supervisor mode
-            PDEIntegrityCheck = ST_PDE_SUPERVISOR_MODE_32;
-        } else if (*pde & (1 << PDEBits.pse)) { // if pse bit is set
-            // Big page PSE mode is on
-            if (*pde && PDE4MbBits.reserved) {
-                PDEIntegrityCheck = ST_PDE_RESERVED_32;
-            } else if (!(*pde & (1 << PDE4MbBits.pat))) {
-                PDEIntegrityCheck = ST_PDE_PSE_PAT_32;
-            }
-        }
-        
-        // if pde is somehow corrupt
-        if (PDEIntegrityCheck != ST_SUCCESS_32) {
-            // print error and return error code
 #ifdef VA2PA_DEBUG_ON
-                printerr(PDEIntegrityCheck);
-                printf(" pde: ");
-                printbits((uint64_t) *pde, sizeof(uint32_t));
+    #define DIAG_ACTIVE() 1
+#else
+    #define DIAG_ACTIVE() __builtin_expect(__atomic_load_n(&diag_consumers, __ATOMIC_RELAXED) != 0, 0)
 #endif
-            
-            free(pde);
-            return PDEIntegrityCheck;
-        }
 
-        if (*pde & (1 << PDEBits.pse)) { // IF PAGE SIZE EXTENSION IS ON
-            *phys_addr = (*pde & 0xFFC00000) + (virt_addr & 0x3FFFFE);
-            free(pde);
-        } else { // IF PAGE SIZE EXTENSION IS OFF
-            // Getting PTE address from PDE data
-            uint32_t pte_addr = (*pde >> 12) + ((virt_addr >> 12) & 0x3FF) * sizeof(uint32_t);
-            free(pde);
+// Reports a diagnostic event, without consumers this is a single load of diag_consumers
+#define DIAG_EMIT(kind, state, name, addr, entry, size) do { \
+        if (DIAG_ACTIVE()) { \
+            diag_emit((kind), (state), (name), (addr), (entry), (size)); \
+        } \
+    } while (0)
 
-            // Init buffer to read PTE from memory
-            uint32_t* pte = malloc(sizeof(uint32_t));
+/**
+ * @name va2pa_diag_set
+ * @param func
+ *  Callback that receives every diagnostic event of every thread or NULL to detach the current one
+ * @description:
+ *  Function attaches the process-wide diagnostic callback. It is called in the thread that caused an event,
+ *  in addition to the ring bound to that thread. Without a callback and without bound rings diagnostics cost
+ *  nothing but a load of one flag on the paths that detect them
+ */
+void va2pa_diag_set(DIAG_FUNC func, void *ctx) {
+    DIAG_FUNC old = __atomic_exchange_n(&diag_func, NULL, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&diag_ctx, ctx, __ATOMIC_RELAXED);
+    __atomic_store_n(&diag_func, func, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&diag_consumers, (func != NULL) - (old != NULL), __ATOMIC_RELAXED);
+}
 
-            // reading pte data from RAM
-            if ((*read_func)(pte, sizeof(uint32_t), pte_addr) < sizeof(uint32_t)) {
-#ifdef VA2PA_DEBUG_ON
-                    printerr(ST_RAM_READ_ERROR_32);
-                    printf(" at addr: 0x%08x bytes to read: %lu\n", pte_addr, sizeof(uint32_t));
-#endif
+/**
+ * @name diag_ring_create
+ * @param capacity
+ *  Amount of events the ring holds, rounded up to a power of two
+ * @returns DiagRing*
+ *  Returns an empty ring or NULL if memory could not be allocated
+ */
+DiagRing* diag_ring_create(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
 
-                free(pte);
-                return ST_RAM_READ_ERROR_32;
-            }
-            
-            TranslationState32 PTEIntegrityCheck = ST_SUCCESS_32;
+    DiagRing *ring = calloc(1, sizeof(DiagRing));
+    if (ring == NULL) {
+        return NULL;
+    }
 
-            if (!(*pte & (1 << PTEBits.present))) { // if pte present bit is not set
-                PTEIntegrityCheck = ST_PTE_NOT_PRESENT_32;
-            } else if (!(*pte & (1 << PTEBits.uaccess))) { // if pte is in supervisor mode
-                PTEIntegrityCheck = ST_PTE_SUPERVISOR_MODE_32;
-            }
+    ring->events = malloc(size * sizeof(DiagEvent));
+    if (ring->events == NULL) {
+        free(ring);
+        return NULL;
+    }
 
-            // if pte is somehow corrupt
-            if (PTEIntegrityCheck != ST_SUCCESS_32) {
-                // print error and return error code
-#ifdef VA2PA_DEBUG_ON
-                    printerr(PTEIntegrityCheck);
-                    printf(" pte: ");
-                    printbits((uint64_t) *pte, sizeof(uint32_t));
-#endif
+    ring->mask = size - 1;
+    return ring;
+}
 
-                free(pte);
-                return PTEIntegrityCheck;
-            }
-            
-            // Display a warning if a dirty bit is set
-            if (!(*pte & (1 << PTEBits.dirty))) {
-                printf("WARNING: PTE dirty bit is set\n");
-            }
-            
-            // Unsetting 12 least significant bits
-            // And adding offset from virtual address
-            *phys_addr = (uint64_t)((*pte & 0xFFFFF000) + (virt_addr & 0xFFF));
-            free(pte);
-        }
-        
-        // END OF LEVEL 2 LEGACY TRANSLATION
-    } else if (level == 3) {
-        // BEGINNING OF LEVEL 3 PAE TRANSLATION
+// Function frees a ring created by diag_ring_create(), it must not be bound to any thread
+void diag_ring_destroy(DiagRing *ring) {
+    if (ring != NULL) {
+        free(ring->events);
+        free(ring);
+    }
+}
+
+// Function makes the calling thread append its diagnostic events to a given ring, NULL unbinds the current one.
+// A ring is filled by one thread only, unbind it before the thread exits
+void diag_ring_bind(DiagRing *ring) {
+    __atomic_add_fetch(&diag_consumers, (ring != NULL) - (diag_ring_bound != NULL), __ATOMIC_RELAXED);
+    diag_ring_bound = ring;
+}
 
-        // Init buffer to read PDPTE data from memory
-        uint64_t* pdpte = malloc(sizeof(uint64_t));
+/**
+ * @name diag_ring_drain
+ * @description:
+ *  Function moves up to max of the oldest events of a ring into an array and returns their amount. It may run in
+ *  any thread while the producer keeps appending, but only in one thread at a time. Lost events are in ring->dropped
+ */
+size_t diag_ring_drain(DiagRing *ring, DiagEvent *events, const size_t max) {
+    size_t tail = ring->tail;
+    size_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    size_t count = available < max ? available : max;
 
-        // calculating pde address using CR3 (root addr) and virt_addr
-        uint64_t pdpte_addr = (root_addr >> CR3BitsPAE.addrstart) + (virt_addr >> 30) * sizeof(uint64_t);
+    for (size_t i = 0; i < count; i++) {
+        events[i] = ring->events[(tail + i) & ring->mask];
+    }
 
-        // Reading pdpte data from memory
-        if ((*read_func)(pdpte, sizeof(uint64_t), pdpte_addr) < sizeof(uint64_t)) {
-#ifdef VA2PA_DEBUG_ON
-                printerr(ST_RAM_READ_ERROR_32);
-                printf(" at addr: 0x%08llx bytes to read: %lu\n", pdpte_addr, sizeof(uint64_t));
-#endif
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+    return count;
+}
 
-            free(pdpte);
-            return ST_RAM_READ_ERROR_32;
-        }
-        
-        TranslationState32 PDPTEIntegrityCheck = ST_SUCCESS_32;
+/* -------------------------------------------------------------------------- */
+/*                                 STATISTICS                                 */
+/* -------------------------------------------------------------------------- */
 
-        if (!(*pdpte & (1 << PDPTEBits.present))) { // Check if present
-            PDPTEIntegrityCheck = ST_PDPTE_NOT_PRESENT_32; 
-        } 
-        
-        if (*pdpte & PDPTEBits.reserved) { // Check if any of the reserved bits are set
-            PDPTEIntegrityCheck = ST_PDPTE_RESERVED_32;
-        }
+#define STATS_STATES (ST_ADDRESS_WIDTH_32 + 1) // Amount of TranslationState32 codes
+#define STATS_PAGE_SIZES 4 // 4 KiB, 2 MiB, 4 MiB and 1 GiB pages
+#define STATS_LATENCY_BUCKETS 32 // Bucket N counts calls that took 2^N to 2^(N+1) - 1 ticks, the last one everything longer
 
-        // if pdpte is somehow corrupt
-        if (PDPTEIntegrityCheck != ST_SUCCESS_32) {
-            // display an error message and return error code
-#ifdef VA2PA_DEBUG_ON
-                printerr(PDPTEIntegrityCheck);
-                printf(" pdpte: ");
-                printbits(*pdpte, sizeof(uint64_t));
+// Latency of every VA2PA_STATS_SAMPLE-th call of a thread is measured, reading the clock costs more than a cached translation
+#ifndef VA2PA_STATS_SAMPLE
+    #define VA2PA_STATS_SAMPLE 64
 #endif
-            
-            free(pdpte);
-            return PDPTEIntegrityCheck;
-        }
 
-        // Calculating PDE address from PDPTE data
-        uint64_t pde_addr_pae = ((*pdpte >> 12) & 0xFFFFFFFFFF) + ((virt_addr >> 21) & 0x1FF) * sizeof(uint64_t);
-        free(pdpte);
+// Translation caches statistics are kept for
+typedef enum {
+    STATS_TLB, // TranslationCache translations
+    STATS_PSC_PML4E, // TranslationCache paging-structure caches, same order as PSCKind
+    STATS_PSC_PDPTE,
+    STATS_PSC_PDE,
+    STATS_BATCH, // entries va2pa_64_batch() and va2pa_64_range() reused from the previous address they translated
+    STATS_FCACHE, // FrameCache frames
+    STATS_SHARED, // SharedCache translations
+    STATS_TAGGED, // TaggedCache translations, its PML4Es are counted under STATS_PSC_PML4E
+    STATS_CACHES
+} StatsCache;
+
+// Calls latency is measured for
+typedef enum {
+    STATS_CALL_WALK, // va2pa(), va2pa_64() and the functions defined with VA2PA_SPECIALIZE / VA2PA_64_SPECIALIZE
+    STATS_CALL_CACHED, // va2pa_cached(), va2pa_64_cached(), va2pa_shared(), va2pa_64_shared() and va2pa_64_tagged()
+    STATS_CALL_IMAGE, // va2pa_image() and va2pa_64_image()
+    STATS_CALL_BATCH, // va2pa_64_batch() and va2pa_64_image_batch(), one sample per batch
+    STATS_CALL_ASYNC, // va2pa_async(), one sample per call
+    STATS_CALL_NESTED, // va2pa_nested()
+    STATS_CALLS
+} StatsCall;
 
-        // Init buffer to read PDE data from memory
-        uint64_t* pde_pae = malloc(sizeof(uint64_t));
+// Struct represents translation statistics, every field is a uint64_t counter
+typedef struct {
+    uint64_t reads[4]; // backend reads of paging-structure entries by depth, 0 is the structure the root points to
+    uint64_t hits[STATS_CACHES];
+    uint64_t misses[STATS_CACHES];
+    uint64_t states[STATS_STATES]; // translations by result code
+    uint64_t pages[STATS_PAGE_SIZES]; // successful translations by the size of the page they ended in
+    uint64_t latency[STATS_CALLS][STATS_LATENCY_BUCKETS]; // sampled calls, rdtsc ticks on x86 and nanoseconds elsewhere
+} TranslationStats;
 
-        // Reading PDE data from memory
-        if ((*read_func)(pde_pae, sizeof(uint64_t), pde_addr_pae) < sizeof(uint64_t)) {
-#ifdef VA2PA_DEBUG_ON
-                printerr(ST_RAM_READ_ERROR_32);
-                printf(" at addr: 0x%08llx bytes to read: %lu\n", pde_addr_pae, sizeof(uint64_t));
-#endif
+#ifdef VA2PA_STATS_ON
+// Struct represents the counters of one thread, registered in stats_threads while the thread is alive
+typedef struct StatsThread {
+    TranslationStats stats;
+    struct StatsThread *next;
+} StatsThread;
 
-            free(pde_pae);
-            return ST_RAM_READ_ERROR_32;
-        }
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static StatsThread *stats_threads; // counters of the live threads
+static TranslationStats stats_retired; // counters of the threads that exited
+static _Thread_local StatsThread *stats_thread;
+static _Thread_local TranslationStats stats_lost; // counts of a thread whose counters could not be allocated
+static _Thread_local unsigned int stats_countdown; // calls until the next latency sample
 
-        TranslationState32 PDEIntegrityCheckPAE = ST_SUCCESS_32;
+// Function adds a block of counters to another one, a counter is only ever written by the thread that owns it
+static void stats_sum(TranslationStats *total, const TranslationStats *stats) {
+    uint64_t *dst = (uint64_t*) total;
+    const uint64_t *src = (const uint64_t*) stats;
 
-        if (!(*pde_pae & (1 << PDEBitsPAE.present))) { // Check if present
-            PDEIntegrityCheckPAE = ST_PDE_NOT_PRESENT_32; 
-        } else if (!(*pde_pae & (1 << PDEBitsPAE.uaccess))) { // Check if accessible by user
-            PDEIntegrityCheckPAE = ST_PDE_SUPERVISOR_MODE_32;
-        } 
-        
-        if (*pde_pae & (1 << PDEBitsPAE.pse)) { // Check if page size is not extended
-            if (*pde_pae & PDE2MbBits.reserved) {
-                PDEIntegrityCheckPAE = ST_PDE_RESERVED_32;
-            } else if (!(*pde_pae & (1 << PDE2MbBits.pat))) {
-                PDEIntegrityCheckPAE = ST_PDE_PSE_PAT_32;
-            }
-        } else if (*pde_pae & PDEBitsPAE.reserved) { // Check if any of the reserved bits are set
-            PDEIntegrityCheckPAE = ST_PDE_RESERVED_32;
-        }
+    for (size_t i = 0; i < sizeof(TranslationStats) / sizeof(uint64_t); i++) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
 
-        // If PDE is somehow corrupt
-        if (PDEIntegrityCheckPAE != ST_SUCCESS_32) {
-            // Display an error message and return error code
-#ifdef VA2PA_DEBUG_ON
-                printerr(PDEIntegrityCheckPAE);
-                printf(" pde: ");
-                printbits(*pde_pae, sizeof(uint64_t));
-#endif
+// Destructor of stats_key, moves the counters of an exiting thread into stats_retired
+static void stats_retire(void *ptr) {
+    StatsThread *thread = ptr;
 
-            free(pde_pae);
-            return PDEIntegrityCheckPAE;
+    pthread_mutex_lock(&stats_lock);
+    for (StatsThread **link = &stats_threads; *link != NULL; link = &(*link)->next) {
+        if (*link == thread) {
+            *link = thread->next;
+            break;
         }
+    }
 
-        if (*pde_pae & (1 << PDEBitsPAE.pse)) { // IF PAGE SIZE EXTENSION IS ENABLED (2Mb Page Directory Entry)
-            *phys_addr = (*pde_pae & 0xFFFFFFFE00000) + (virt_addr & 0x1FFFFF);
-            free(pde_pae);
-        } else { // IF PAGE SIZE EXTENSION IS DISABLED
-             // Calculating PTE address from PDE data
-            uint64_t pte_addr_pae = ((*pde_pae >> 12) & 0xFFFFFFFFFF) + ((virt_addr >> 12) & 0x1FF) * sizeof(uint64_t);
-            free(pde_pae);
+    stats_sum(&stats_retired, &thread->stats);
+    pthread_mutex_unlock(&stats_lock);
 
-            // Init buffer to read PTE from memory
-            uint64_t* pte_pae = malloc(sizeof(uint64_t));
+    stats_thread = NULL; // destructors run in the exiting thread, a later translation registers it again
+    free(thread);
+}
 
-            // Reading PTE data from memory
-            if ((*read_func)(pte_pae, sizeof(uint64_t), pte_addr_pae) < sizeof(uint64_t)) {
-#ifdef VA2PA_DEBUG_ON
-                    printerr(ST_RAM_READ_ERROR_32);
-                    printf(" at addr: 0x%08llx bytes to read: %lu\n", pte_addr_pae, sizeof(uint64_t));
-#endif
-                
-                free(pte_pae);
-                return ST_RAM_READ_ERROR_32;
-            }
+static void stats_init(void) {
+    pthread_key_create(&stats_key, stats_retire);
+}
 
-            TranslationState32 PTEIntegrityCheckPAE = ST_SUCCESS_32;
+// Function registers the counters of the calling thread on its first use
+static TranslationStats* stats_register(void) {
+    pthread_once(&stats_once, stats_init);
 
-            if (!(*pte_pae & (1 << PTEBitsPAE.present))) { // Check if present
-                PTEIntegrityCheckPAE = ST_PTE_NOT_PRESENT_32; 
-            } else if (!(*pte_pae & (1 << PTEBitsPAE.uaccess))) { // Check if accessible by user
-                PTEIntegrityCheckPAE = ST_PDE_SUPERVISOR_MODE_32;
-            } else if (!(*pte_pae & (1 << PTEBitsPAE.pat))) { // Check if PAT bit is resereved
-                PTEIntegrityCheckPAE = ST_PTE_PAE_PAT_32;
-            } 
-            
-            if (*pte_pae & PTEBitsPAE.reserved) { // Check if any of the reserved bits are set
-                PTEIntegrityCheckPAE = ST_PTE_RESERVED_32;
-            }
+    StatsThread *thread = calloc(1, sizeof(StatsThread));
+    if (thread == NULL || pthread_setspecific(stats_key, thread) != 0) {
+        free(thread);
+        return &stats_lost;
+    }
 
-            // If PTE is somehow corrupt
-            if (PTEIntegrityCheckPAE != ST_SUCCESS_32) {
-                // Dispaly an error message and return error code
-#ifdef VA2PA_DEBUG_ON
-                    printerr(PTEIntegrityCheckPAE);
-                    printf(" pte: ");
-                    printbits(*pte_pae, sizeof(uint64_t));
-#endif
-                
-                free(pte_pae);
-                return PTEIntegrityCheckPAE;
-            }
+    pthread_mutex_lock(&stats_lock);
+    thread->next = stats_threads;
+    stats_threads = thread;
+    pthread_mutex_unlock(&stats_lock);
 
-            // Display a warning if a dirty bit is set
-#ifdef VA2PA_DEBUG_ON
-                if (!(*pte_pae & (1 << PTEBitsPAE.dirty))) {
-                    printf("WARNING: PTE dirty bit is set\n");
-                }
-#endif
-            
-            // Unsetting 12 least significant bits
-            // And adding offset from virtual address
-            *phys_addr = (*pte_pae & 0xFFFFFFFFFFFFF000) + (virt_addr & 0xFFF);
-            free(pte_pae);
-        }
-        // END OF LEVEL 3 PAE TRANSLATION
-    }
+    stats_thread = thread;
+    return &thread->stats;
+}
 
-    // return successfull result
-    return ST_SUCCESS_32;
+static inline TranslationStats* stats_local(void) {
+    return __builtin_expect(stats_thread != NULL, 1) ? &stats_thread->stats : stats_register();
 }
 
-/**
- * @name: va2pa_64
- * @description:
- *  Same as va2pa, only for 64 but translation with 64-bit CR3, 64-bit return physical address buffer and
- *  64-bit PREAD_FUNC_64 instead of PREAD_FUNC to read from RAM 
- */
-uint8_t va2pa_64(
-    const uint64_t virt_addr_64, 
-    const uint64_t root_addr_64, 
-    const PREAD_FUNC_64 read_func_64, 
-    uint64_t *phys_addr_64
-) {
-#ifdef VA2PA_DEBUG_ON
-        uint32_t void_ptr_token_32 = 0;
-        uint64_t void_ptr_token_64 = 0;
+// Relaxed atomics keep va2pa_stats_snapshot() from racing with the owner, on x86 they are plain loads and stores
+static inline void stats_add(uint64_t *counter, const uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_clock(void) {
+#ifdef VA2PA_X86
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 #endif
+}
+
+// Function returns the clock at the beginning of a call whose latency is sampled and 0 otherwise
+static inline uint64_t stats_start(void) {
+    if (stats_countdown-- != 0) {
+        return 0;
+    }
 
-    // Init buffer to read PML4E data from memory
-    uint64_t* pml4e = malloc(sizeof(uint64_t));
+    stats_countdown = VA2PA_STATS_SAMPLE - 1;
+    return stats_clock();
+}
 
-    // calculation pml4e address using CR3 and virt_addr
-    uint64_t pml4e_addr = ((root_addr_64 >> CR3Bits64.addrstart) & 0xFFFFFFFFFF) + ((virt_addr_64 >> 39) & 0x1FF) * sizeof(uint64_t);
+// Function counts the result of a translation and the size of the page a successful one ended in
+static inline void stats_translation(const int state, const uint8_t page_shift) {
+    TranslationStats *stats = stats_local();
 
-    // Reading pml4e data from memory
-    if ((*read_func_64)(pml4e, sizeof(uint64_t), pml4e_addr) < sizeof(uint64_t)) {
-#ifdef VA2PA_DEBUG_ON
-            printerr(ST_RAM_READ_ERROR_32);
-            printf(" at addr: 0x%08llx bytes to read: %lu\n", pml4e_addr, sizeof(uint64_t));
-#endif
-            free(pml4e);
-            return ST_RAM_READ_ERROR_32;
-        
+    if (state >= 0 && state < STATS_STATES) {
+        stats_add(&stats->states[state], 1);
     }
 
-    TranslationState32 PML4EIntegrityCheck = ST_SUCCESS_32;
-
-    if (!(*pml4e & (1 << PML4EBits.present))) { // Check if present
-        PML4EIntegrityCheck = ST_PDPTE_NOT_PRESENT_32; 
-    } else if (!(*pml4e & (1 << PML4EBits.uaccess))) { // Check if accessible by user
-        PML4EIntegrityCheck = ST_PDE_SUPERVISOR_MODE_32;
-    } else if (*pml4e & PML4EBits.mbz) {
-        PML4EIntegrityCheck = ST_PML4E_MBZ_32;
+    if (state == ST_SUCCESS_32 && page_shift != 0) {
+        stats_add(&stats->pages[page_shift == 12 ? 0 : page_shift == 21 ? 1 : page_shift == 22 ? 2 : 3], 1);
     }
+}
 
-    // If PDE is somehow corrupt
-    if (PML4EIntegrityCheck != ST_SUCCESS_32) {
-        // Display an error message and return error code
-#ifdef VA2PA_DEBUG_ON
-            printerr(PML4EIntegrityCheck);
-            printf(" pde: ");
-            printbits(*pml4e, sizeof(uint64_t));
-#endif
-        
-        free(pml4e);
-        return PML4EIntegrityCheck;
+// Function adds the ticks elapsed since start to the latency histogram of a call if the call was sampled
+static inline void stats_latency(const StatsCall call, const uint64_t start) {
+    if (start == 0) {
+        return;
     }
 
-    // Init buffer to read PDPTE data from memory
-    uint64_t* pdpte = malloc(sizeof(uint64_t));
+    uint64_t ticks = stats_clock() - start;
+    unsigned int bucket = 63 - __builtin_clzll(ticks | 1);
 
-    // calculating pdpte address using PML4E and virt_addr
-    uint64_t pdpte_addr = ((*pml4e >> PML4EBits.addrstart) & 0xFFFFFFFFFF) + ((virt_addr_64 >> 30) & 0x1FF) * sizeof(uint64_t);
-    free(pml4e);
+    stats_add(&stats_local()->latency[call][bucket < STATS_LATENCY_BUCKETS ? bucket : STATS_LATENCY_BUCKETS - 1], 1);
+}
 
-    // Reading pdpte data from memory
-    if ((*read_func_64)(pdpte, sizeof(uint64_t), pdpte_addr) < sizeof(uint64_t)) {
-#ifdef VA2PA_DEBUG_ON
-            printerr(ST_RAM_READ_ERROR_32);
-            printf(" at addr: 0x%08llx bytes to read: %lu\n", pdpte_addr, sizeof(uint64_t));
+    #define STATS_ADD(field, n) stats_add(&stats_local()->field, (n))
+    #define STATS_CALL_BEGIN() uint64_t stats_begin = stats_start()
+    #define STATS_LATENCY(call) stats_latency((call), stats_begin)
+    #define STATS_TRANSLATION(state, page_shift) stats_translation((state), (page_shift))
+#else
+    #define STATS_ADD(field, n)
+    #define STATS_CALL_BEGIN()
+    #define STATS_LATENCY(call)
+    #define STATS_TRANSLATION(state, page_shift)
 #endif
-        
-        free(pdpte);
-        return ST_RAM_READ_ERROR_32;
-    }
 
-    TranslationState32 PDPTEIntegrityCheck = ST_SUCCESS_32;
+#define STATS_CALL_END(call, state, page_shift) do { \
+        STATS_TRANSLATION((state), (page_shift)); \
+        STATS_LATENCY(call); \
+    } while (0)
 
-    if (!(*pdpte & (1 << PDPTEBits.present))) { // Check if present
-        PDPTEIntegrityCheck = ST_PDPTE_NOT_PRESENT_32; 
-    } 
+/**
+ * @name va2pa_stats_snapshot
+ * @param stats
+ *  Output buffer for the sum of the counters of every thread that ever translated an address
+ * @returns uint8_t
+ *  Returns 1 if the statistics were collected and 0 if they are compiled out (build with -DVA2PA_STATS_ON)
+ * @description:
+ *  Function sums the counters of the live threads and of the threads that exited. Counters only grow,
+ *  statistics of a workload are the difference of snapshots taken before and after it. Counters of a thread
+ *  that is translating while the snapshot is taken may be a few events behind
+ */
+uint8_t va2pa_stats_snapshot(TranslationStats *stats) {
+    memset(stats, 0, sizeof(TranslationStats));
 
-    if (*pdpte & (1 << PDPTEBits.pse)) { // If PSE is enabled
-        if (*pdpte & PDPTEBits.reserved64PSE) { // Check if any of the reserved bits are set
-            PDPTEIntegrityCheck = ST_PDPTE_RESERVED_32;
-        }
-    }
+#ifdef VA2PA_STATS_ON
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(stats, &stats_retired);
 
-    // if pdpte is somehow corrupt
-    if (PDPTEIntegrityCheck != ST_SUCCESS_32) {
-        // display an error message and return error code
-#ifdef VA2PA_DEBUG_ON
-            printerr(PDPTEIntegrityCheck);
-            printf(" pdpte: ");
-            printbits(*pdpte, sizeof(uint64_t));
-#endif
-        
-        free(pdpte);
-        return PDPTEIntegrityCheck;
+    for (const StatsThread *thread = stats_threads; thread != NULL; thread = thread->next) {
+        stats_sum(stats, &thread->stats);
     }
 
-    if (*pdpte & (1 << PDPTEBits.pse)) { // IF 1Gb PDPE PSE IS ENABLE IN LONG MODE
-        *phys_addr_64 = (*pdpte & 0xFFFFFC0000000) + (virt_addr_64 & 0x3FFFFFFF);
-        free(pdpte);
-    } else { // IF 1Gb PDPE PSE IS DISABLED
-         // Calculating PDE address from PDPTE data
-        uint64_t pde_addr_64 = ((*pdpte >> 12) & 0xFFFFFFFFFF) + ((virt_addr_64 >> 21) & 0x1FF) * sizeof(uint64_t);
-        free(pdpte);
-
-        // Init buffer to read PDE data from memory
-        uint64_t* pde_64 = malloc(sizeof(uint64_t));
-
-        // Reading PDE data from memory
-        if ((*read_func_64)(pde_64, sizeof(uint64_t), pde_addr_64) <= 0) {
-#ifdef VA2PA_DEBUG_ON
-                printerr(ST_RAM_READ_ERROR_32);
-                printf(" at addr: 0x%08llx bytes to read: %lu\n", pde_addr_64, sizeof(uint64_t));
+    pthread_mutex_unlock(&stats_lock);
+    return 1;
+#else
+    return 0;
 #endif
-            
-            free(pde_64);
-            return ST_RAM_READ_ERROR_32;
-        }
-
-        TranslationState32 PDEIntegrityCheckPAE = ST_SUCCESS_32;
+}
 
-        if (!(*pde_64 & (1 << PDEBitsPAE.present))) { // Check if present
-            PDEIntegrityCheckPAE = ST_PDPTE_NOT_PRESENT_32; 
-        } else if (!(*pde_64 & (1 << PDEBitsPAE.uaccess))) { // Check if accessible by user
-            PDEIntegrityCheckPAE = ST_PDE_SUPERVISOR_MODE_32;
-        } 
-        
-        if (*pde_64 & (1 << PDEBitsPAE.pse)) { // Check if page size is not extended
-            if (*pde_64 & PDE2MbBits.reserved) {
-                PDEIntegrityCheckPAE = ST_PDE_RESERVED_32;
-            }
-        } else {
-            if (*pde_64 & PDEBitsPAE.reserved) { // Check if any of the reserved bits are set
-                PDEIntegrityCheckPAE = ST_PDE_RESERVED_32;
-            }
-        }
+/* -------------------------------------------------------------------------- */
+/*                             TRANSLATION CACHES                             */
+/* -------------------------------------------------------------------------- */
 
-        // If PDE is somehow corrupt
-        if (PDEIntegrityCheckPAE != ST_SUCCESS_32) {
-            // Display an error message and return error code
-#ifdef VA2PA_DEBUG_ON
-                printerr(PDEIntegrityCheckPAE);
-                printf(" pde: ");
-                printbits(*pde_64, sizeof(uint64_t));
-#endif
+#define TLB_DEFAULT_ENTRIES 256 // Default amount of cached translations
+#define TLB_DEFAULT_WAYS 4 // Default associativity of a TLB set
+#define PSC_DEFAULT_ENTRIES 32 // Default amount of entries in each paging-structure cache
 
-            free(pde_64);
-            return PDEIntegrityCheckPAE;
-        }
+// Struct represents a single cached translation
+typedef struct {
+    uint64_t root; // root_addr / root_addr_64 that the translation was walked from
+    uint64_t vpn; // virtual page number (virtual address >> page_shift)
+    uint64_t frame; // physical address of the beginning of the page
+    uint32_t stamp; // last time the entry was used, for LRU replacement inside a set
+    uint8_t level; // 2 or 3 for va2pa() translations, 4 for va2pa_64() translations
+    uint8_t page_shift; // 12 for 4 KiB, 21 for 2 MiB, 22 for 4 MiB and 30 for 1 GiB pages
+    uint8_t valid;
+} TLBEntry;
 
-        if (*pde_64 & (1 << PDEBitsPAE.pse)) { // IF PSE IS ENABLED FOR LONG MODE 2Mb PDE
-            *phys_addr_64 = (*pde_64 & 0xFFFFFFFE00000) + (virt_addr_64 & 0x1FFFFE);
-            free(pde_64);
-        } else { // IF PSE FOR LONG MODE PDE IS DISABLED
-            // Calculatin PTE address from PDE data
-            uint64_t pte_addr_64 = ((*pde_64 >> 12) & 0xFFFFFFFFFF) + ((virt_addr_64 >> 12) & 0x1FF) * sizeof(uint64_t);
-            free(pde_64);
+// Kinds of paging-structure caches, each one holds entries of a single paging structure
+typedef enum {
+    PSC_PML4E, // PML4Es, tagged with virtual address bits 47:39
+    PSC_PDPTE, // PDPTEs, tagged with virtual address bits 47:30 (31:30 in PAE)
+    PSC_PDE, // PDEs, tagged with virtual address bits 47:21 (31:21 in PAE, 31:22 in Legacy)
+    PSC_KINDS
+} PSCKind;
 
-            // Init buffer to read PTE from memory
-            uint64_t* pte_64 = malloc(sizeof(uint64_t));
+// Struct represents a cached paging-structure entry that references the next paging structure
+typedef struct {
+    uint64_t root; // root_addr / root_addr_64 the entry was reached from
+    uint64_t tag; // virtual address bits translated by this entry and the entries above it
+    uint64_t entry; // entry value, it passed all integrity checks when it was cached
+    uint32_t stamp;
+    uint8_t level; // 2, 3 or 4, same as in TLBEntry
+    uint8_t valid;
+} PSCEntry;
 
-            // Reading PTE data from memory
-            if ((*read_func_64)(pte_64, sizeof(uint64_t), pte_addr_64) < sizeof(uint64_t)) {
-#ifdef VA2PA_DEBUG_ON
-                    printerr(ST_RAM_READ_ERROR_32);
-                    printf(" at addr: 0x%08llx bytes to read: %lu\n", pte_addr_64, sizeof(uint64_t));
-#endif
+// Struct represents a set-associative translation cache that sits in front of va2pa() and va2pa_64()
+typedef struct {
+    TLBEntry *entries; // sets * ways entries, ways of a set are adjacent
+    unsigned int sets; // power of two
+    unsigned int ways;
+    uint32_t clock; // LRU clock, incremented on every lookup
+    uint64_t page_shifts; // bit N is set if entries with page_shift N may be cached
+    uint64_t hits, misses;
 
-                free(pte_64);
-                return ST_RAM_READ_ERROR_32;
-            }
+    PSCEntry *psc[PSC_KINDS]; // paging-structure caches, NULL if disabled
+    unsigned int psc_sets; // power of two, every paging-structure cache has psc_sets * ways entries
+    uint64_t psc_hits, psc_misses;
+} TranslationCache;
 
-            TranslationState32 PTEIntegrityCheckPAE = ST_SUCCESS_32;
+// Page sizes each level of translation can end in, most common first
+static const uint8_t TLBPageShifts[5][4] = {
+    [2] = { 12, 22 }, // Legacy: 4 KiB and 4 MiB (PSE) pages
+    [3] = { 12, 21 }, // PAE: 4 KiB and 2 MiB pages
+    [4] = { 12, 21, 30 } // Long mode: 4 KiB, 2 MiB and 1 GiB pages
+};
 
-            if (!(*pte_64 & (1 << PTEBitsPAE.present))) { // Check if present
-                PTEIntegrityCheckPAE = ST_PDPTE_NOT_PRESENT_32; 
-            } else if (!(*pte_64 & (1 << PTEBitsPAE.uaccess))) { // Check if accessible by user
-                PTEIntegrityCheckPAE = ST_PDE_SUPERVISOR_MODE_32;
-            } else if (!(*pte_64 & (1 << PTEBitsPAE.pat))) { // Check if PAT bit is resereved
-                PTEIntegrityCheckPAE = ST_PTE_PAE_PAT_32;
-            }
-            
-            if (*pte_64 & PTEBitsPAE.reserved) { // Check if any of the reserved bits are set
-                PTEIntegrityCheckPAE = ST_PTE_RESERVED_32;
-            }
+// Amount of virtual address bits below the tag of each paging-structure cache
+static const uint8_t PSCTagShifts[5][PSC_KINDS] = {
+    [2] = { 0, 0, 22 },
+    [3] = { 0, 30, 21 },
+    [4] = { 39, 30, 21 }
+};
 
-            // If PTE is somehow corrupt
-            if (PTEIntegrityCheckPAE != ST_SUCCESS_32) {
-                // Dispaly an error message and return error code
-#ifdef VA2PA_DEBUG_ON
-                    printerr(PTEIntegrityCheckPAE);
-                    printf(" pte: ");
-                    printbits(*pte_64, sizeof(uint64_t));
-#endif
+// Function mixes a root address and a key discriminator into a set index offset
+static inline uint64_t tcache_salt(uint64_t root, uint8_t discriminator) {
+    return (((root >> 5) ^ discriminator) * 0x9E3779B97F4A7C15ULL) >> 32;
+}
 
-                free(pte_64);
-                return PTEIntegrityCheckPAE;
-            }
+// Function picks a TLB set for a virtual page of a given size in a given address space
+static inline TLBEntry* tcache_set(const TranslationCache *tc, uint64_t root, uint64_t vpn, uint8_t page_shift) {
+    // Adjacent pages land in adjacent sets, root and page size only scramble the starting point
+    unsigned int set = (unsigned int)((vpn ^ tcache_salt(root, page_shift)) & (tc->sets - 1));
+    return &tc->entries[set * tc->ways];
+}
 
-            // Display a warning if a dirty bit is set
-#ifdef VA2PA_DEBUG_ON
-                if (!(*pte_64 & (1 << PTEBitsPAE.dirty))) {
-                    printf("WARNING: PTE dirty bit is set\n");
-                }
-#endif
+// Function picks a set of a paging-structure cache for a given tag in a given address space
+static inline PSCEntry* psc_set(const TranslationCache *tc, PSCKind kind, uint64_t root, uint64_t tag) {
+    unsigned int set = (unsigned int)((tag ^ tcache_salt(root, kind)) & (tc->psc_sets - 1));
+    return &tc->psc[kind][set * tc->ways];
+}
 
-            // Unsetting 12 least significant bits
-            // And adding offset from virtual address
-            *phys_addr_64 = (*pte_64 & 0xFFFFFFFFFFFFF000) + (virt_addr_64 & 0xFFF);
-            free(pte_64);
-        }
+// Function rounds an amount of entries up to a power of two amount of sets of a given size
+static unsigned int tcache_sets_for(unsigned int entries, unsigned int ways) {
+    unsigned int sets = 1;
+    while (sets * ways < entries) {
+        sets <<= 1;
     }
 
-    // Return successful result code
-    return ST_SUCCESS_32;
+    return sets;
 }
 
-#ifdef VA2PA_DEBUG_ON
-int main(int argc, char* argv[]) {
-    srand(time(NULL));
+// Function frees a cache created by tcache_create()
+void tcache_destroy(TranslationCache *tc) {
+    if (tc == NULL) {
+        return;
+    }
 
-    PREAD_FUNC read32 = &dbg_read_func;
-    PREAD_FUNC_64 read64 = &dbg_read_func_64;
-    
-    uint64_t* paddr_32 = malloc(sizeof(uint64_t));
+    for (int kind = 0; kind < PSC_KINDS; kind++) {
+        free(tc->psc[kind]);
+    }
 
-    int tempres = 0;
+    free(tc->entries);
+    free(tc);
+}
 
-    printf("------------- LEVEL 2 -------------\n\n");
-    for (int i = 0; i < 5; i++) {
-        tempres = va2pa(randbits(2), 2, randbits(2), read32, paddr_32);
-        if (tempres == 0) {
-            printf("Physical address: 0x%llX\n", *paddr_32);
+/**
+ * @name tcache_create
+ * @param entries
+ *  Total amount of translations the cache can hold (0 for TLB_DEFAULT_ENTRIES)
+ * @param ways
+ *  Amount of entries per set (0 for TLB_DEFAULT_WAYS)
+ * @param psc_entries
+ *  Amount of entries in each of the PML4E, PDPTE and PDE caches (0 disables paging-structure caching)
+ * @returns TranslationCache*
+ *  Returns a new empty cache or NULL if memory could not be allocated
+ * @description:
+ *  Function creates a translation cache to be passed to va2pa_cached() and va2pa_64_cached().
+ *  The amount of sets (entries / ways) is rounded up to a power of two. Paging-structure caches
+ *  remember validated upper-level entries so a TLB miss only reads the levels below the deepest cached one
+ */
+TranslationCache* tcache_create(unsigned int entries, unsigned int ways, unsigned int psc_entries) {
+    if (entries == 0) {
+        entries = TLB_DEFAULT_ENTRIES;
+    }
+
+    if (ways == 0) {
+        ways = TLB_DEFAULT_WAYS;
+    }
+
+    TranslationCache *tc = calloc(1, sizeof(TranslationCache));
+    if (tc == NULL) {
+        return NULL;
+    }
+
+    tc->sets = tcache_sets_for(entries, ways);
+    tc->ways = ways;
+    tc->entries = calloc((size_t) tc->sets * ways, sizeof(TLBEntry));
+    if (tc->entries == NULL) {
+        tcache_destroy(tc);
+        return NULL;
+    }
+
+    if (psc_entries != 0) {
+        tc->psc_sets = tcache_sets_for(psc_entries, ways);
+
+        for (int kind = 0; kind < PSC_KINDS; kind++) {
+            tc->psc[kind] = calloc((size_t) tc->psc_sets * ways, sizeof(PSCEntry));
+            if (tc->psc[kind] == NULL) {
+                tcache_destroy(tc);
+                return NULL;
+            }
+        }
+    }
+
+    return tc;
+}
+
+// Function drops every cached translation and paging-structure entry of a given address space that covers a given virtual address
+void tcache_flush_page(TranslationCache *tc, const uint64_t root_addr, const uint64_t virt_addr) {
+    for (uint8_t page_shift = 12; page_shift <= 30; page_shift++) {
+        if (!(tc->page_shifts & (1ULL << page_shift))) {
+            continue;
+        }
+
+        uint64_t vpn = virt_addr >> page_shift;
+        TLBEntry *set = tcache_set(tc, root_addr, vpn, page_shift);
+
+        for (unsigned int way = 0; way < tc->ways; way++) {
+            if (set[way].valid && set[way].root == root_addr && 
+                set[way].page_shift == page_shift && set[way].vpn == vpn) {
+                set[way].valid = 0;
+            }
+        }
+    }
+
+    if (tc->psc_sets == 0) {
+        return;
+    }
+
+    for (uint8_t level = 2; level <= 4; level++) {
+        for (int kind = 0; kind < PSC_KINDS; kind++) {
+            if (PSCTagShifts[level][kind] == 0) {
+                continue;
+            }
+
+            uint64_t tag = virt_addr >> PSCTagShifts[level][kind];
+            PSCEntry *set = psc_set(tc, kind, root_addr, tag);
+
+            for (unsigned int way = 0; way < tc->ways; way++) {
+                if (set[way].valid && set[way].root == root_addr && 
+                    set[way].level == level && set[way].tag == tag) {
+                    set[way].valid = 0;
+                }
+            }
         }
-        printf("\n");
     }
+}
+
+// Function drops every cached translation and paging-structure entry that was reached from a given root
+void tcache_flush_root(TranslationCache *tc, const uint64_t root_addr) {
+    for (size_t i = 0; i < (size_t) tc->sets * tc->ways; i++) {
+        if (tc->entries[i].root == root_addr) {
+            tc->entries[i].valid = 0;
+        }
+    }
+
+    for (int kind = 0; kind < PSC_KINDS && tc->psc_sets != 0; kind++) {
+        for (size_t i = 0; i < (size_t) tc->psc_sets * tc->ways; i++) {
+            if (tc->psc[kind][i].root == root_addr) {
+                tc->psc[kind][i].valid = 0;
+            }
+        }
+    }
+}
+
+// Function drops every cached translation and paging-structure entry
+void tcache_flush_all(TranslationCache *tc) {
+    for (size_t i = 0; i < (size_t) tc->sets * tc->ways; i++) {
+        tc->entries[i].valid = 0;
+    }
+
+    for (int kind = 0; kind < PSC_KINDS && tc->psc_sets != 0; kind++) {
+        for (size_t i = 0; i < (size_t) tc->psc_sets * tc->ways; i++) {
+            tc->psc[kind][i].valid = 0;
+        }
+    }
+
+    tc->page_shifts = 0;
+}
+
+// Function looks up a cached translation, returns 1 and sets phys_addr and page_shift on a hit and 0 on a miss
+static int tcache_lookup(
+    TranslationCache *tc, uint8_t level, uint64_t root, uint64_t virt_addr, uint64_t *phys_addr, uint8_t *page_shift_out
+) {
+    tc->clock++;
+
+    for (int i = 0; i < 4 && TLBPageShifts[level][i] != 0; i++) {
+        uint8_t page_shift = TLBPageShifts[level][i];
+
+        if (!(tc->page_shifts & (1ULL << page_shift))) {
+            continue;
+        }
+
+        uint64_t vpn = virt_addr >> page_shift;
+        TLBEntry *set = tcache_set(tc, root, vpn, page_shift);
+
+        for (unsigned int way = 0; way < tc->ways; way++) {
+            TLBEntry *entry = &set[way];
+
+            if (entry->valid && entry->vpn == vpn && entry->root == root && 
+                entry->level == level && entry->page_shift == page_shift) {
+                entry->stamp = tc->clock;
+                *phys_addr = entry->frame + (virt_addr & ((1ULL << page_shift) - 1));
+                *page_shift_out = page_shift;
+                tc->hits++;
+                STATS_ADD(hits[STATS_TLB], 1);
+                return 1;
+            }
+        }
+    }
+
+    tc->misses++;
+    STATS_ADD(misses[STATS_TLB], 1);
+    return 0;
+}
+
+// Function caches a successful translation, evicting the least recently used entry of the set
+static void tcache_fill(TranslationCache *tc, uint8_t level, uint64_t root, uint64_t virt_addr, uint64_t phys_addr, uint8_t page_shift) {
+    uint64_t vpn = virt_addr >> page_shift;
+    TLBEntry *set = tcache_set(tc, root, vpn, page_shift);
+    TLBEntry *victim = &set[0];
+
+    for (unsigned int way = 0; way < tc->ways; way++) {
+        if (!set[way].valid) {
+            victim = &set[way];
+            break;
+        }
 
-    printf("------------- LEVEL 3 -------------\n\n");
-    for (int i = 0; i < 5; i++) {
-        tempres = va2pa(randbits(2), 3, randbits(2), read32, paddr_32);
-        if (tempres == 0) {
-            printf("Physical address: 0x%llX\n", *paddr_32);
+        if ((int32_t)(set[way].stamp - victim->stamp) < 0) {
+            victim = &set[way];
         }
-        printf("\n");
     }
 
-    printf("------------- LEVEL 4 -------------\n\n");
-    for (int i = 0; i < 5; i++) {
-        tempres = va2pa_64(randbits(2), randbits(2), read64, paddr_32);
-        if (tempres == 0) {
-            printf("Physical address: 0x%llX\n", *paddr_32);
+    victim->root = root;
+    victim->vpn = vpn;
+    victim->frame = phys_addr & ~((1ULL << page_shift) - 1);
+    victim->stamp = tc->clock;
+    victim->level = level;
+    victim->page_shift = page_shift;
+    victim->valid = 1;
+
+    tc->page_shifts |= 1ULL << page_shift;
+}
+
+// Function looks up a paging-structure entry, returns 1 and sets entry on a hit and 0 on a miss or if caching is disabled
+static int psc_lookup(TranslationCache *tc, PSCKind kind, uint8_t level, uint64_t root, uint64_t virt_addr, uint64_t *entry) {
+    if (tc == NULL || tc->psc_sets == 0) {
+        return 0;
+    }
+
+    uint64_t tag = virt_addr >> PSCTagShifts[level][kind];
+    PSCEntry *set = psc_set(tc, kind, root, tag);
+
+    for (unsigned int way = 0; way < tc->ways; way++) {
+        if (set[way].valid && set[way].tag == tag && set[way].root == root && set[way].level == level) {
+            set[way].stamp = tc->clock;
+            *entry = set[way].entry;
+            tc->psc_hits++;
+            STATS_ADD(hits[STATS_PSC_PML4E + kind], 1);
+            return 1;
         }
-        printf("\n");
     }
 
-    free(paddr_32);
+    tc->psc_misses++;
+    STATS_ADD(misses[STATS_PSC_PML4E + kind], 1);
     return 0;
 }
-#endif
\ No newline at end of file
+
+// Function caches a validated paging-structure entry that references the next paging structure
+static void psc_fill(TranslationCache *tc, PSCKind kind, uint8_t level, uint64_t root, uint64_t virt_addr, uint64_t entry) {
+    if (tc == NULL || tc->psc_sets == 0) {
+        return;
+    }
+
+    uint64_t tag = virt_addr >> PSCTagShifts[level][kind];
+    PSCEntry *set = psc_set(tc, kind, root, tag);
+    PSCEntry *victim = &set[0];
+
+    for (unsigned int way = 0; way < tc->ways; way++) {
+        if (!set[way].valid) {
+            victim = &set[way];
+            break;
+        }
+
+        if ((int32_t)(set[way].stamp - victim->stamp) < 0) {
+            victim = &set[way];
+        }
+    }
+
+    victim->root = root;
+    victim->tag = tag;
+    victim->entry = entry;
+    victim->stamp = tc->clock;
+    victim->level = level;
+    victim->valid = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            MEMORY IMAGE BACKEND                            */
+/* -------------------------------------------------------------------------- */
+
+// Struct represents a range of physical memory backed by an image file
+typedef struct {
+    uint64_t phys_start; // physical address of the first byte of the segment
+    uint64_t length;
+    const uint8_t *data; // mapping of the segment, NULL if it is read with pread() or is not stored in the file
+    uint64_t file_offset; // offset of the segment in the image file, used with pread()
+    uint8_t zero; // segment is not stored in the file and reads as zeros (ELF p_memsz past p_filesz)
+} MemSegment;
+
+// Struct represents physical memory held by a raw image, a sparse set of image files or an ELF core
+typedef struct {
+    MemSegment *segments; // sorted by phys_start, do not overlap
+    size_t count;
+    uint64_t *index_keys; // segment starts in Eytzinger order (1-based, index_keys[0] is unused)
+    uint32_t *index_pos; // position in segments of every index_keys element
+    void *mapping; // single mapping all segments point into (ELF core), NULL if every segment is mapped on its own
+    size_t mapping_length;
+    int fd; // image file segments are read from with pread(), -1 if segments are mapped
+} MemImage;
+
+// Image used by memimage_read_func() and memimage_read_func_64() in the calling thread
+static _Thread_local const MemImage *memimage_bound = NULL;
+
+// Backing of zero-filled segments for memimage_ptr()
+static const uint8_t memimage_zeros[4096];
+
+// Function returns the last segment of an image that starts at or below a given physical address (or the first one)
+static inline const MemSegment* memimage_segment(const MemImage *image, const uint64_t physical_addr) {
+    if (image->index_keys == NULL) {
+        return &image->segments[0];
+    }
+
+    // Branch-free descent to the first segment that starts above the address
+    size_t k = 1;
+    while (k <= image->count) {
+        __builtin_prefetch(image->index_keys + 8 * k);
+        k = 2 * k + (image->index_keys[k] <= physical_addr);
+    }
+
+    k >>= __builtin_ffsll(~(long long) k);
+    size_t above = k != 0 ? image->index_pos[k] : image->count;
+
+    return &image->segments[above != 0 ? above - 1 : 0];
+}
+
+/**
+ * @name memimage_ptr
+ * @param image
+ *  Memory image
+ * @param physical_addr
+ *  Physical address of the data
+ * @param size
+ *  Amount of bytes that have to be accessible
+ * @returns const uint8_t*
+ *  Returns a pointer to the data inside the mapping or NULL if [physical_addr, physical_addr + size) is not 
+ *  entirely inside one mapped segment of the image
+ */
+static inline const uint8_t* memimage_ptr(const MemImage *image, const uint64_t physical_addr, const unsigned int size) {
+    const MemSegment *segment = memimage_segment(image, physical_addr);
+    uint64_t offset = physical_addr - segment->phys_start;
+
+    if (physical_addr < segment->phys_start || offset > segment->length || segment->length - offset < size) {
+        return NULL;
+    }
+
+    if (segment->data == NULL) {
+        return segment->zero && size <= sizeof(memimage_zeros) ? memimage_zeros : NULL;
+    }
+
+    return segment->data + offset;
+}
+
+// Function lays out segment starts in Eytzinger order, returns the next segment to be placed
+static size_t memimage_index_fill(MemImage *image, size_t next, const size_t k) {
+    if (k <= image->count) {
+        next = memimage_index_fill(image, next, 2 * k);
+        image->index_keys[k] = image->segments[next].phys_start;
+        image->index_pos[k] = (uint32_t) next++;
+        next = memimage_index_fill(image, next, 2 * k + 1);
+    }
+
+    return next;
+}
+
+// Function builds the segment index of an image with sorted segments, returns 0 if memory could not be allocated
+static int memimage_build_index(MemImage *image) {
+    if (image->count <= 1) {
+        return 1;
+    }
+
+    image->index_keys = malloc((image->count + 1) * sizeof(uint64_t));
+    image->index_pos = malloc((image->count + 1) * sizeof(uint32_t));
+
+    if (image->index_keys == NULL || image->index_pos == NULL) {
+        return 0;
+    }
+
+    memimage_index_fill(image, 0, 1);
+    return 1;
+}
+
+// Function unmaps or closes every file of an image opened by one of the memimage_open functions
+void memimage_close(MemImage *image) {
+    if (image == NULL) {
+        return;
+    }
+
+    if (memimage_bound == image) {
+        memimage_bound = NULL;
+    }
+
+    if (image->mapping != NULL) {
+        munmap(image->mapping, image->mapping_length);
+    } else {
+        for (size_t i = 0; i < image->count; i++) {
+            if (image->segments[i].data != NULL) {
+                munmap((void*) image->segments[i].data, image->segments[i].length);
+            }
+        }
+    }
+
+    if (image->fd >= 0) {
+        close(image->fd);
+    }
+
+    free(image->index_keys);
+    free(image->index_pos);
+    free(image->segments);
+    free(image);
+}
+
+// Function allocates an image without segments
+static MemImage* memimage_alloc(const size_t count) {
+    MemImage *image = calloc(1, sizeof(MemImage));
+    if (image == NULL) {
+        return NULL;
+    }
+
+    image->fd = -1;
+    image->segments = calloc(count ? count : 1, sizeof(MemSegment));
+
+    if (image->segments == NULL) {
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+// Function maps a file read-only with access pattern hints for page walks, returns NULL on failure
+static void* memimage_map(const int fd, const size_t length) {
+    void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Page walks touch memory all over the image, read-ahead only wastes I/O
+    madvise(data, length, MADV_RANDOM);
+#ifdef MADV_HUGEPAGE
+    madvise(data, length, MADV_HUGEPAGE);
+#endif
+
+    return data;
+}
+
+// Function maps a whole file as one segment, returns 0 on failure
+static int memimage_map_file(const char *path, MemSegment *segment) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *data = memimage_map(fd, (size_t) st.st_size);
+    close(fd);
+
+    if (data == NULL) {
+        return 0;
+    }
+
+    segment->data = data;
+    segment->length = (uint64_t) st.st_size;
+    return 1;
+}
+
+static int memsegment_cmp(const void *a, const void *b) {
+    uint64_t sa = ((const MemSegment*) a)->phys_start, sb = ((const MemSegment*) b)->phys_start;
+    return (sa > sb) - (sa < sb);
+}
+
+/**
+ * @name memimage_open_sparse
+ * @param paths
+ *  Image files, each one holds a contiguous range of physical memory
+ * @param phys_addrs
+ *  Physical address of the first byte of every file
+ * @param count
+ *  Amount of files
+ * @returns MemImage*
+ *  Returns the mapped image or NULL if a file could not be mapped or two files overlap
+ * @description:
+ *  Function maps a set of raw image files into one physical address space. Physical memory 
+ *  not covered by any of the files reads as an error
+ */
+MemImage* memimage_open_sparse(const char *const *paths, const uint64_t *phys_addrs, const size_t count) {
+    MemImage *image = count != 0 ? memimage_alloc(count) : NULL;
+    if (image == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        image->segments[i].phys_start = phys_addrs[i];
+
+        if (!memimage_map_file(paths[i], &image->segments[i])) {
+            memimage_close(image);
+            return NULL;
+        }
+
+        image->count++;
+    }
+
+    qsort(image->segments, count, sizeof(MemSegment), memsegment_cmp);
+
+    for (size_t i = 1; i < count; i++) {
+        const MemSegment *prev = &image->segments[i - 1];
+
+        if (prev->phys_start + prev->length > image->segments[i].phys_start) {
+            memimage_close(image);
+            return NULL;
+        }
+    }
+
+    if (!memimage_build_index(image)) {
+        memimage_close(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+// Function maps a raw image file that holds physical memory starting at address 0
+MemImage* memimage_open(const char *path) {
+    uint64_t phys_addr = 0;
+    return memimage_open_sparse(&path, &phys_addr, 1);
+}
+
+// Function reads exactly size bytes at a given file offset, returns 0 on failure
+static int memimage_pread(const int fd, void *buf, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t done = pread(fd, buf, size, (off_t) offset);
+        if (done <= 0) {
+            return 0;
+        }
+
+        buf = (uint8_t*) buf + done;
+        size -= (size_t) done;
+        offset += (uint64_t) done;
+    }
+
+    return 1;
+}
+
+// Function collects the PT_LOAD segments of an ELF core, returns the amount of segments or 0 if the file is not an ELF core
+static size_t memimage_elf_segments(const int fd, MemSegment **segments) {
+    unsigned char ident[EI_NIDENT];
+    if (!memimage_pread(fd, ident, sizeof(ident), 0) || memcmp(ident, ELFMAG, SELFMAG) != 0) {
+        return 0;
+    }
+
+    // Only cores written by a machine with the same byte order are supported
+    const uint16_t byte_order = 1;
+    if (ident[EI_DATA] != (*(const uint8_t*) &byte_order ? ELFDATA2LSB : ELFDATA2MSB)) {
+        return 0;
+    }
+
+    int is64 = ident[EI_CLASS] == ELFCLASS64;
+    uint64_t phoff, shoff;
+    size_t phnum, phentsize;
+
+    if (is64) {
+        Elf64_Ehdr ehdr;
+        if (!memimage_pread(fd, &ehdr, sizeof(ehdr), 0)) {
+            return 0;
+        }
+
+        phoff = ehdr.e_phoff, shoff = ehdr.e_shoff, phnum = ehdr.e_phnum, phentsize = ehdr.e_phentsize;
+    } else if (ident[EI_CLASS] == ELFCLASS32) {
+        Elf32_Ehdr ehdr;
+        if (!memimage_pread(fd, &ehdr, sizeof(ehdr), 0)) {
+            return 0;
+        }
+
+        phoff = ehdr.e_phoff, shoff = ehdr.e_shoff, phnum = ehdr.e_phnum, phentsize = ehdr.e_phentsize;
+    } else {
+        return 0;
+    }
+
+    if (phnum == PN_XNUM) { // Real amount of program headers is kept in the first section header
+        if (is64) {
+            Elf64_Shdr shdr;
+            phnum = memimage_pread(fd, &shdr, sizeof(shdr), shoff) ? shdr.sh_info : 0;
+        } else {
+            Elf32_Shdr shdr;
+            phnum = memimage_pread(fd, &shdr, sizeof(shdr), shoff) ? shdr.sh_info : 0;
+        }
+    }
+
+    if (phnum == 0 || phentsize < (is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr))) {
+        return 0;
+    }
+
+    // sh_info of a corrupt core can be large enough to wrap the sizes below, and the headers have to be in the file
+    struct stat st;
+    if (phnum > SIZE_MAX / phentsize || phnum > SIZE_MAX / 2 / sizeof(MemSegment) || fstat(fd, &st) != 0 || 
+        phoff > (uint64_t) st.st_size || phnum * phentsize > (uint64_t) st.st_size - phoff) {
+        return 0;
+    }
+
+    uint8_t *phdrs = malloc(phnum * phentsize);
+    *segments = calloc(phnum * 2, sizeof(MemSegment));
+
+    if (phdrs == NULL || *segments == NULL || !memimage_pread(fd, phdrs, phnum * phentsize, phoff)) {
+        free(phdrs);
+        free(*segments);
+        *segments = NULL;
+        return 0;
+    }
+
+    size_t count = 0;
+
+    for (size_t i = 0; i < phnum; i++) {
+        uint64_t paddr, offset, filesz, memsz;
+
+        if (is64) {
+            const Elf64_Phdr *phdr = (const Elf64_Phdr*)(phdrs + i * phentsize);
+            if (phdr->p_type != PT_LOAD) {
+                continue;
+            }
+
+            paddr = phdr->p_paddr, offset = phdr->p_offset, filesz = phdr->p_filesz, memsz = phdr->p_memsz;
+        } else {
+            const Elf32_Phdr *phdr = (const Elf32_Phdr*)(phdrs + i * phentsize);
+            if (phdr->p_type != PT_LOAD) {
+                continue;
+            }
+
+            paddr = phdr->p_paddr, offset = phdr->p_offset, filesz = phdr->p_filesz, memsz = phdr->p_memsz;
+        }
+
+        // Neither the physical nor the file range of a segment may wrap, merging and lookups rely on it
+        if ((filesz > memsz ? filesz : memsz) > UINT64_MAX - paddr || filesz > UINT64_MAX - offset) {
+            free(phdrs);
+            free(*segments);
+            *segments = NULL;
+            return 0;
+        }
+
+        if (filesz > 0) {
+            (*segments)[count++] = (MemSegment) { paddr, filesz, NULL, offset, 0 };
+        }
+
+        if (memsz > filesz) {
+            (*segments)[count++] = (MemSegment) { paddr + filesz, memsz - filesz, NULL, 0, 1 };
+        }
+    }
+
+    free(phdrs);
+    return count;
+}
+
+/**
+ * @name memimage_open_elfcore
+ * @param path
+ *  ELF core file (e.g. a kdump vmcore) that holds physical memory in PT_LOAD segments addressed by p_paddr
+ * @param use_mmap
+ *  Non-zero to map the file and hand out pointers into the mapping, 0 to read entries with pread()
+ * @returns MemImage*
+ *  Returns the opened image or NULL if the file could not be opened or is not an ELF core
+ * @description:
+ *  Function parses the program headers once and builds a sorted segment index, so finding the file
+ *  offset of a physical address is an O(log n) search no matter how many segments the core has.
+ *  Physical memory not covered by any segment reads as an error
+ */
+MemImage* memimage_open_elfcore(const char *path, const int use_mmap) {
+    MemImage *image = memimage_alloc(0);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    image->fd = open(path, O_RDONLY);
+    if (image->fd < 0) {
+        memimage_close(image);
+        return NULL;
+    }
+
+    MemSegment *segments = NULL;
+    size_t count = memimage_elf_segments(image->fd, &segments);
+
+    if (count == 0) {
+        free(segments);
+        memimage_close(image);
+        return NULL;
+    }
+
+    free(image->segments);
+    image->segments = segments;
+    qsort(segments, count, sizeof(MemSegment), memsegment_cmp);
+
+    // Trimming overlaps and merging segments that continue each other both in memory and in the file
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        MemSegment segment = segments[i];
+
+        if (kept != 0) {
+            MemSegment *prev = &segments[kept - 1];
+            uint64_t prev_end = prev->phys_start + prev->length;
+
+            if (prev_end >= segment.phys_start + segment.length) {
+                continue;
+            }
+
+            if (prev_end > segment.phys_start) {
+                uint64_t overlap = prev_end - segment.phys_start;
+                segment.phys_start += overlap;
+                segment.file_offset += segment.zero ? 0 : overlap;
+                segment.length -= overlap;
+            }
+
+            if (prev_end == segment.phys_start && prev->zero == segment.zero && 
+                (segment.zero || prev->file_offset + prev->length == segment.file_offset)) {
+                prev->length += segment.length;
+                continue;
+            }
+        }
+
+        segments[kept++] = segment;
+    }
+
+    image->count = kept;
+
+    if (use_mmap) {
+        struct stat st;
+        if (fstat(image->fd, &st) != 0 || (image->mapping = memimage_map(image->fd, (size_t) st.st_size)) == NULL) {
+            memimage_close(image);
+            return NULL;
+        }
+
+        image->mapping_length = (size_t) st.st_size;
+
+        for (size_t i = 0; i < image->count; i++) {
+            MemSegment *segment = &image->segments[i];
+
+            if (!segment->zero && segment->length <= (uint64_t) st.st_size && 
+                segment->file_offset <= (uint64_t) st.st_size - segment->length) {
+                segment->data = (const uint8_t*) image->mapping + segment->file_offset;
+            }
+        }
+
+        close(image->fd);
+        image->fd = -1;
+    }
+
+    if (!memimage_build_index(image)) {
+        memimage_close(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/**
+ * @name memimage_read
+ * @description:
+ *  Same as PREAD_FUNC_64, but copies data out of a given image. Reads may span adjacent segments,
+ *  the amount of bytes returned stops at the first byte the image does not hold
+ */
+unsigned int memimage_read(const MemImage *image, void *buf, const unsigned int size, const uint64_t physical_addr) {
+    unsigned int done = 0;
+
+    while (done < size) {
+        uint64_t addr = physical_addr + done;
+        const MemSegment *segment = memimage_segment(image, addr);
+        uint64_t offset = addr - segment->phys_start;
+
+        if (addr < segment->phys_start || offset >= segment->length) {
+            break;
+        }
+
+        unsigned int chunk = segment->length - offset < size - done ? (unsigned int)(segment->length - offset) : size - done;
+
+        if (segment->data != NULL) {
+            memcpy((uint8_t*) buf + done, segment->data + offset, chunk);
+        } else if (segment->zero) {
+            memset((uint8_t*) buf + done, 0, chunk);
+        } else if (image->fd < 0 || !memimage_pread(image->fd, (uint8_t*) buf + done, chunk, segment->file_offset + offset)) {
+            break;
+        }
+
+        done += chunk;
+    }
+
+    return done;
+}
+
+// Function makes memimage_read_func() and memimage_read_func_64() read from a given image in the calling thread
+void memimage_bind(const MemImage *image) {
+    memimage_bound = image;
+}
+
+/**
+ * @name memimage_read_func
+ * @description:
+ *  PREAD_FUNC that reads from the image bound to the calling thread with memimage_bind(), for the 
+ *  functions that only take a read function. va2pa_image() and va2pa_64_image() do not copy entries at all
+ */
+unsigned int memimage_read_func(void *buf, const unsigned int size, const unsigned int physical_addr) {
+    return memimage_bound != NULL ? memimage_read(memimage_bound, buf, size, physical_addr) : 0;
+}
+
+/**
+ * @name memimage_read_func_64
+ * @description:
+ *  Same as memimage_read_func, only a PREAD_FUNC_64
+ */
+unsigned int memimage_read_func_64(void *buf, const unsigned int size, const uint64_t physical_addr) {
+    return memimage_bound != NULL ? memimage_read(memimage_bound, buf, size, physical_addr) : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                           MAIN API IMPLEMENTATION                          */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @name PREAD_FUNC
+ * @param buf
+ *  Buffer, that will hold the data, stored at a given physical address in RAM
+ * @param size
+ *  Amount of data in bytes that will be read from a given physical address in RAM
+ * @param physical_addr
+ *  4-byte physical memory address
+ * @returns unsigned int 
+ *  Returns an amount of bytes successfully read from RAM
+ * @description:
+ *  Function reads certaing amount of data from RAM at a certain address and stores 
+ *  that data into a buffer, passed as an arguement. Function returns an amount of bytes, 
+ *  successfully read from memory, 0 or less means an out of bounds exception or another error 
+ */
+typedef unsigned int (*PREAD_FUNC)(void *buf, const unsigned int size, const unsigned int physical_addr);
+
+/**
+ * @name: PREAD_FUNC_64
+ * @description:
+ *  Same as PREAD_FUNC, just read memory address from 64-bit address
+ */
+typedef unsigned int (*PREAD_FUNC_64)(void *buf, const unsigned int size, const uint64_t physical_addr);
+
+// Struct represents one request of a vectored read
+typedef struct {
+    uint64_t physical_addr;
+    void *buf;
+    unsigned int size;
+    unsigned int read; // set by the backend: amount of bytes read, less than size on errors
+} PhysRead;
+
+/**
+ * @name PHYS_READ_FUNC
+ * @param ctx
+ *  Context pointer of the backend
+ * @description:
+ *  Same as PREAD_FUNC_64, only the backend gets its context instead of having to keep its state in globals
+ */
+typedef unsigned int (*PHYS_READ_FUNC)(void *ctx, void *buf, const unsigned int size, const uint64_t physical_addr);
+
+/**
+ * @name PHYS_READV_FUNC
+ * @param ctx
+ *  Context pointer of the backend
+ * @param reads
+ *  Array of count read requests, the backend sets the read member of every one of them
+ * @description:
+ *  Function performs count reads in one call. The requests may overlap, repeat and come in any order, the
+ *  backend is free to reorder them and to merge neighbouring requests into fewer larger reads
+ */
+typedef void (*PHYS_READV_FUNC)(void *ctx, PhysRead *reads, const size_t count);
+
+// Struct represents a physical memory backend, readv may be NULL and then the reads are done one by one
+typedef struct {
+    PHYS_READ_FUNC read;
+    PHYS_READV_FUNC readv;
+    void *ctx;
+} PhysBackend;
+
+// Function performs count reads with the vectored read of a backend or one by one if it has none
+static void phys_readv(const PhysBackend *backend, PhysRead *reads, const size_t count) {
+    if (backend->readv != NULL) {
+        (*backend->readv)(backend->ctx, reads, count);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        reads[i].read = (*backend->read)(backend->ctx, reads[i].buf, reads[i].size, reads[i].physical_addr);
+    }
+}
+
+// Struct represents where the walks read paging-structure entries from, exactly one of the members is set
+typedef struct {
+    PREAD_FUNC read_func; // va2pa() backend
+    PREAD_FUNC_64 read_func_64; // va2pa_64() backend
+    const MemImage *image; // entries are loaded in place from a mapped image, nothing is copied through a buffer
+    const PhysBackend *backend; // context-carrying backend
+} PhysReader;
+
+// Backend kinds of PhysReader, walks are specialized for each one of them
+typedef enum {
+    READER_FUNC,
+    READER_FUNC_64,
+    READER_IMAGE,
+    READER_BACKEND
+} ReaderKind;
+
+static inline ReaderKind reader_kind(const PhysReader *reader) {
+    return reader->image != NULL ? READER_IMAGE : reader->backend != NULL ? READER_BACKEND : 
+        reader->read_func_64 != NULL ? READER_FUNC_64 : READER_FUNC;
+}
+
+// Function reads size bytes at a given physical address through any kind of backend, returns the amount read
+static unsigned int reader_read(const PhysReader *reader, void *buf, const unsigned int size, const uint64_t addr) {
+    switch (reader_kind(reader)) {
+    case READER_IMAGE:
+        return memimage_read(reader->image, buf, size, addr);
+    case READER_BACKEND:
+        return (*reader->backend->read)(reader->backend->ctx, buf, size, addr);
+    case READER_FUNC_64:
+        return (*reader->read_func_64)(buf, size, addr);
+    default:
+        return (*reader->read_func)(buf, size, (unsigned int) addr);
+    }
+}
+
+// Function loads a paging-structure entry of a given size from a given physical address through a backend of a given kind
+static inline __attribute__((always_inline)) TranslationState32 reader_load_as(
+    const ReaderKind kind, const PhysReader *reader, void *entry, const unsigned int size, const uint64_t addr
+) {
+    if (kind == READER_IMAGE) {
+        const uint8_t *data = memimage_ptr(reader->image, addr, size);
+        if (data == NULL) { // not mapped, pread() images and holes
+            return memimage_read(reader->image, entry, size, addr) < size ? ST_RAM_READ_ERROR_32 : ST_SUCCESS_32;
+        }
+
+        memcpy(entry, data, size); // size is a constant, this is a plain load
+        return ST_SUCCESS_32;
+    }
+
+    unsigned int read = kind == READER_BACKEND ? (*reader->backend->read)(reader->backend->ctx, entry, size, addr) :
+        kind == READER_FUNC_64 ? (*reader->read_func_64)(entry, size, addr) : (*reader->read_func)(entry, size, (unsigned int) addr);
+
+    return read < size ? ST_RAM_READ_ERROR_32 : ST_SUCCESS_32;
+}
+
+// Function loads a paging-structure entry of a given size from a given physical address
+static inline TranslationState32 reader_load(const PhysReader *reader, void *entry, const unsigned int size, const uint64_t addr) {
+    return reader_load_as(reader_kind(reader), reader, entry, size, addr);
+}
+
+/* ------------------------ Entry Integrity Checks -------------------------- */
+
+// EPT entry integrity check, an EPT entry is present if it allows any kind of access
+static TranslationState32 check_ept(const uint64_t entry, const int leaf, const uint64_t reserved, 
+    const TranslationState32 not_present, const TranslationState32 misconfigured
+) {
+    uint8_t memtype = (entry >> EPTBits.memtype) & 0x7;
+
+    if (!(entry & ((1 << EPTBits.read) | (1 << EPTBits.write) | (1 << EPTBits.exec)))) {
+        return not_present;
+    } else if ((entry & (1 << EPTBits.write)) && !(entry & (1 << EPTBits.read))) { // Write-only is a misconfiguration
+        return misconfigured;
+    } else if (entry & reserved) {
+        return misconfigured;
+    } else if (leaf && (memtype == 2 || memtype == 3 || memtype == 7)) { // Reserved memory types
+        return misconfigured;
+    }
+
+    return ST_SUCCESS_32;
+}
+
+static TranslationState32 check_ept_pml4e(const uint64_t pml4e) {
+    return check_ept(pml4e, 0, EPTBits.reserved_pml4e, ST_PML4E_NOT_PRESENT_32, ST_PML4E_MBZ_32);
+}
+
+static TranslationState32 check_ept_pdpte(const uint64_t pdpte) {
+    int leaf = (pdpte >> EPTBits.ps) & 1;
+    return check_ept(pdpte, leaf, leaf ? EPTBits.reserved_1g : EPTBits.reserved_table, ST_PDPTE_NOT_PRESENT_32, ST_PDPTE_RESERVED_32);
+}
+
+static TranslationState32 check_ept_pde(const uint64_t pde) {
+    int leaf = (pde >> EPTBits.ps) & 1;
+    return check_ept(pde, leaf, leaf ? EPTBits.reserved_2m : EPTBits.reserved_table, ST_PDE_NOT_PRESENT_32, ST_PDE_RESERVED_32);
+}
+
+static TranslationState32 check_ept_pte(const uint64_t pte) {
+    return check_ept(pte, 1, 0, ST_PTE_NOT_PRESENT_32, ST_PTE_RESERVED_32);
+}
+
+// Legacy PDE integrity check
+static TranslationState32 check_pde_legacy(const uint64_t pde) {
+    if (!(pde & (1 << PDEBits.present))) {  // if pde present bit is not set
+        return ST_PDE_NOT_PRESENT_32;
+    } else if (!(pde & (1 << PDEBits.uaccess))) { // if pde is in supervisor mode
+        return ST_PDE_SUPERVISOR_MODE_32;
+    } else if (pde & (1 << PDEBits.pse)) { // if pse bit is set
+        // Big page PSE mode is on
+        if (pde && PDE4MbBits.reserved) {
+            return ST_PDE_RESERVED_32;
+        } else if (!(pde & (1 << PDE4MbBits.pat))) {
+            return ST_PDE_PSE_PAT_32;
+        }
+    }
+
+    return ST_SUCCESS_32;
+}
+
+// Legacy PTE integrity check
+static TranslationState32 check_pte_legacy(const uint64_t pte) {
+    if (!(pte & (1 << PTEBits.present))) { // if pte present bit is not set
+        return ST_PTE_NOT_PRESENT_32;
+    } else if (!(pte & (1 << PTEBits.uaccess))) { // if pte is in supervisor mode
+        return ST_PTE_SUPERVISOR_MODE_32;
+    }
+
+    return ST_SUCCESS_32;
+}
+
+// PAE PDPTE integrity check
+static TranslationState32 check_pdpte_pae(const uint64_t pdpte) {
+    TranslationState32 state = ST_SUCCESS_32;
+
+    if (!(pdpte & (1 << PDPTEBits.present))) { // Check if present
+        state = ST_PDPTE_NOT_PRESENT_32; 
+    } 
+    
+    if (pdpte & PDPTEBits.reserved) { // Check if any of the reserved bits are set
+        state = ST_PDPTE_RESERVED_32;
+    }
+
+    return state;
+}
+
+// PAE PDE integrity check
+static TranslationState32 check_pde_pae(const uint64_t pde) {
+    TranslationState32 state = ST_SUCCESS_32;
+
+    if (!(pde & (1 << PDEBitsPAE.present))) { // Check if present
+        state = ST_PDE_NOT_PRESENT_32; 
+    } else if (!(pde & (1 << PDEBitsPAE.uaccess))) { // Check if accessible by user
+        state = ST_PDE_SUPERVISOR_MODE_32;
+    } 
+    
+    if (pde & (1 << PDEBitsPAE.pse)) { // Check if page size is not extended
+        if (pde & PDE2MbBits.reserved) {
+            state = ST_PDE_RESERVED_32;
+        } else if (!(pde & (1 << PDE2MbBits.pat))) {
+            state = ST_PDE_PSE_PAT_32;
+        }
+    } else if (pde & PDEBitsPAE.reserved) { // Check if any of the reserved bits are set
+        state = ST_PDE_RESERVED_32;
+    }
+
+    return state;
+}
+
+// PAE PTE integrity check
+static TranslationState32 check_pte_pae(const uint64_t pte) {
+    TranslationState32 state = ST_SUCCESS_32;
+
+    if (!(pte & (1 << PTEBitsPAE.present))) { // Check if present
+        state = ST_PTE_NOT_PRESENT_32; 
+    } else if (!(pte & (1 << PTEBitsPAE.uaccess))) { // Check if accessible by user
+        state = ST_PDE_SUPERVISOR_MODE_32;
+    } else if (!(pte & (1 << PTEBitsPAE.pat))) { // Check if PAT bit is resereved
+        state = ST_PTE_PAE_PAT_32;
+    } 
+    
+    if (pte & PTEBitsPAE.reserved) { // Check if any of the reserved bits are set
+        state = ST_PTE_RESERVED_32;
+    }
+
+    return state;
+}
+
+// Long mode PML4E integrity check
+static TranslationState32 check_pml4e(const uint64_t pml4e) {
+    if (!(pml4e & (1 << PML4EBits.present))) { // Check if present
+        return ST_PDPTE_NOT_PRESENT_32; 
+    } else if (!(pml4e & (1 << PML4EBits.uaccess))) { // Check if accessible by user
+        return ST_PDE_SUPERVISOR_MODE_32;
+    } else if (pml4e & PML4EBits.mbz) {
+        return ST_PML4E_MBZ_32;
+    }
+
+    return ST_SUCCESS_32;
+}
+
+// Long mode PDPTE integrity check
+static TranslationState32 check_pdpte_64(const uint64_t pdpte) {
+    TranslationState32 state = ST_SUCCESS_32;
+
+    if (!(pdpte & (1 << PDPTEBits.present))) { // Check if present
+        state = ST_PDPTE_NOT_PRESENT_32; 
+    } 
+
+    if (pdpte & (1 << PDPTEBits.pse)) { // If PSE is enabled
+        if (pdpte & PDPTEBits.reserved64PSE) { // Check if any of the reserved bits are set
+            state = ST_PDPTE_RESERVED_32;
+        }
+    }
+
+    return state;
+}
+
+// Long mode PDE integrity check
+static TranslationState32 check_pde_64(const uint64_t pde) {
+    TranslationState32 state = ST_SUCCESS_32;
+
+    if (!(pde & (1 << PDEBitsPAE.present))) { // Check if present
+        state = ST_PDPTE_NOT_PRESENT_32; 
+    } else if (!(pde & (1 << PDEBitsPAE.uaccess))) { // Check if accessible by user
+        state = ST_PDE_SUPERVISOR_MODE_32;
+    } 
+    
+    if (pde & (1 << PDEBitsPAE.pse)) { // Check if page size is not extended
+        if (pde & PDE2MbBits.reserved) {
+            state = ST_PDE_RESERVED_32;
+        }
+    } else {
+        if (pde & PDEBitsPAE.reserved) { // Check if any of the reserved bits are set
+            state = ST_PDE_RESERVED_32;
+        }
+    }
+
+    return state;
+}
+
+// Long mode PTE integrity check
+static TranslationState32 check_pte_64(const uint64_t pte) {
+    TranslationState32 state = ST_SUCCESS_32;
+
+    if (!(pte & (1 << PTEBitsPAE.present))) { // Check if present
+        state = ST_PDPTE_NOT_PRESENT_32; 
+    } else if (!(pte & (1 << PTEBitsPAE.uaccess))) { // Check if accessible by user
+        state = ST_PDE_SUPERVISOR_MODE_32;
+    } else if (!(pte & (1 << PTEBitsPAE.pat))) { // Check if PAT bit is resereved
+        state = ST_PTE_PAE_PAT_32;
+    }
+    
+    if (pte & PTEBitsPAE.reserved) { // Check if any of the reserved bits are set
+        state = ST_PTE_RESERVED_32;
+    }
+
+    return state;
+}
+
+/* ------------------------------- Page Walks ------------------------------- */
+
+// Function returns a mask with bits start..end (both inclusive) set
+static inline uint64_t bit_range(const uint8_t start, const uint8_t end) {
+    return (~0ULL >> (63 - end)) & ~((1ULL << start) - 1);
+}
+
+// Paging-structure entry addresses, each one is computed from the entry one level above.
+// A paging structure is a 4 KiB aligned frame (32 byte aligned PAE PDPT) at the address held by that entry
+
+// Legacy paging-structure entry addresses
+static inline uint32_t pde_addr_32(const uint32_t root_addr, const uint32_t virt_addr) {
+    return (root_addr & bit_range(CR3Bits32.addrstart, CR3Bits32.addrend)) + (virt_addr >> 22) * sizeof(uint32_t);
+}
+
+static inline uint32_t pte_addr_32(const uint32_t pde, const uint32_t virt_addr) {
+    return (pde & bit_range(PDEBits.addrstart, PDEBits.addrend)) + ((virt_addr >> 12) & 0x3FF) * sizeof(uint32_t);
+}
+
+// PAE paging-structure entry addresses
+static inline uint64_t pdpte_addr_pae(const uint32_t root_addr, const uint32_t virt_addr) {
+    return (root_addr & bit_range(CR3BitsPAE.addrstart, CR3BitsPAE.addrend)) + (virt_addr >> 30) * sizeof(uint64_t);
+}
+
+// Long mode paging-structure entry addresses
+static inline uint64_t pml4e_addr_64(const uint64_t root_addr_64, const uint64_t virt_addr_64) {
+    return (root_addr_64 & bit_range(CR3Bits64.addrstart, CR3Bits64.addrend)) + ((virt_addr_64 >> 39) & 0x1FF) * sizeof(uint64_t);
+}
+
+static inline uint64_t pdpte_addr_64(const uint64_t pml4e, const uint64_t virt_addr_64) {
+    return (pml4e & bit_range(PML4EBits.addrstart, PML4EBits.addrend)) + ((virt_addr_64 >> 30) & 0x1FF) * sizeof(uint64_t);
+}
+
+static inline uint64_t pde_addr_64(const uint64_t pdpte, const uint64_t virt_addr_64) {
+    return (pdpte & bit_range(PDPTEBits.addrstart, PDPTEBits.addrend)) + ((virt_addr_64 >> 21) & 0x1FF) * sizeof(uint64_t);
+}
+
+static inline uint64_t pte_addr_64(const uint64_t pde, const uint64_t virt_addr_64) {
+    return (pde & bit_range(PDEBitsPAE.addrstart, PDEBitsPAE.addrend)) + ((virt_addr_64 >> 12) & 0x1FF) * sizeof(uint64_t);
+}
+
+// Reads one paging-structure entry of a given size, returns ST_RAM_READ_ERROR_32 if it could not be read
+#define READ_ENTRY(reader, entry, addr) reader_load((reader), &(entry), sizeof(entry), (addr))
+
+// Diagnostics of the walks, see DIAG_EMIT
+#define REPORT_READ_ERROR(name, addr, size) DIAG_EMIT(DIAG_READ_ERROR, ST_RAM_READ_ERROR_32, (name), (addr), 0, (size))
+#define REPORT_ENTRY_ERROR(state, name, addr, entry) DIAG_EMIT(DIAG_ENTRY_ERROR, (state), (name), (addr), (entry), sizeof(entry))
+
+// Reports a translation that ended in a PTE with the dirty bit clear
+#define REPORT_NOT_DIRTY(addr, pte, size) do { \
+        if (!((pte) & (1 << PTEBits.dirty))) { \
+            DIAG_EMIT(DIAG_PTE_NOT_DIRTY, ST_SUCCESS_32, "pte", (addr), (pte), (size)); \
+        } \
+    } while (0)
+
+// Struct describes one paging structure of a paging mode
+typedef struct {
+    uint8_t shift; // lowest virtual address bit that indexes the structure, also log2 of the page a leaf entry maps
+    uint64_t index_mask; // virtual address index bits after the shift
+    uint64_t table_mask; // bits of the entry above (or of the root) that hold the address of the structure
+    uint64_t page_mask; // bits of a leaf entry that hold the page address
+    uint8_t leaf_bit; // entry maps a page when this bit is set, 0 if only the last level maps pages
+    PSCKind psc; // kind the entry is cached as when it references the next structure, PSC_KINDS for the last level
+    TranslationState32 (*check)(const uint64_t entry);
+    const char *name;
+} WalkLevel;
+
+// Struct describes a paging mode, levels are listed from the root down
+typedef struct {
+    uint8_t levels; // 2 for legacy, 3 for PAE and 4 for long mode, the caches tag entries with it
+    uint8_t entry_size; // size of a paging-structure entry in bytes
+    uint8_t report_dirty; // last level entries without the dirty bit are reported, guest paging modes only
+    WalkLevel level[4];
+} WalkMode;
+
+static const WalkMode WalkModeLegacy = {
+    .levels = 2, .entry_size = sizeof(uint32_t), .report_dirty = 1,
+    .level = {
+        { 22, 0x3FF, 0xFFFFF000, 0xFFC00000, 7, PSC_PDE, check_pde_legacy, "pde" },
+        { 12, 0x3FF, 0xFFFFF000, 0xFFFFF000, 0, PSC_KINDS, check_pte_legacy, "pte" }
+    }
+};
+
+static const WalkMode WalkModePAE = {
+    .levels = 3, .entry_size = sizeof(uint64_t), .report_dirty = 1,
+    .level = {
+        { 30, 0x3, 0xFFFFFFE0, 0, 0, PSC_PDPTE, check_pdpte_pae, "pdpte" },
+        { 21, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFFFE00000, 7, PSC_PDE, check_pde_pae, "pde" },
+        { 12, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFFFFFF000, 0, PSC_KINDS, check_pte_pae, "pte" }
+    }
+};
+
+static const WalkMode WalkMode64 = {
+    .levels = 4, .entry_size = sizeof(uint64_t), .report_dirty = 1,
+    .level = {
+        { 39, 0x1FF, 0xFFFFFFFFFF000, 0, 0, PSC_PML4E, check_pml4e, "pml4e" },
+        { 30, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFC0000000, 7, PSC_PDPTE, check_pdpte_64, "pdpte" },
+        { 21, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFFFE00000, 7, PSC_PDE, check_pde_64, "pde" },
+        { 12, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFFFFFF000, 0, PSC_KINDS, check_pte_64, "pte" }
+    }
+};
+
+// Host paging structures of nested translations, guest-physical addresses are the "virtual" addresses they translate.
+// AMD nested page tables have the long mode format, Intel extended page tables have their own
+static const WalkMode WalkModeNPT = {
+    .levels = 4, .entry_size = sizeof(uint64_t),
+    .level = {
+        { 39, 0x1FF, 0xFFFFFFFFFF000, 0, 0, PSC_PML4E, check_pml4e, "npt pml4e" },
+        { 30, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFC0000000, 7, PSC_PDPTE, check_pdpte_64, "npt pdpte" },
+        { 21, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFFFE00000, 7, PSC_PDE, check_pde_64, "npt pde" },
+        { 12, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFFFFFF000, 0, PSC_KINDS, check_pte_64, "npt pte" }
+    }
+};
+
+static const WalkMode WalkModeEPT = {
+    .levels = 4, .entry_size = sizeof(uint64_t),
+    .level = {
+        { 39, 0x1FF, 0xFFFFFFFFFF000, 0, 0, PSC_PML4E, check_ept_pml4e, "ept pml4e" },
+        { 30, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFC0000000, 7, PSC_PDPTE, check_ept_pdpte, "ept pdpte" },
+        { 21, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFFFE00000, 7, PSC_PDE, check_ept_pde, "ept pde" },
+        { 12, 0x1FF, 0xFFFFFFFFFF000, 0xFFFFFFFFFF000, 0, PSC_KINDS, check_ept_pte, "ept pte" }
+    }
+};
+
+/**
+ * @name walk_core
+ * @description:
+ *  Function translates a virtual address by walking the paging structures of a given mode. It is always
+ *  inlined and every caller passes a constant mode and reader kind, so the compiler unrolls the walk,
+ *  folds the mode tables into immediates, calls the checks directly and keeps the entries in registers.
+ *  A statically known reader function is inlined into the walk as well (see VA2PA_64_SPECIALIZE)
+ */
+static inline __attribute__((always_inline)) int walk_core(
+    const WalkMode *mode,
+    const ReaderKind kind,
+    const PhysReader *reader,
+    TranslationCache *tc,
+    const uint64_t virt_addr, 
+    const uint64_t root_addr, 
+    uint64_t *phys_addr,
+    uint8_t *page_shift
+) {
+    uint64_t entry = root_addr;
+    TranslationState32 state;
+    int start = 0;
+
+    // Resuming the walk below the deepest cached paging-structure entry
+    if (tc != NULL) {
+        for (int i = mode->levels - 2; i >= 0; i--) {
+            if (psc_lookup(tc, mode->level[i].psc, mode->levels, root_addr, virt_addr, &entry)) {
+                start = i + 1;
+                break;
+            }
+        }
+    }
+
+#pragma GCC unroll 4
+    for (int i = start; i < mode->levels; i++) {
+        const WalkLevel *level = &mode->level[i];
+
+        // Entry address from the entry above and the index bits of the virtual address
+        uint64_t addr = (entry & level->table_mask) + ((virt_addr >> level->shift) & level->index_mask) * mode->entry_size;
+
+        if (mode->entry_size == sizeof(uint32_t)) {
+            uint32_t entry_32 = 0;
+            state = reader_load_as(kind, reader, &entry_32, sizeof(entry_32), addr);
+            entry = entry_32;
+        } else {
+            uint64_t entry_64 = 0;
+            state = reader_load_as(kind, reader, &entry_64, sizeof(entry_64), addr);
+            entry = entry_64;
+        }
+
+        STATS_ADD(reads[i], 1);
+
+        if (state != ST_SUCCESS_32) {
+            REPORT_READ_ERROR(level->name, addr, mode->entry_size);
+            return ST_RAM_READ_ERROR_32;
+        }
+
+        // If the entry is somehow corrupt display an error message and return error code
+        if ((state = level->check(entry)) != ST_SUCCESS_32) {
+            DIAG_EMIT(DIAG_ENTRY_ERROR, state, level->name, addr, entry, mode->entry_size);
+            return state;
+        }
+
+        if (i == mode->levels - 1 || (level->leaf_bit != 0 && (entry & (1ULL << level->leaf_bit)))) {
+            if (i == mode->levels - 1 && mode->report_dirty) {
+                REPORT_NOT_DIRTY(addr, entry, mode->entry_size);
+            }
+
+            // Page address from the leaf entry plus the page offset from the virtual address
+            *phys_addr = (entry & level->page_mask) + (virt_addr & ((1ULL << level->shift) - 1));
+            *page_shift = level->shift;
+            return ST_SUCCESS_32;
+        }
+
+        psc_fill(tc, level->psc, mode->levels, root_addr, virt_addr, entry);
+    }
+
+    __builtin_unreachable(); // the last level always maps a page
+}
+
+// Function specializes walk_core() for the backend of a given reader
+static inline __attribute__((always_inline)) int walk_mode(
+    const WalkMode *mode,
+    const PhysReader *reader,
+    TranslationCache *tc,
+    const uint64_t virt_addr, 
+    const uint64_t root_addr, 
+    uint64_t *phys_addr,
+    uint8_t *page_shift
+) {
+    switch (reader_kind(reader)) {
+    case READER_IMAGE:
+        return walk_core(mode, READER_IMAGE, reader, tc, virt_addr, root_addr, phys_addr, page_shift);
+    case READER_BACKEND:
+        return walk_core(mode, READER_BACKEND, reader, tc, virt_addr, root_addr, phys_addr, page_shift);
+    case READER_FUNC_64:
+        return walk_core(mode, READER_FUNC_64, reader, tc, virt_addr, root_addr, phys_addr, page_shift);
+    default:
+        return walk_core(mode, READER_FUNC, reader, tc, virt_addr, root_addr, phys_addr, page_shift);
+    }
+}
+
+// Performs va2pa() translation and additionally reports the size of the page it ended in
+static inline __attribute__((always_inline)) int va2pa_walk(
+    const unsigned int virt_addr, 
+    const unsigned int level, 
+    const unsigned int root_addr, 
+    const PhysReader *reader,
+    TranslationCache *tc,
+    uint64_t *phys_addr,
+    uint8_t *page_shift // log2 of the size of the page the translation ended in
+) {
+    if (level == 2) { // Legacy 2-level translation (4 KiB pages or 4 MiB pages with PSE)
+        return walk_mode(&WalkModeLegacy, reader, tc, virt_addr, root_addr, phys_addr, page_shift);
+    } else if (level == 3) { // PAE 3-level translation (4 KiB or 2 MiB pages)
+        return walk_mode(&WalkModePAE, reader, tc, virt_addr, root_addr, phys_addr, page_shift);
+    }
+
+    // Return error if a wrong level is given
+    DIAG_EMIT(DIAG_INCORRECT_LEVEL, ST_INCORRECT_LEVEL_32, NULL, 0, level, 0);
+
+    return ST_INCORRECT_LEVEL_32;
+}
+
+// Performs va2pa_64() translation and additionally reports the size of the page it ended in
+static inline __attribute__((always_inline)) uint8_t va2pa_64_walk(
+    const uint64_t virt_addr_64, 
+    const uint64_t root_addr_64, 
+    const PhysReader *reader,
+    TranslationCache *tc,
+    uint64_t *phys_addr_64,
+    uint8_t *page_shift
+) {
+    return (uint8_t) walk_mode(&WalkMode64, reader, tc, virt_addr_64, root_addr_64, phys_addr_64, page_shift);
+}
+
+/**
+ * @name VA2PA_SPECIALIZE
+ * @description:
+ *  Defines int name(virt_addr, level, root_addr, phys_addr) that is va2pa() with read_func fixed at compile
+ *  time. Walks of the defined function call read_func directly, a read_func defined in the same translation
+ *  unit is inlined into them
+ */
+#define VA2PA_SPECIALIZE(name, read_func) \
+    int name(const unsigned int virt_addr, const unsigned int level, const unsigned int root_addr, uint64_t *phys_addr) { \
+        const PhysReader reader = { (read_func), NULL, NULL, NULL }; \
+        uint8_t page_shift = 0; \
+        STATS_CALL_BEGIN(); \
+        int result = va2pa_walk(virt_addr, level, root_addr, &reader, NULL, phys_addr, &page_shift); \
+        STATS_CALL_END(STATS_CALL_WALK, result, page_shift); \
+        return result; \
+    }
+
+/**
+ * @name VA2PA_64_SPECIALIZE
+ * @description:
+ *  Same as VA2PA_SPECIALIZE, defines uint8_t name(virt_addr_64, root_addr_64, phys_addr_64) that is va2pa_64()
+ *  with read_func_64 fixed at compile time
+ */
+#define VA2PA_64_SPECIALIZE(name, read_func_64) \
+    uint8_t name(const uint64_t virt_addr_64, const uint64_t root_addr_64, uint64_t *phys_addr_64) { \
+        const PhysReader reader = { NULL, (read_func_64), NULL, NULL }; \
+        uint8_t page_shift = 0; \
+        STATS_CALL_BEGIN(); \
+        uint8_t result = va2pa_64_walk(virt_addr_64, root_addr_64, &reader, NULL, phys_addr_64, &page_shift); \
+        STATS_CALL_END(STATS_CALL_WALK, result, page_shift); \
+        return result; \
+    }
+
+/**
+ * @name va2pa
+ * @param virt_addr
+ *  4-byte virtual address to be tranlated into physical address
+ * @param level
+ *  Level of indirection w/ values 2 or 3 which stand for legacy translation and PAE translation respectively
+ * @param root_addr
+ *  Page directory root address (similar to CR3 register value in x86 architecture)
+ * @param read_func
+ *  Function pointer that accepts a PREAD_FUNC function that reads a certain amount of physical memory
+ * @param phys_addr
+ *  Integer pointer that will hold a resulting physical address after a given virtual address is 
+ *  successfully translated (output buffer)
+ * @returns int
+ *  Function returns 0 if translation was carried out succesfully or returns value other than zero if errors occured
+ * @description: 
+ *  Function performs a translation of a given virtual address into physical address and stores it in an output buffer
+ */
+int va2pa(
+    const unsigned int virt_addr, 
+    const unsigned int level, 
+    const unsigned int root_addr, 
+    const PREAD_FUNC read_func, 
+    //unsigned int *phys_addr
+    uint64_t *phys_addr // since PAE translations produce 52-bit physical address
+) {
+    PhysReader reader = { read_func, NULL, NULL, NULL };
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+    int result = va2pa_walk(virt_addr, level, root_addr, &reader, NULL, phys_addr, &page_shift);
+    STATS_CALL_END(STATS_CALL_WALK, result, page_shift);
+    return result;
+}
+
+/**
+ * @name: va2pa_64
+ * @description:
+ *  Same as va2pa, only for 64 but translation with 64-bit CR3, 64-bit return physical address buffer and
+ *  64-bit PREAD_FUNC_64 instead of PREAD_FUNC to read from RAM 
+ */
+uint8_t va2pa_64(
+    const uint64_t virt_addr_64, 
+    const uint64_t root_addr_64, 
+    const PREAD_FUNC_64 read_func_64, 
+    uint64_t *phys_addr_64
+) {
+    PhysReader reader = { NULL, read_func_64, NULL, NULL };
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+    uint8_t result = va2pa_64_walk(virt_addr_64, root_addr_64, &reader, NULL, phys_addr_64, &page_shift);
+    STATS_CALL_END(STATS_CALL_WALK, result, page_shift);
+    return result;
+}
+
+/**
+ * @name va2pa_cached
+ * @param tc
+ *  Translation cache created by tcache_create() or NULL to always walk the tables
+ * @description:
+ *  Same as va2pa, but a translation already held by the cache is returned without calling read_func
+ *  and a TLB miss resumes the walk below the deepest paging-structure entry held by the cache.
+ *  Successful walks are added to the cache, failed ones are not cached. The cache is not aware of
+ *  changes to the page tables, use tcache_flush_page(), tcache_flush_root() or tcache_flush_all() after them
+ */
+int va2pa_cached(
+    TranslationCache *tc,
+    const unsigned int virt_addr, 
+    const unsigned int level, 
+    const unsigned int root_addr, 
+    const PREAD_FUNC read_func, 
+    uint64_t *phys_addr
+) {
+    if (tc == NULL || level > 3 || level < 2) {
+        return va2pa(virt_addr, level, root_addr, read_func, phys_addr);
+    }
+
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+
+    if (tcache_lookup(tc, level, root_addr, virt_addr, phys_addr, &page_shift)) {
+        STATS_CALL_END(STATS_CALL_CACHED, ST_SUCCESS_32, page_shift);
+        return ST_SUCCESS_32;
+    }
+
+    PhysReader reader = { read_func, NULL, NULL, NULL };
+    int result = va2pa_walk(virt_addr, level, root_addr, &reader, tc, phys_addr, &page_shift);
+
+    if (result == ST_SUCCESS_32) {
+        tcache_fill(tc, level, root_addr, virt_addr, *phys_addr, page_shift);
+    }
+
+    STATS_CALL_END(STATS_CALL_CACHED, result, page_shift);
+    return result;
+}
+
+/**
+ * @name va2pa_64_cached
+ * @description:
+ *  Same as va2pa_cached, only for va2pa_64 translations
+ */
+uint8_t va2pa_64_cached(
+    TranslationCache *tc,
+    const uint64_t virt_addr_64, 
+    const uint64_t root_addr_64, 
+    const PREAD_FUNC_64 read_func_64, 
+    uint64_t *phys_addr_64
+) {
+    if (tc == NULL) {
+        return va2pa_64(virt_addr_64, root_addr_64, read_func_64, phys_addr_64);
+    }
+
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+
+    if (tcache_lookup(tc, 4, root_addr_64, virt_addr_64, phys_addr_64, &page_shift)) {
+        STATS_CALL_END(STATS_CALL_CACHED, ST_SUCCESS_32, page_shift);
+        return ST_SUCCESS_32;
+    }
+
+    PhysReader reader = { NULL, read_func_64, NULL, NULL };
+    uint8_t result = va2pa_64_walk(virt_addr_64, root_addr_64, &reader, tc, phys_addr_64, &page_shift);
+
+    if (result == ST_SUCCESS_32) {
+        tcache_fill(tc, 4, root_addr_64, virt_addr_64, *phys_addr_64, page_shift);
+    }
+
+    STATS_CALL_END(STATS_CALL_CACHED, result, page_shift);
+    return result;
+}
+
+/**
+ * @name va2pa_image
+ * @param image
+ *  Memory image opened with memimage_open() or memimage_open_sparse()
+ * @description:
+ *  Same as va2pa, but paging-structure entries are loaded straight out of the mapped image instead of being
+ *  copied through a read function. Entries outside of the image result in ST_RAM_READ_ERROR_32
+ */
+int va2pa_image(
+    const MemImage *image,
+    const unsigned int virt_addr, 
+    const unsigned int level, 
+    const unsigned int root_addr, 
+    uint64_t *phys_addr
+) {
+    PhysReader reader = { NULL, NULL, image, NULL };
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+    int result = va2pa_walk(virt_addr, level, root_addr, &reader, NULL, phys_addr, &page_shift);
+    STATS_CALL_END(STATS_CALL_IMAGE, result, page_shift);
+    return result;
+}
+
+/**
+ * @name va2pa_64_image
+ * @description:
+ *  Same as va2pa_image, only for va2pa_64 translations
+ */
+uint8_t va2pa_64_image(
+    const MemImage *image,
+    const uint64_t virt_addr_64, 
+    const uint64_t root_addr_64, 
+    uint64_t *phys_addr_64
+) {
+    PhysReader reader = { NULL, NULL, image, NULL };
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+    uint8_t result = va2pa_64_walk(virt_addr_64, root_addr_64, &reader, NULL, phys_addr_64, &page_shift);
+    STATS_CALL_END(STATS_CALL_IMAGE, result, page_shift);
+    return result;
+}
+
+/**
+ * @name va2pa_backend
+ * @param backend
+ *  Backend the paging-structure entries are read with, its read function gets the context of the backend
+ * @description:
+ *  Same as va2pa, but physical memory is read through a PhysBackend. Legacy callbacks are wrapped into one
+ *  with phys_func_init()
+ */
+int va2pa_backend(
+    const PhysBackend *backend,
+    const unsigned int virt_addr, 
+    const unsigned int level, 
+    const unsigned int root_addr, 
+    uint64_t *phys_addr
+) {
+    PhysReader reader = { NULL, NULL, NULL, backend };
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+    int result = va2pa_walk(virt_addr, level, root_addr, &reader, NULL, phys_addr, &page_shift);
+    STATS_CALL_END(STATS_CALL_WALK, result, page_shift);
+    return result;
+}
+
+/**
+ * @name va2pa_64_backend
+ * @description:
+ *  Same as va2pa_backend, only for va2pa_64 translations
+ */
+uint8_t va2pa_64_backend(
+    const PhysBackend *backend,
+    const uint64_t virt_addr_64, 
+    const uint64_t root_addr_64, 
+    uint64_t *phys_addr_64
+) {
+    PhysReader reader = { NULL, NULL, NULL, backend };
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+    uint8_t result = va2pa_64_walk(virt_addr_64, root_addr_64, &reader, NULL, phys_addr_64, &page_shift);
+    STATS_CALL_END(STATS_CALL_WALK, result, page_shift);
+    return result;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                             NESTED TRANSLATION                             */
+/* -------------------------------------------------------------------------- */
+
+// Formats of the host paging structures of a nested translation
+typedef enum {
+    NESTED_NPT, // AMD nested page tables (nCR3 root), same format as long mode paging structures
+    NESTED_EPT // Intel extended page tables (EPTP root)
+} NestedFormat;
+
+// Function translates a guest-physical address into a host-physical one, the host cache is looked up first
+static inline __attribute__((always_inline)) TranslationState32 nested_host(
+    const WalkMode *host,
+    const PhysReader *reader,
+    TranslationCache *tc,
+    const uint64_t host_root,
+    const uint64_t guest_phys,
+    uint64_t *host_phys,
+    uint8_t *page_shift
+) {
+    if (tc != NULL && tcache_lookup(tc, host->levels, host_root, guest_phys, host_phys, page_shift)) {
+        return ST_SUCCESS_32;
+    }
+
+    TranslationState32 state = walk_core(host, READER_FUNC_64, reader, tc, guest_phys, host_root, host_phys, page_shift);
+
+    if (state == ST_SUCCESS_32 && tc != NULL) {
+        tcache_fill(tc, host->levels, host_root, guest_phys, *host_phys, *page_shift);
+    }
+
+    return state;
+}
+
+/**
+ * @name nested_walk
+ * @description:
+ *  Function walks the guest paging structures of a given mode like walk_core(), only every guest entry is
+ *  at a guest-physical address that is translated by a host walk before it is read, and so is the page the
+ *  guest walk ends in. Without the host cache a long mode guest on 4-level host tables takes 24 reads, with
+ *  the host frames of the guest tables cached it takes the 4 reads of a native walk
+ */
+static inline __attribute__((always_inline)) TranslationState32 nested_walk(
+    const WalkMode *mode,
+    const WalkMode *host,
+    const PhysReader *reader,
+    TranslationCache *tc,
+    const uint64_t virt_addr,
+    const uint64_t guest_root,
+    const uint64_t host_root,
+    uint64_t *phys_addr,
+    uint8_t *page_shift
+) {
+    uint64_t entry = guest_root;
+    uint64_t guest_phys, host_phys;
+    uint8_t host_shift = 0;
+    TranslationState32 state;
+
+#pragma GCC unroll 4
+    for (int i = 0; i < mode->levels; i++) {
+        const WalkLevel *level = &mode->level[i];
+
+        guest_phys = (entry & level->table_mask) + ((virt_addr >> level->shift) & level->index_mask) * mode->entry_size;
+
+        if ((state = nested_host(host, reader, tc, host_root, guest_phys, &host_phys, &host_shift)) != ST_SUCCESS_32) {
+            return state;
+        }
+
+        if (mode->entry_size == sizeof(uint32_t)) {
+            uint32_t entry_32 = 0;
+            state = reader_load_as(READER_FUNC_64, reader, &entry_32, sizeof(entry_32), host_phys);
+            entry = entry_32;
+        } else {
+            uint64_t entry_64 = 0;
+            state = reader_load_as(READER_FUNC_64, reader, &entry_64, sizeof(entry_64), host_phys);
+            entry = entry_64;
+        }
+
+        STATS_ADD(reads[i], 1);
+
+        if (state != ST_SUCCESS_32) {
+            REPORT_READ_ERROR(level->name, host_phys, mode->entry_size);
+            return ST_RAM_READ_ERROR_32;
+        }
+
+        // Guest entries are reported at their guest-physical addresses
+        if ((state = level->check(entry)) != ST_SUCCESS_32) {
+            DIAG_EMIT(DIAG_ENTRY_ERROR, state, level->name, guest_phys, entry, mode->entry_size);
+            return state;
+        }
+
+        if (i == mode->levels - 1 || (level->leaf_bit != 0 && (entry & (1ULL << level->leaf_bit)))) {
+            if (i == mode->levels - 1) {
+                REPORT_NOT_DIRTY(guest_phys, entry, mode->entry_size);
+            }
+
+            guest_phys = (entry & level->page_mask) + (virt_addr & ((1ULL << level->shift) - 1));
+
+            if ((state = nested_host(host, reader, tc, host_root, guest_phys, phys_addr, &host_shift)) != ST_SUCCESS_32) {
+                return state;
+            }
+
+            // Host-physically contiguous only as far as both the guest and the host page go
+            *page_shift = host_shift < level->shift ? host_shift : level->shift;
+            return ST_SUCCESS_32;
+        }
+    }
+
+    __builtin_unreachable(); // the last level always maps a page
+}
+
+// Function specializes nested_walk() for the format of the host paging structures
+static inline __attribute__((always_inline)) TranslationState32 nested_format(
+    const WalkMode *mode,
+    const NestedFormat format,
+    const PhysReader *reader,
+    TranslationCache *tc,
+    const uint64_t virt_addr,
+    const uint64_t guest_root,
+    const uint64_t host_root,
+    uint64_t *phys_addr,
+    uint8_t *page_shift
+) {
+    if (format == NESTED_EPT) {
+        return nested_walk(mode, &WalkModeEPT, reader, tc, virt_addr, guest_root, host_root, phys_addr, page_shift);
+    }
+
+    return nested_walk(mode, &WalkModeNPT, reader, tc, virt_addr, guest_root, host_root, phys_addr, page_shift);
+}
+
+/**
+ * @name va2pa_nested
+ * @param level
+ *  Guest paging mode: 2 for legacy, 3 for PAE and 4 for long mode, legacy and PAE only use the low 32 bits
+ *  of virt_addr and guest_root
+ * @param virt_addr
+ *  Guest virtual address to be translated
+ * @param guest_root
+ *  Guest CR3, it holds a guest-physical address
+ * @param host_root
+ *  Root of the host paging structures, EPTP or nCR3 (host-physical, low 12 bits are ignored)
+ * @param format
+ *  NESTED_EPT or NESTED_NPT, format of the host paging structures
+ * @param read_func_64
+ *  Function that reads host-physical memory
+ * @param tc
+ *  Translation cache created by tcache_create() that is only used for nested translations of one host format,
+ *  or NULL. It holds guest-physical to host-physical translations (of guest table frames and guest pages) and
+ *  host paging-structure entries, flush it with tcache_flush_page() / tcache_flush_root() using the host root
+ *  and a guest-physical address when the host paging structures change
+ * @param phys_addr
+ *  Host-physical address the guest virtual address ends in (output buffer)
+ * @returns uint8_t
+ *  Returns 0 on success, otherwise the code of the guest or host entry that failed. Diagnostics name host
+ *  entries "ept ..." or "npt ..." and report guest entries at their guest-physical addresses
+ * @description:
+ *  Function performs a two-dimensional translation of a guest virtual address into a host-physical address
+ *  the way a CPU with EPT / NPT does. Changes of the guest paging structures need no flush, they are not cached
+ */
+uint8_t va2pa_nested(
+    const unsigned int level,
+    const uint64_t virt_addr,
+    const uint64_t guest_root,
+    const uint64_t host_root,
+    const NestedFormat format,
+    const PREAD_FUNC_64 read_func_64,
+    TranslationCache *tc,
+    uint64_t *phys_addr
+) {
+    PhysReader reader = { NULL, read_func_64, NULL, NULL };
+    TranslationState32 result;
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+
+    if (level == 4) {
+        result = nested_format(&WalkMode64, format, &reader, tc, virt_addr, guest_root, host_root, phys_addr, &page_shift);
+    } else if (level == 3) {
+        result = nested_format(&WalkModePAE, format, &reader, tc, (uint32_t) virt_addr, (uint32_t) guest_root, host_root, phys_addr, &page_shift);
+    } else if (level == 2) {
+        result = nested_format(&WalkModeLegacy, format, &reader, tc, (uint32_t) virt_addr, (uint32_t) guest_root, host_root, phys_addr, &page_shift);
+    } else {
+        DIAG_EMIT(DIAG_INCORRECT_LEVEL, ST_INCORRECT_LEVEL_32, NULL, 0, level, 0);
+        result = ST_INCORRECT_LEVEL_32;
+    }
+
+    STATS_CALL_END(STATS_CALL_NESTED, result, page_shift);
+    return (uint8_t) result;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                          SHARED TRANSLATION CACHE                          */
+/* -------------------------------------------------------------------------- */
+
+#define SHARED_ROOT_SLOTS 256 // Root generations tcache_shared_flush_root() bumps, roots are hashed onto them
+
+// Struct represents a cached translation of a SharedCache, every field is accessed atomically.
+// seq is a per-entry seqlock: odd while a thread writes the entry, readers retry the lookup elsewhere then
+typedef struct {
+    uint64_t seq;
+    uint64_t root;
+    uint64_t vpn;
+    uint64_t frame;
+    uint64_t epoch; // SharedCache epoch of the root when the walk started, older entries are stale
+    uint32_t level; // same as in TLBEntry, 0 if the entry is empty or was flushed
+    uint32_t page_shift;
+} SharedEntry;
+
+// Struct represents a set-associative translation cache that any amount of threads look up and fill at once
+typedef struct {
+    SharedEntry *entries; // sets * ways entries, ways of a set are adjacent
+    unsigned int sets; // power of two
+    unsigned int ways;
+    uint64_t page_shifts; // bit N is set if entries with page_shift N may be cached, only ever grows
+    uint32_t generation; // bumped by tcache_shared_flush_all()
+    uint32_t page_flushes; // bumped by tcache_shared_flush_page() before it clears entries
+    uint32_t root_generations[SHARED_ROOT_SLOTS]; // bumped by tcache_shared_flush_root()
+} SharedCache;
+
+// Struct remembers the state of a SharedCache when a lookup missed, a walk result is only cached if it is still current
+typedef struct {
+    uint64_t epoch;
+    uint32_t page_flushes;
+} SharedTicket;
+
+static inline uint32_t* scache_root_generation(SharedCache *sc, const uint64_t root) {
+    return &sc->root_generations[tcache_salt(root, 0) & (SHARED_ROOT_SLOTS - 1)];
+}
+
+// Function returns the epoch an entry of a given root has to carry to be current
+static inline uint64_t scache_epoch(SharedCache *sc, const uint64_t root) {
+    return (uint64_t) __atomic_load_n(&sc->generation, __ATOMIC_ACQUIRE) << 32 |
+        __atomic_load_n(scache_root_generation(sc, root), __ATOMIC_ACQUIRE);
+}
+
+static inline SharedEntry* scache_set(const SharedCache *sc, const uint64_t root, const uint64_t vpn, const uint8_t page_shift) {
+    unsigned int set = (unsigned int)((vpn ^ tcache_salt(root, page_shift)) & (sc->sets - 1));
+    return &sc->entries[set * sc->ways];
+}
+
+// Function takes the seqlock of an entry for writing, returns the even sequence it had or 1 if another thread writes it
+static inline uint64_t scache_lock(SharedEntry *entry) {
+    uint64_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+
+    if ((seq & 1) || !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 1;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE); // readers that see the new fields see the odd sequence
+    return seq;
+}
+
+static inline void scache_unlock(SharedEntry *entry, const uint64_t seq) {
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Function frees a cache created by tcache_shared_create(), no thread may use it anymore
+void tcache_shared_destroy(SharedCache *sc) {
+    if (sc != NULL) {
+        free(sc->entries);
+        free(sc);
+    }
+}
+
+/**
+ * @name tcache_shared_create
+ * @param entries
+ *  Total amount of translations the cache can hold (0 for TLB_DEFAULT_ENTRIES)
+ * @param ways
+ *  Amount of entries per set (0 for TLB_DEFAULT_WAYS)
+ * @returns SharedCache*
+ *  Returns a new empty cache or NULL if memory could not be allocated
+ * @description:
+ *  Function creates a translation cache to be passed to va2pa_shared() and va2pa_64_shared() from any amount
+ *  of threads at once. Lookups take no locks and write nothing, a fill only locks the entry it replaces and
+ *  gives up if another thread holds it. Unlike TranslationCache it holds no paging-structure entries and
+ *  replaces entries at random instead of LRU, so hits do not make threads write to shared cache lines
+ */
+SharedCache* tcache_shared_create(unsigned int entries, unsigned int ways) {
+    if (entries == 0) {
+        entries = TLB_DEFAULT_ENTRIES;
+    }
+
+    if (ways == 0) {
+        ways = TLB_DEFAULT_WAYS;
+    }
+
+    SharedCache *sc = calloc(1, sizeof(SharedCache));
+    if (sc == NULL) {
+        return NULL;
+    }
+
+    sc->sets = tcache_sets_for(entries, ways);
+    sc->ways = ways;
+    if ((sc->entries = calloc((size_t) sc->sets * ways, sizeof(SharedEntry))) == NULL) {
+        free(sc);
+        return NULL;
+    }
+
+    return sc;
+}
+
+// Function looks up a cached translation, returns 1 on a hit and 0 on a miss, in which case ticket is set for scache_fill()
+static int scache_lookup(
+    SharedCache *sc, const uint8_t level, const uint64_t root, const uint64_t virt_addr,
+    uint64_t *phys_addr, uint8_t *page_shift_out, SharedTicket *ticket
+) {
+    uint64_t page_shifts = __atomic_load_n(&sc->page_shifts, __ATOMIC_RELAXED);
+
+    ticket->page_flushes = __atomic_load_n(&sc->page_flushes, __ATOMIC_ACQUIRE);
+    ticket->epoch = scache_epoch(sc, root);
+
+    for (int i = 0; i < 4 && TLBPageShifts[level][i] != 0; i++) {
+        uint8_t page_shift = TLBPageShifts[level][i];
+
+        if (!(page_shifts & (1ULL << page_shift))) {
+            continue;
+        }
+
+        uint64_t vpn = virt_addr >> page_shift;
+        SharedEntry *set = scache_set(sc, root, vpn, page_shift);
+
+        for (unsigned int way = 0; way < sc->ways; way++) {
+            SharedEntry *entry = &set[way];
+            uint64_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+            if (seq & 1) { // being written, treated as a miss
+                continue;
+            }
+
+            uint64_t entry_vpn = __atomic_load_n(&entry->vpn, __ATOMIC_RELAXED);
+            uint64_t entry_root = __atomic_load_n(&entry->root, __ATOMIC_RELAXED);
+            uint64_t frame = __atomic_load_n(&entry->frame, __ATOMIC_RELAXED);
+            uint64_t epoch = __atomic_load_n(&entry->epoch, __ATOMIC_RELAXED);
+            uint32_t entry_level = __atomic_load_n(&entry->level, __ATOMIC_RELAXED);
+            uint32_t entry_shift = __atomic_load_n(&entry->page_shift, __ATOMIC_RELAXED);
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq) { // torn read
+                continue;
+            }
+
+            if (entry_vpn == vpn && entry_root == root && entry_level == level && 
+                entry_shift == page_shift && epoch == ticket->epoch) {
+                *phys_addr = frame + (virt_addr & ((1ULL << page_shift) - 1));
+                *page_shift_out = page_shift;
+                STATS_ADD(hits[STATS_SHARED], 1);
+                return 1;
+            }
+        }
+    }
+
+    STATS_ADD(misses[STATS_SHARED], 1);
+    return 0;
+}
+
+// Function caches a successful translation unless the cache was flushed since the lookup that handed out the ticket
+static void scache_fill(
+    SharedCache *sc, const uint8_t level, const uint64_t root, const uint64_t virt_addr, 
+    const uint64_t phys_addr, const uint8_t page_shift, const SharedTicket *ticket
+) {
+    static _Thread_local uint32_t victim_seed = 0x9E3779B9;
+    uint64_t vpn = virt_addr >> page_shift;
+    SharedEntry *set = scache_set(sc, root, vpn, page_shift);
+    SharedEntry *victim = NULL;
+
+    // An empty or stale way if there is one, a random way otherwise
+    for (unsigned int way = 0; way < sc->ways && victim == NULL; way++) {
+        if (__atomic_load_n(&set[way].level, __ATOMIC_RELAXED) == 0 ||
+            __atomic_load_n(&set[way].epoch, __ATOMIC_RELAXED) >> 32 != ticket->epoch >> 32) {
+            victim = &set[way];
+        }
+    }
+
+    if (victim == NULL) {
+        victim_seed ^= victim_seed << 13;
+        victim_seed ^= victim_seed >> 17;
+        victim_seed ^= victim_seed << 5;
+        victim = &set[victim_seed % sc->ways];
+    }
+
+    uint64_t seq = scache_lock(victim);
+    if (seq & 1) { // another thread fills the same entry, this translation is simply not cached
+        return;
+    }
+
+    __atomic_store_n(&victim->root, root, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->vpn, vpn, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->frame, phys_addr & ~((1ULL << page_shift) - 1), __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->epoch, ticket->epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->level, level, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->page_shift, page_shift, __ATOMIC_RELAXED);
+    scache_unlock(victim, seq);
+
+    if (!(__atomic_load_n(&sc->page_shifts, __ATOMIC_RELAXED) & (1ULL << page_shift))) {
+        __atomic_or_fetch(&sc->page_shifts, 1ULL << page_shift, __ATOMIC_RELAXED);
+    }
+
+    // A page flush that started after the lookup may have missed this entry, which can hold what it flushed.
+    // Either the flush finds the entry or the fence makes its page_flushes increment visible here
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sc->page_flushes, __ATOMIC_RELAXED) != ticket->page_flushes) {
+        while ((seq = scache_lock(victim)) & 1) {
+            sched_yield();
+        }
+
+        if (__atomic_load_n(&victim->vpn, __ATOMIC_RELAXED) == vpn && __atomic_load_n(&victim->root, __ATOMIC_RELAXED) == root) {
+            __atomic_store_n(&victim->level, 0, __ATOMIC_RELAXED);
+        }
+
+        scache_unlock(victim, seq);
+    }
+}
+
+/**
+ * @name tcache_shared_flush_page
+ * @description:
+ *  Function drops every cached translation of a given address space that covers a given virtual address.
+ *  Lookups running at the same time may still return the old translation, lookups that start after the
+ *  function returns do not, and neither do walks that were in flight when it was called
+ */
+void tcache_shared_flush_page(SharedCache *sc, const uint64_t root_addr, const uint64_t virt_addr) {
+    __atomic_add_fetch(&sc->page_flushes, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with the fence at the end of scache_fill()
+    uint64_t page_shifts = __atomic_load_n(&sc->page_shifts, __ATOMIC_RELAXED);
+
+    for (uint8_t page_shift = 12; page_shift <= 30; page_shift++) {
+        if (!(page_shifts & (1ULL << page_shift))) {
+            continue;
+        }
+
+        uint64_t vpn = virt_addr >> page_shift;
+        SharedEntry *set = scache_set(sc, root_addr, vpn, page_shift);
+
+        for (unsigned int way = 0; way < sc->ways; way++) {
+            SharedEntry *entry = &set[way];
+
+            if (__atomic_load_n(&entry->vpn, __ATOMIC_RELAXED) != vpn || __atomic_load_n(&entry->root, __ATOMIC_RELAXED) != root_addr) {
+                // A fill that writes this address right now checks page_flushes after it is done
+                continue;
+            }
+
+            uint64_t seq;
+            while ((seq = scache_lock(entry)) & 1) {
+                sched_yield();
+            }
+
+            if (__atomic_load_n(&entry->vpn, __ATOMIC_RELAXED) == vpn && __atomic_load_n(&entry->root, __ATOMIC_RELAXED) == root_addr &&
+                __atomic_load_n(&entry->page_shift, __ATOMIC_RELAXED) == page_shift) {
+                __atomic_store_n(&entry->level, 0, __ATOMIC_RELAXED);
+            }
+
+            scache_unlock(entry, seq);
+        }
+    }
+}
+
+/**
+ * @name tcache_shared_flush_root
+ * @description:
+ *  Function drops every cached translation that was reached from a given root in constant time by moving
+ *  the root to a new epoch. Roots share SHARED_ROOT_SLOTS epochs, so other roots may lose their entries too
+ */
+void tcache_shared_flush_root(SharedCache *sc, const uint64_t root_addr) {
+    __atomic_add_fetch(scache_root_generation(sc, root_addr), 1, __ATOMIC_RELEASE);
+}
+
+// Function drops every cached translation in constant time, see tcache_shared_flush_root()
+void tcache_shared_flush_all(SharedCache *sc) {
+    __atomic_add_fetch(&sc->generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @name va2pa_shared
+ * @param sc
+ *  Cache created by tcache_shared_create() or NULL to always walk the tables
+ * @description:
+ *  Same as va2pa_cached, but the cache may be used by any amount of threads at the same time.
+ *  A translation is only cached if no flush of its address space ran while it was walked
+ */
+int va2pa_shared(
+    SharedCache *sc,
+    const unsigned int virt_addr, 
+    const unsigned int level, 
+    const unsigned int root_addr, 
+    const PREAD_FUNC read_func, 
+    uint64_t *phys_addr
+) {
+    if (sc == NULL || level > 3 || level < 2) {
+        return va2pa(virt_addr, level, root_addr, read_func, phys_addr);
+    }
+
+    SharedTicket ticket;
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+
+    if (scache_lookup(sc, level, root_addr, virt_addr, phys_addr, &page_shift, &ticket)) {
+        STATS_CALL_END(STATS_CALL_CACHED, ST_SUCCESS_32, page_shift);
+        return ST_SUCCESS_32;
+    }
+
+    PhysReader reader = { read_func, NULL, NULL, NULL };
+    int result = va2pa_walk(virt_addr, level, root_addr, &reader, NULL, phys_addr, &page_shift);
+
+    if (result == ST_SUCCESS_32) {
+        scache_fill(sc, level, root_addr, virt_addr, *phys_addr, page_shift, &ticket);
+    }
+
+    STATS_CALL_END(STATS_CALL_CACHED, result, page_shift);
+    return result;
+}
+
+/**
+ * @name va2pa_64_shared
+ * @description:
+ *  Same as va2pa_shared, only for va2pa_64 translations
+ */
+uint8_t va2pa_64_shared(
+    SharedCache *sc,
+    const uint64_t virt_addr_64, 
+    const uint64_t root_addr_64, 
+    const PREAD_FUNC_64 read_func_64, 
+    uint64_t *phys_addr_64
+) {
+    if (sc == NULL) {
+        return va2pa_64(virt_addr_64, root_addr_64, read_func_64, phys_addr_64);
+    }
+
+    SharedTicket ticket;
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+
+    if (scache_lookup(sc, 4, root_addr_64, virt_addr_64, phys_addr_64, &page_shift, &ticket)) {
+        STATS_CALL_END(STATS_CALL_CACHED, ST_SUCCESS_32, page_shift);
+        return ST_SUCCESS_32;
+    }
+
+    PhysReader reader = { NULL, read_func_64, NULL, NULL };
+    uint8_t result = va2pa_64_walk(virt_addr_64, root_addr_64, &reader, NULL, phys_addr_64, &page_shift);
+
+    if (result == ST_SUCCESS_32) {
+        scache_fill(sc, 4, root_addr_64, virt_addr_64, *phys_addr_64, page_shift, &ticket);
+    }
+
+    STATS_CALL_END(STATS_CALL_CACHED, result, page_shift);
+    return result;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                             BATCH TRANSLATION                              */
+/* -------------------------------------------------------------------------- */
+
+// Struct represents a virtual address of a batch together with its position in the caller's arrays
+typedef struct {
+    uint64_t virt_addr;
+    size_t index;
+} BatchItem;
+
+// Struct remembers the last paging-structure entry read at one level of a batched walk
+typedef struct {
+    uint64_t addr; // physical address the entry was read from
+    uint64_t entry;
+    TranslationState32 state; // result of reading and checking the entry
+    uint8_t valid;
+} BatchMemo;
+
+static int batch_item_cmp(const void *a, const void *b) {
+    uint64_t va = ((const BatchItem*) a)->virt_addr, vb = ((const BatchItem*) b)->virt_addr;
+    return (va > vb) - (va < vb);
+}
+
+// Function reads and checks a paging-structure entry unless it is the one the level read last
+static TranslationState32 batch_entry(
+    BatchMemo *memo, 
+    const int depth,
+    const PhysReader *reader, 
+    const uint64_t addr, 
+    TranslationState32 (*check)(const uint64_t), 
+    const char *name,
+    uint64_t *entry
+) {
+    if (!memo->valid || memo->addr != addr) {
+        memo->addr = addr;
+        memo->valid = 1;
+        STATS_ADD(misses[STATS_BATCH], 1);
+        STATS_ADD(reads[depth], 1);
+
+        if (READ_ENTRY(reader, memo->entry, addr) != ST_SUCCESS_32) {
+            REPORT_READ_ERROR(name, addr, sizeof(uint64_t));
+            memo->state = ST_RAM_READ_ERROR_32;
+        } else if ((memo->state = check(memo->entry)) != ST_SUCCESS_32) {
+            REPORT_ENTRY_ERROR(memo->state, name, addr, memo->entry);
+        }
+    } else {
+        STATS_ADD(hits[STATS_BATCH], 1);
+    }
+
+    (void) name;
+    (void) depth;
+    *entry = memo->entry;
+    return memo->state;
+}
+
+// Function translates one address of a batch, reusing entries the previous address of the batch read
+static TranslationState32 batch_translate_64(
+    BatchMemo memo[4], 
+    const uint64_t virt_addr_64, 
+    const uint64_t root_addr_64, 
+    const PhysReader *reader, 
+    uint64_t *phys_addr_64,
+    uint8_t *page_shift
+) {
+    uint64_t pml4e, pdpte, pde, pte;
+    TranslationState32 state;
+
+    state = batch_entry(&memo[0], 0, reader, pml4e_addr_64(root_addr_64, virt_addr_64), check_pml4e, "pml4e", &pml4e);
+    if (state != ST_SUCCESS_32) {
+        return state;
+    }
+
+    state = batch_entry(&memo[1], 1, reader, pdpte_addr_64(pml4e, virt_addr_64), check_pdpte_64, "pdpte", &pdpte);
+    if (state != ST_SUCCESS_32) {
+        return state;
+    }
+
+    if (pdpte & (1 << PDPTEBits.pse)) { // 1Gb page
+        *phys_addr_64 = (pdpte & 0xFFFFFC0000000) + (virt_addr_64 & 0x3FFFFFFF);
+        *page_shift = 30;
+        return ST_SUCCESS_32;
+    }
+
+    state = batch_entry(&memo[2], 2, reader, pde_addr_64(pdpte, virt_addr_64), check_pde_64, "pde", &pde);
+    if (state != ST_SUCCESS_32) {
+        return state;
+    }
+
+    if (pde & (1 << PDEBitsPAE.pse)) { // 2Mb page
+        *phys_addr_64 = (pde & 0xFFFFFFFE00000) + (virt_addr_64 & 0x1FFFFF);
+        *page_shift = 21;
+        return ST_SUCCESS_32;
+    }
+
+    state = batch_entry(&memo[3], 3, reader, pte_addr_64(pde, virt_addr_64), check_pte_64, "pte", &pte);
+    if (state != ST_SUCCESS_32) {
+        return state;
+    }
+
+    REPORT_NOT_DIRTY(memo[3].addr, pte, sizeof(pte));
+
+    *phys_addr_64 = (pte & 0xFFFFFFFFFFFFF000) + (virt_addr_64 & 0xFFF);
+    *page_shift = 12;
+    return ST_SUCCESS_32;
+}
+
+/**
+ * @name va2pa_64_batch
+ * @param virt_addrs
+ *  Array of n virtual addresses to be translated, it does not have to be sorted
+ * @param n
+ *  Amount of addresses in the batch
+ * @param root_addr_64
+ *  Root address (CR3) all addresses of the batch are translated with
+ * @param read_func_64
+ *  Function that reads physical memory, same as for va2pa_64
+ * @param phys_addrs
+ *  Output array of n physical addresses, an element is only written if its translation succeeded
+ * @param states
+ *  Output array of n result codes, states[i] is what va2pa_64 would have returned for virt_addrs[i]
+ * @returns size_t
+ *  Returns the amount of successfully translated addresses
+ * @description:
+ *  Function translates a batch of virtual addresses of one address space. Addresses are walked in 
+ *  ascending order so addresses that share a PML4E, PDPTE, PDE or PTE follow each other and the shared
+ *  entry is read and checked only once per batch. A failing address only fails its own translation
+ */
+size_t va2pa_64_batch(
+    const uint64_t *virt_addrs,
+    const size_t n,
+    const uint64_t root_addr_64,
+    const PREAD_FUNC_64 read_func_64,
+    uint64_t *phys_addrs,
+    TranslationState32 *states
+) {
+    PhysReader reader = { NULL, read_func_64, NULL, NULL };
+    BatchMemo memo[4] = { 0 };
+    size_t translated = 0;
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+
+    int sorted = 1;
+    for (size_t i = 1; i < n && sorted; i++) {
+        sorted = virt_addrs[i - 1] <= virt_addrs[i];
+    }
+
+    BatchItem *items = sorted ? NULL : malloc(n * sizeof(BatchItem));
+
+    if (items == NULL) { // Already sorted (or no memory to sort), walk in the given order
+        for (size_t i = 0; i < n; i++) {
+            states[i] = batch_translate_64(memo, virt_addrs[i], root_addr_64, &reader, &phys_addrs[i], &page_shift);
+            translated += states[i] == ST_SUCCESS_32;
+            STATS_TRANSLATION(states[i], page_shift);
+        }
+
+        STATS_LATENCY(STATS_CALL_BATCH);
+        return translated;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        items[i].virt_addr = virt_addrs[i];
+        items[i].index = i;
+    }
+
+    qsort(items, n, sizeof(BatchItem), batch_item_cmp);
+
+    for (size_t i = 0; i < n; i++) {
+        size_t index = items[i].index;
+        states[index] = batch_translate_64(memo, items[i].virt_addr, root_addr_64, &reader, &phys_addrs[index], &page_shift);
+        translated += states[index] == ST_SUCCESS_32;
+        STATS_TRANSLATION(states[index], page_shift);
+    }
+
+    free(items);
+    STATS_LATENCY(STATS_CALL_BATCH);
+    return translated;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                          ASYNCHRONOUS TRANSLATION                          */
+/* -------------------------------------------------------------------------- */
+
+// Struct represents a walk that is suspended whenever it needs a paging-structure entry. The caller reads
+// size bytes at physical address addr into buf by any means and resumes the walk with walk_resume()
+typedef struct {
+    const WalkMode *mode;
+    uint64_t virt_addr;
+    uint64_t root_addr;
+    uint64_t entry; // entry the walk reached last, root_addr before the first read
+    uint64_t addr; // physical address of the entry the walk waits for
+    uint64_t phys_addr; // result of a successful walk
+    TranslationState32 state; // result of the walk once it is done
+    uint8_t depth; // level of the entry the walk waits for, 0 is the structure the root points to
+    uint8_t size; // size of the entry the walk waits for
+    uint8_t page_shift; // log2 of the size of the page a successful walk ended in
+    uint8_t done;
+    uint8_t buf[8]; // entry the walk waits for is read into it
+} WalkState;
+
+// Function ends a walk with a given result, returns 0 so callers can return it as "no more reads"
+static uint8_t walk_finish(WalkState *walk, const TranslationState32 state) {
+    walk->state = state;
+    walk->done = 1;
+    STATS_TRANSLATION(state, walk->page_shift);
+    return 0;
+}
+
+// Function points a walk at the entry of the level it is at, mode is walk->mode passed separately so that
+// callers with a constant mode get the level tables folded into immediates like walk_core()
+static inline __attribute__((always_inline)) uint8_t walk_request(WalkState *walk, const WalkMode *mode) {
+    const WalkLevel *level = &mode->level[walk->depth];
+
+    walk->addr = (walk->entry & level->table_mask) + ((walk->virt_addr >> level->shift) & level->index_mask) * mode->entry_size;
+    walk->size = mode->entry_size;
+    return 1;
+}
+
+// Function starts a walk of a given mode, see walk_start()
+static inline __attribute__((always_inline)) uint8_t walk_begin(
+    WalkState *walk, const WalkMode *mode, const uint64_t virt_addr, const uint64_t root_addr
+) {
+    memset(walk, 0, offsetof(WalkState, buf));
+    walk->mode = mode;
+    walk->virt_addr = virt_addr;
+    walk->root_addr = root_addr;
+    walk->entry = root_addr;
+    return walk_request(walk, mode);
+}
+
+/**
+ * @name walk_start
+ * @param level
+ *  2 for legacy, 3 for PAE and 4 for long mode translations
+ * @returns uint8_t
+ *  Returns 1 if the walk needs the entry at walk->addr and 0 if it is already done (wrong level)
+ * @description:
+ *  Function starts a resumable walk, it performs the same translation as va2pa() or va2pa_64() but never
+ *  reads memory itself. Legacy and PAE walks only use the low 32 bits of the addresses
+ */
+uint8_t walk_start(WalkState *walk, const unsigned int level, const uint64_t virt_addr, const uint64_t root_addr) {
+    if (level == 4) {
+        return walk_begin(walk, &WalkMode64, virt_addr, root_addr);
+    } else if (level == 2 || level == 3) {
+        return walk_begin(walk, level == 2 ? &WalkModeLegacy : &WalkModePAE, (uint32_t) virt_addr, (uint32_t) root_addr);
+    }
+
+    memset(walk, 0, offsetof(WalkState, buf));
+    DIAG_EMIT(DIAG_INCORRECT_LEVEL, ST_INCORRECT_LEVEL_32, NULL, 0, level, 0);
+    return walk_finish(walk, ST_INCORRECT_LEVEL_32);
+}
+
+// Function checks the entry a walk of a given mode waited for, see walk_resume()
+static inline __attribute__((always_inline)) uint8_t walk_advance(WalkState *walk, const WalkMode *mode, const unsigned int read) {
+    const WalkLevel *level = &mode->level[walk->depth];
+    TranslationState32 state;
+    uint64_t entry;
+
+    STATS_ADD(reads[walk->depth], 1);
+
+    if (read < mode->entry_size) {
+        REPORT_READ_ERROR(level->name, walk->addr, mode->entry_size);
+        return walk_finish(walk, ST_RAM_READ_ERROR_32);
+    }
+
+    if (mode->entry_size == sizeof(uint32_t)) {
+        uint32_t entry_32;
+        memcpy(&entry_32, walk->buf, sizeof(entry_32));
+        entry = entry_32;
+    } else {
+        memcpy(&entry, walk->buf, sizeof(entry));
+    }
+
+    if ((state = level->check(entry)) != ST_SUCCESS_32) {
+        DIAG_EMIT(DIAG_ENTRY_ERROR, state, level->name, walk->addr, entry, mode->entry_size);
+        return walk_finish(walk, state);
+    }
+
+    if (walk->depth == mode->levels - 1 || (level->leaf_bit != 0 && (entry & (1ULL << level->leaf_bit)))) {
+        if (walk->depth == mode->levels - 1 && mode->report_dirty) {
+            REPORT_NOT_DIRTY(walk->addr, entry, mode->entry_size);
+        }
+
+        walk->phys_addr = (entry & level->page_mask) + (walk->virt_addr & ((1ULL << level->shift) - 1));
+        walk->page_shift = level->shift;
+        return walk_finish(walk, ST_SUCCESS_32);
+    }
+
+    walk->entry = entry;
+    walk->depth++;
+    return walk_request(walk, mode);
+}
+
+/**
+ * @name walk_resume
+ * @param read
+ *  Amount of bytes of the requested entry that were read into walk->buf, less than walk->size is a read error
+ * @returns uint8_t
+ *  Returns 1 if the walk needs the next entry at walk->addr and 0 once it is done, the result is in
+ *  walk->state, walk->phys_addr and walk->page_shift
+ * @description:
+ *  Function checks the entry a walk waited for and either finishes the walk or advances it to the next level
+ */
+uint8_t walk_resume(WalkState *walk, const unsigned int read) {
+    return walk_advance(walk, walk->mode, read);
+}
+
+// Struct represents a finished asynchronous read
+typedef struct {
+    void *tag; // tag the read was submitted with
+    unsigned int read; // amount of bytes read, less than requested on errors
+} AsyncCompletion;
+
+// Queues a read of size bytes at a physical address into buf, returns 0 if the read could not be queued
+typedef uint8_t (*ASYNC_SUBMIT_FUNC)(void *ctx, void *buf, const unsigned int size, const uint64_t physical_addr, void *tag);
+
+// Starts the queued reads and waits for at least one of the reads in flight to finish, returns the amount of
+// completions written to done (at most max) or 0 on an error of the backend. A backend that fails must not
+// leave any submitted read running or reporting a completion later, their buffers are released right after
+typedef size_t (*ASYNC_COMPLETE_FUNC)(void *ctx, AsyncCompletion *done, const size_t max);
+
+// Struct represents an asynchronous physical memory backend
+typedef struct {
+    ASYNC_SUBMIT_FUNC submit;
+    ASYNC_COMPLETE_FUNC complete;
+    void *ctx;
+} AsyncReader;
+
+// Struct represents a walk of va2pa_async() together with the position of its address in the caller's arrays
+typedef struct {
+    WalkState walk;
+    size_t index;
+} AsyncSlot;
+
+/**
+ * @name va2pa_async
+ * @param level
+ *  2 for legacy, 3 for PAE and 4 for long mode translations, same as walk_start()
+ * @param reader
+ *  Asynchronous backend the paging-structure entries are read with
+ * @param inflight
+ *  Maximum amount of walks waiting for a read at the same time
+ * @param phys_addrs
+ *  Output array of n physical addresses, an element is only written if its translation succeeded
+ * @param states
+ *  Output array of n result codes
+ * @returns size_t
+ *  Returns the amount of successfully translated addresses
+ * @description:
+ *  Function translates n virtual addresses of one address space keeping up to inflight walks going at once.
+ *  Every walk that needs an entry submits its read, the backend gets them all before it is asked to complete
+ *  any, and a walk resumes as soon as its read completes. A read the backend refuses fails its translation
+ *  with ST_RAM_READ_ERROR_32, and so do the walks in flight and the ones not started yet if the backend reports
+ *  an error
+ */
+size_t va2pa_async(
+    const unsigned int level,
+    const uint64_t *virt_addrs,
+    const size_t n,
+    const uint64_t root_addr,
+    const AsyncReader *reader,
+    const unsigned int inflight,
+    uint64_t *phys_addrs,
+    TranslationState32 *states
+) {
+    size_t slot_count = inflight == 0 ? 1 : inflight;
+    AsyncSlot *slots = malloc(slot_count * sizeof(AsyncSlot));
+    AsyncSlot **free_slots = malloc(slot_count * sizeof(AsyncSlot*));
+    AsyncCompletion *done = malloc(slot_count * sizeof(AsyncCompletion));
+    size_t next = 0, free_count = slot_count, waiting = 0, translated = 0;
+    uint8_t failed = 0; // backend reported an error, walks are no longer submitted
+    STATS_CALL_BEGIN();
+
+    if (slots == NULL || free_slots == NULL || done == NULL) {
+        free(slots);
+        free(free_slots);
+        free(done);
+        return 0;
+    }
+
+    for (size_t i = 0; i < slot_count; i++) {
+        free_slots[i] = &slots[slot_count - 1 - i];
+    }
+
+    while (next < n || waiting > 0) {
+        // Starting walks until every slot waits for a read
+        while (next < n && free_count > 0) {
+            AsyncSlot *slot = free_slots[--free_count];
+            uint8_t reading = walk_start(&slot->walk, level, virt_addrs[next], root_addr);
+            slot->index = next++;
+
+            if (reading && !failed && (*reader->submit)(reader->ctx, slot->walk.buf, slot->walk.size, slot->walk.addr, slot)) {
+                waiting++;
+                continue;
+            }
+
+            if (reading) {
+                walk_resume(&slot->walk, 0);
+            }
+
+            states[slot->index] = slot->walk.state;
+            translated += slot->walk.state == ST_SUCCESS_32;
+            if (slot->walk.state == ST_SUCCESS_32) {
+                phys_addrs[slot->index] = slot->walk.phys_addr;
+            }
+
+            free_slots[free_count++] = slot;
+        }
+
+        if (waiting == 0) {
+            continue;
+        }
+
+        size_t count = (*reader->complete)(reader->ctx, done, slot_count);
+
+        if (count == 0) { // backend failed, every walk in flight fails and the rest are not started
+            for (size_t i = 0; i < slot_count; i++) {
+                AsyncSlot *slot = &slots[i];
+                uint8_t in_flight = 1;
+
+                for (size_t j = 0; j < free_count && in_flight; j++) {
+                    in_flight = free_slots[j] != slot;
+                }
+
+                if (in_flight) {
+                    walk_resume(&slot->walk, 0);
+                    states[slot->index] = slot->walk.state;
+                    free_slots[free_count++] = slot;
+                }
+            }
+
+            waiting = 0;
+            failed = 1;
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            AsyncSlot *slot = done[i].tag;
+
+            if (walk_resume(&slot->walk, done[i].read)) {
+                if ((*reader->submit)(reader->ctx, slot->walk.buf, slot->walk.size, slot->walk.addr, slot)) {
+                    continue;
+                }
+
+                walk_resume(&slot->walk, 0);
+            }
+
+            states[slot->index] = slot->walk.state;
+            translated += slot->walk.state == ST_SUCCESS_32;
+            if (slot->walk.state == ST_SUCCESS_32) {
+                phys_addrs[slot->index] = slot->walk.phys_addr;
+            }
+
+            free_slots[free_count++] = slot;
+            waiting--;
+        }
+    }
+
+    free(slots);
+    free(free_slots);
+    free(done);
+    STATS_LATENCY(STATS_CALL_ASYNC);
+    return translated;
+}
+
+/* ------------------------- Interleaved Image Walks ------------------------ */
+
+#define INTERLEAVE_GROUP 16 // Walks va2pa_64_image_batch() interleaves when it is given a group size of 0
+#define INTERLEAVE_GROUP_MAX 64
+
+// Struct represents a walk of va2pa_64_image_batch() together with the entry it prefetched
+typedef struct {
+    WalkState walk;
+    const uint8_t *data; // entry the walk waits for inside the image, NULL if it has to be copied out with memimage_read()
+    size_t index;
+} InterleaveSlot;
+
+// Function looks up the entry a walk waits for and starts loading it into the cache
+static inline __attribute__((always_inline)) void interleave_prefetch(const MemImage *image, InterleaveSlot *slot) {
+    slot->data = memimage_ptr(image, slot->walk.addr, sizeof(uint64_t));
+
+    if (slot->data != NULL) {
+        __builtin_prefetch(slot->data);
+    }
+}
+
+/**
+ * @name va2pa_64_image_batch
+ * @param image
+ *  Memory image the paging structures are read from
+ * @param virt_addrs
+ *  Array of n virtual addresses to be translated
+ * @param group
+ *  Amount of walks that are interleaved, 0 for INTERLEAVE_GROUP and at most INTERLEAVE_GROUP_MAX
+ * @param phys_addrs
+ *  Output array of n physical addresses, an element is only written if its translation succeeded
+ * @param states
+ *  Output array of n result codes, states[i] is what va2pa_64_image would have returned for virt_addrs[i]
+ * @returns size_t
+ *  Returns the amount of successfully translated addresses
+ * @description:
+ *  Function translates a batch of virtual addresses of one address space in a mapped image, taking one level
+ *  of group walks in turn. A walk prefetches the entry of its next level and the other walks of the group run
+ *  before it is loaded, so up to group cache misses of independent walks are outstanding at the same time
+ *  instead of one. Unlike va2pa_64_batch() nothing is sorted or shared between walks, this pays off on
+ *  scattered addresses whose paging structures do not fit in the cache
+ */
+size_t va2pa_64_image_batch(
+    const MemImage *image,
+    const uint64_t *virt_addrs,
+    const size_t n,
+    const uint64_t root_addr_64,
+    const unsigned int group,
+    uint64_t *phys_addrs,
+    TranslationState32 *states
+) {
+    InterleaveSlot slots[INTERLEAVE_GROUP_MAX];
+    size_t active = group == 0 ? INTERLEAVE_GROUP : group < INTERLEAVE_GROUP_MAX ? group : INTERLEAVE_GROUP_MAX;
+    size_t next = 0, translated = 0;
+    STATS_CALL_BEGIN();
+
+    active = active < n ? active : n;
+
+    for (size_t i = 0; i < active; i++) {
+        slots[i].index = next;
+        walk_begin(&slots[i].walk, &WalkMode64, virt_addrs[next++], root_addr_64);
+        interleave_prefetch(image, &slots[i]);
+    }
+
+    for (size_t i = 0; active > 0; i = i + 1 < active ? i + 1 : 0) {
+        InterleaveSlot *slot = &slots[i];
+        unsigned int read = sizeof(uint64_t);
+
+        if (slot->data != NULL) {
+            memcpy(slot->walk.buf, slot->data, sizeof(uint64_t));
+        } else { // not mapped, pread() images and holes
+            read = memimage_read(image, slot->walk.buf, sizeof(uint64_t), slot->walk.addr);
+        }
+
+        if (walk_advance(&slot->walk, &WalkMode64, read)) {
+            interleave_prefetch(image, slot);
+            continue;
+        }
+
+        states[slot->index] = slot->walk.state;
+        if (slot->walk.state == ST_SUCCESS_32) {
+            phys_addrs[slot->index] = slot->walk.phys_addr;
+            translated++;
+        }
+
+        if (next < n) { // the slot takes the next address
+            slot->index = next;
+            walk_begin(&slot->walk, &WalkMode64, virt_addrs[next++], root_addr_64);
+            interleave_prefetch(image, slot);
+        } else if (i != --active) { // the group shrinks, the last walk takes the place of the finished one
+            *slot = slots[active];
+        }
+    }
+
+    STATS_LATENCY(STATS_CALL_BATCH);
+    return translated;
+}
+
+/* -------------------- Synchronous Backend Adapter ------------------------- */
+
+// Struct represents an AsyncReader over a PREAD_FUNC_64, reads are done when they are submitted
+typedef struct {
+    PREAD_FUNC_64 read_func_64;
+    AsyncCompletion *done;
+    size_t count;
+    size_t capacity;
+} AsyncSync;
+
+static uint8_t async_sync_submit(void *ctx, void *buf, const unsigned int size, const uint64_t physical_addr, void *tag) {
+    AsyncSync *sync = ctx;
+
+    if (sync->count == sync->capacity) {
+        size_t capacity = sync->capacity == 0 ? 64 : sync->capacity * 2;
+        AsyncCompletion *done = realloc(sync->done, capacity * sizeof(AsyncCompletion));
+
+        if (done == NULL) {
+            return 0;
+        }
+
+        sync->done = done;
+        sync->capacity = capacity;
+    }
+
+    sync->done[sync->count].tag = tag;
+    sync->done[sync->count].read = (*sync->read_func_64)(buf, size, physical_addr);
+    sync->count++;
+    return 1;
+}
+
+static size_t async_sync_complete(void *ctx, AsyncCompletion *done, const size_t max) {
+    AsyncSync *sync = ctx;
+    size_t count = sync->count < max ? sync->count : max;
+
+    // Handing out the newest reads first keeps the queue a stack, completion order does not matter to walks
+    sync->count -= count;
+    memcpy(done, sync->done + sync->count, count * sizeof(AsyncCompletion));
+    return count;
+}
+
+/**
+ * @name async_sync_init
+ * @description:
+ *  Function makes an AsyncReader that reads with a PREAD_FUNC_64 while the reads are submitted, so that backends
+ *  without asynchronous reads can be passed to va2pa_async(). Free it with async_sync_release()
+ */
+void async_sync_init(AsyncSync *sync, AsyncReader *reader, const PREAD_FUNC_64 read_func_64) {
+    memset(sync, 0, sizeof(AsyncSync));
+    sync->read_func_64 = read_func_64;
+    reader->submit = async_sync_submit;
+    reader->complete = async_sync_complete;
+    reader->ctx = sync;
+}
+
+void async_sync_release(AsyncSync *sync) {
+    free(sync->done);
+    sync->done = NULL;
+    sync->count = sync->capacity = 0;
+}
+
+#ifdef VA2PA_URING
+/* ------------------------- io_uring Image Backend ------------------------- */
+
+// Struct represents an io_uring instance that reads a raw physical memory image file
+typedef struct {
+    int ring_fd;
+    int fd; // image file, physical address N is at file offset N
+    unsigned int entries; // size of the submission queue
+    unsigned int queued; // reads in the submission queue the kernel has not been told about
+    unsigned int pending; // reads submitted whose completions were not reaped yet
+    uint8_t failed; // an error stopped the backend, it refuses every read from then on
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+} AsyncUring;
+
+// Function frees an io_uring backend created by async_uring_create(), the image file is not closed
+void async_uring_destroy(AsyncUring *uring) {
+    if (uring == NULL) {
+        return;
+    }
+
+    if (uring->sqes != NULL) {
+        munmap(uring->sqes, uring->entries * sizeof(struct io_uring_sqe));
+    }
+
+    if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+
+    if (uring->sq_ring != NULL) {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+
+    if (uring->ring_fd >= 0) {
+        close(uring->ring_fd);
+    }
+
+    free(uring);
+}
+
+/**
+ * @name async_uring_create
+ * @param fd
+ *  Raw image file descriptor, physical address N is read from offset N
+ * @param entries
+ *  Size of the submission queue, should be at least the inflight argument of va2pa_async()
+ * @returns AsyncUring*
+ *  Returns the backend or NULL if io_uring is not available. Pass it to async_uring_reader() for va2pa_async()
+ * @description:
+ *  An error of io_uring stops the backend for good, it waits for the reads the kernel has and refuses every read
+ *  after that. Such a backend has to be destroyed and created again
+ */
+AsyncUring* async_uring_create(const int fd, const unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    AsyncUring *uring = calloc(1, sizeof(AsyncUring));
+    if (uring == NULL) {
+        return NULL;
+    }
+
+    uring->fd = fd;
+    uring->ring_fd = (int) syscall(__NR_io_uring_setup, entries == 0 ? 1 : entries, &params);
+    if (uring->ring_fd < 0) {
+        free(uring);
+        return NULL;
+    }
+
+    uring->entries = params.sq_entries;
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) { // both rings live in one mapping
+        uring->sq_ring_size = uring->sq_ring_size > uring->cq_ring_size ? uring->sq_ring_size : uring->cq_ring_size;
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        uring->ring_fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? uring->sq_ring :
+        mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+    uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+
+    if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        uring->sq_ring = uring->sq_ring == MAP_FAILED ? NULL : uring->sq_ring;
+        uring->cq_ring = uring->cq_ring == MAP_FAILED ? NULL : uring->cq_ring;
+        uring->sqes = uring->sqes == MAP_FAILED ? NULL : uring->sqes;
+        async_uring_destroy(uring);
+        return NULL;
+    }
+
+    uint8_t *sq = uring->sq_ring, *cq = uring->cq_ring;
+    uring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+    uring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    uring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    uring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    uring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    uring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return uring;
+}
+
+// Function hands the queued reads to the kernel and optionally waits for a completion, returns 0 on errors
+static int async_uring_enter(AsyncUring *uring, const unsigned int wait) {
+    for (;;) {
+        int ret = (int) syscall(__NR_io_uring_enter, uring->ring_fd, uring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (ret >= 0) {
+            uring->queued -= (unsigned int) ret < uring->queued ? (unsigned int) ret : uring->queued;
+            return 1;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return 0;
+        }
+    }
+}
+
+// Function stops the backend after an error. Reads the kernel was not told about are taken back and the ones
+// it has are waited for, so that none of them writes to a buffer once va2pa_async() returned. Returns 0
+static size_t async_uring_fail(AsyncUring *uring) {
+    unsigned int sq_head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+    uring->pending -= *uring->sq_tail - sq_head;
+    uring->queued = 0;
+    uring->failed = 1;
+    __atomic_store_n(uring->sq_tail, sq_head, __ATOMIC_RELEASE);
+
+    while (uring->pending > 0) {
+        unsigned int head = *uring->cq_head, tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        unsigned int reaped = tail - head < uring->pending ? tail - head : uring->pending;
+
+        // Completions of the lost reads are dropped, their tags belong to walks that are failed already
+        uring->pending -= reaped;
+        __atomic_store_n(uring->cq_head, head + reaped, __ATOMIC_RELEASE);
+
+        // Only a ring the kernel no longer knows fails here, and then it has no reads left either
+        if (uring->pending > 0 && !async_uring_enter(uring, uring->pending)) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static uint8_t async_uring_submit(void *ctx, void *buf, const unsigned int size, const uint64_t physical_addr, void *tag) {
+    AsyncUring *uring = ctx;
+    unsigned int tail = *uring->sq_tail;
+
+    if (uring->failed) {
+        return 0;
+    }
+
+    // A full submission queue is handed to the kernel first
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->entries) {
+        if (!async_uring_enter(uring, 0) || tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->entries) {
+            return 0;
+        }
+    }
+
+    unsigned int index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = uring->fd;
+    sqe->off = physical_addr;
+    sqe->addr = (uint64_t)(uintptr_t) buf;
+    sqe->len = size;
+    sqe->user_data = (uint64_t)(uintptr_t) tag;
+
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->queued++;
+    uring->pending++;
+    return 1;
+}
+
+static size_t async_uring_complete(void *ctx, AsyncCompletion *done, const size_t max) {
+    AsyncUring *uring = ctx;
+    unsigned int head = *uring->cq_head;
+
+    if (uring->failed) {
+        return 0;
+    }
+
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE) || uring->queued > 0) {
+        if (!async_uring_enter(uring, head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))) {
+            return async_uring_fail(uring);
+        }
+    }
+
+    size_t count = 0;
+    unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && count < max) {
+        const struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        done[count].tag = (void*)(uintptr_t) cqe->user_data;
+        done[count].read = cqe->res < 0 ? 0 : (unsigned int) cqe->res;
+        count++;
+        head++;
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    uring->pending -= (unsigned int) count;
+    return count;
+}
+
+// Function makes an AsyncReader that reads with a given io_uring backend
+void async_uring_reader(AsyncUring *uring, AsyncReader *reader) {
+    reader->submit = async_uring_submit;
+    reader->complete = async_uring_complete;
+    reader->ctx = uring;
+}
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*                           VECTORED READ BACKENDS                           */
+/* -------------------------------------------------------------------------- */
+
+/* -------------------------- Callback Adapters ----------------------------- */
+
+// Struct holds a PREAD_FUNC or a PREAD_FUNC_64 a PhysBackend made by phys_func_init() reads with
+typedef struct {
+    PREAD_FUNC read_func;
+    PREAD_FUNC_64 read_func_64;
+} PhysFunc;
+
+static unsigned int phys_func_read(void *ctx, void *buf, const unsigned int size, const uint64_t physical_addr) {
+    const PhysFunc *func = ctx;
+
+    return func->read_func_64 != NULL ? 
+        (*func->read_func_64)(buf, size, physical_addr) : (*func->read_func)(buf, size, (unsigned int) physical_addr);
+}
+
+/**
+ * @name phys_func_init
+ * @param func
+ *  Storage for the callback, it is the context of the backend and has to outlive it
+ * @param read_func, read_func_64
+ *  Legacy callback the backend reads with, read_func_64 is used if both are given
+ * @description:
+ *  Function makes a PhysBackend out of a legacy callback so that code written against PREAD_FUNC and
+ *  PREAD_FUNC_64 keeps working with the backend interface. Vectored reads are done one by one
+ */
+void phys_func_init(PhysFunc *func, PhysBackend *backend, const PREAD_FUNC read_func, const PREAD_FUNC_64 read_func_64) {
+    func->read_func = read_func;
+    func->read_func_64 = read_func_64;
+    backend->read = phys_func_read;
+    backend->readv = NULL;
+    backend->ctx = func;
+}
+
+static unsigned int phys_image_read(void *ctx, void *buf, const unsigned int size, const uint64_t physical_addr) {
+    return memimage_read(ctx, buf, size, physical_addr);
+}
+
+// Function makes a PhysBackend that reads from a memory image, unlike memimage_bind() any amount of images can be in use
+void phys_image_init(PhysBackend *backend, const MemImage *image) {
+    backend->read = phys_image_read;
+    backend->readv = NULL;
+    backend->ctx = (void *) image;
+}
+
+/* --------------------------- Merging Adapter ------------------------------ */
+
+#define PHYS_MERGE_SPAN (1 << 20) // Longest read the merging adapter makes out of several requests
+
+// Struct represents a PhysBackend that sorts the requests of a vectored read and merges neighbouring ones
+typedef struct {
+    const PhysBackend *backend; // backend the merged reads are done with
+    uint64_t max_gap; // requests at most this many bytes apart are merged, the bytes in between are read too
+    PhysRead **order; // requests of the current vectored read sorted by address
+    size_t capacity;
+    uint8_t *span; // PHYS_MERGE_SPAN bytes, merged reads land here and are copied out to the requests
+    size_t requests; // requests received
+    size_t reads; // reads made with the backend
+} PhysMerge;
+
+static int phys_read_cmp(const void *a, const void *b) {
+    const PhysRead *ra = *(PhysRead * const *) a, *rb = *(PhysRead * const *) b;
+
+    if (ra->physical_addr != rb->physical_addr) {
+        return (ra->physical_addr > rb->physical_addr) - (ra->physical_addr < rb->physical_addr);
+    }
+
+    return (ra->size > rb->size) - (ra->size < rb->size);
+}
+
+static unsigned int phys_merge_read(void *ctx, void *buf, const unsigned int size, const uint64_t physical_addr) {
+    PhysMerge *merge = ctx;
+
+    merge->requests++;
+    merge->reads++;
+    return (*merge->backend->read)(merge->backend->ctx, buf, size, physical_addr);
+}
+
+static void phys_merge_readv(void *ctx, PhysRead *reads, const size_t count) {
+    PhysMerge *merge = ctx;
+
+    if (count > merge->capacity) {
+        PhysRead **order = realloc(merge->order, count * sizeof(PhysRead*));
+
+        if (order != NULL) {
+            merge->order = order;
+            merge->capacity = count;
+        }
+    }
+
+    if (merge->span == NULL) {
+        merge->span = malloc(PHYS_MERGE_SPAN);
+    }
+
+    if (count > merge->capacity || merge->span == NULL) { // No memory to merge, reading the requests as they are
+        merge->requests += count;
+        merge->reads += count;
+        phys_readv(merge->backend, reads, count);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        merge->order[i] = &reads[i];
+    }
+
+    qsort(merge->order, count, sizeof(PhysRead*), phys_read_cmp);
+    merge->requests += count;
+
+    for (size_t i = 0; i < count; ) {
+        uint64_t start = merge->order[i]->physical_addr;
+        uint64_t end = start + merge->order[i]->size;
+        size_t j = i + 1;
+
+        // Taking the following requests in while they are close enough and the read stays within the span
+        for (; j < count && (merge->order[j]->physical_addr <= end || merge->order[j]->physical_addr - end <= merge->max_gap); j++) {
+            uint64_t next_end = merge->order[j]->physical_addr + merge->order[j]->size;
+            next_end = next_end > end ? next_end : end;
+
+            if (next_end - start > PHYS_MERGE_SPAN) {
+                break;
+            }
+
+            end = next_end;
+        }
+
+        merge->reads++;
+
+        if (j == i + 1) { // Nothing to merge with, the request is read straight into its buffer
+            PhysRead *req = merge->order[i];
+            req->read = (*merge->backend->read)(merge->backend->ctx, req->buf, req->size, req->physical_addr);
+            i = j;
+            continue;
+        }
+
+        unsigned int read = (*merge->backend->read)(merge->backend->ctx, merge->span, (unsigned int) (end - start), start);
+
+        for (; i < j; i++) {
+            PhysRead *req = merge->order[i];
+            uint64_t offset = req->physical_addr - start;
+            uint64_t avail = read > offset ? read - offset : 0;
+
+            req->read = avail < req->size ? (unsigned int) avail : req->size;
+            memcpy(req->buf, merge->span + offset, req->read);
+        }
+    }
+}
+
+/**
+ * @name phys_merge_init
+ * @param backend
+ *  Backend the merged reads are done with, only its read function is used
+ * @param max_gap
+ *  Requests at most this many bytes apart are read with one read, 0 only merges adjacent and overlapping ones
+ * @description:
+ *  Function makes a PhysBackend whose vectored read sorts the requests by address and reads each run of
+ *  neighbouring requests with a single read of the backend, so that repeated and nearby entries of a level cost
+ *  one read. Useful for backends with a high per-call cost such as files, sockets or debugger connections.
+ *  Free it with phys_merge_release()
+ */
+void phys_merge_init(PhysMerge *merge, PhysBackend *wrapper, const PhysBackend *backend, const uint64_t max_gap) {
+    memset(merge, 0, sizeof(PhysMerge));
+    merge->backend = backend;
+    merge->max_gap = max_gap;
+    wrapper->read = phys_merge_read;
+    wrapper->readv = phys_merge_readv;
+    wrapper->ctx = merge;
+}
+
+void phys_merge_release(PhysMerge *merge) {
+    free(merge->order);
+    free(merge->span);
+    merge->order = NULL;
+    merge->span = NULL;
+    merge->capacity = 0;
+}
+
+/* ----------------------- Level-Synchronous Batches ------------------------ */
+
+#define VECTOR_CHUNK 4096 // Walks va2pa_batch_backend() keeps going at once
+
+/**
+ * @name va2pa_batch_backend
+ * @param level
+ *  2 for legacy, 3 for PAE and 4 for long mode translations, same as walk_start()
+ * @param backend
+ *  Backend the paging-structure entries are read with
+ * @param phys_addrs
+ *  Output array of n physical addresses, an element is only written if its translation succeeded
+ * @param states
+ *  Output array of n result codes
+ * @returns size_t
+ *  Returns the amount of successfully translated addresses
+ * @description:
+ *  Function translates n virtual addresses of one address space level by level: the entries every walk still
+ *  going needs are requested with a single vectored read, then all the walks advance and the next level is read.
+ *  Walks that share an entry ask for the same address, a merging backend (phys_merge_init()) reads it once
+ */
+size_t va2pa_batch_backend(
+    const unsigned int level,
+    const uint64_t *virt_addrs,
+    const size_t n,
+    const uint64_t root_addr,
+    const PhysBackend *backend,
+    uint64_t *phys_addrs,
+    TranslationState32 *states
+) {
+    size_t chunk = n < VECTOR_CHUNK ? n : VECTOR_CHUNK;
+    WalkState *walks = malloc(chunk * sizeof(WalkState));
+    WalkState **pending = malloc(chunk * sizeof(WalkState*));
+    PhysRead *reads = malloc(chunk * sizeof(PhysRead));
+    size_t translated = 0;
+    STATS_CALL_BEGIN();
+
+    if (walks == NULL || pending == NULL || reads == NULL) {
+        free(walks);
+        free(pending);
+        free(reads);
+        return 0;
+    }
+
+    for (size_t base = 0; base < n; base += chunk) {
+        size_t count = n - base < chunk ? n - base : chunk, waiting = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            if (walk_start(&walks[i], level, virt_addrs[base + i], root_addr)) {
+                pending[waiting++] = &walks[i];
+            }
+        }
+
+        while (waiting > 0) {
+            size_t going = 0;
+
+            for (size_t i = 0; i < waiting; i++) {
+                reads[i].physical_addr = pending[i]->addr;
+                reads[i].buf = pending[i]->buf;
+                reads[i].size = pending[i]->size;
+                reads[i].read = 0;
+            }
+
+            phys_readv(backend, reads, waiting);
+
+            for (size_t i = 0; i < waiting; i++) {
+                if (walk_resume(pending[i], reads[i].read)) {
+                    pending[going++] = pending[i];
+                }
+            }
+
+            waiting = going;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            states[base + i] = walks[i].state;
+            translated += walks[i].state == ST_SUCCESS_32;
+            if (walks[i].state == ST_SUCCESS_32) {
+                phys_addrs[base + i] = walks[i].phys_addr;
+            }
+        }
+    }
+
+    free(walks);
+    free(pending);
+    free(reads);
+    STATS_LATENCY(STATS_CALL_BATCH);
+    return translated;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                          ADDRESS SPACE TAGGED CACHE                        */
+/* -------------------------------------------------------------------------- */
+
+#define TAGGED_DEFAULT_SPACES 4096 // Default amount of roots a TaggedCache tells apart
+#define TAGGED_DEFAULT_PML4ES 8192 // Default amount of cached PML4Es, shared by all of the roots
+
+// Struct represents a root known to a TaggedCache, its position in TaggedCache.spaces is the address space ID
+typedef struct {
+    uint64_t root;
+    uint32_t generation; // bumped whenever the entries of the address space are dropped
+    uint32_t stamp;
+    size_t occupancy; // translations of the current generation the address space filled
+    uint8_t valid;
+} TaggedSpace;
+
+// Struct represents a cached PML4E of an address space
+typedef struct {
+    uint64_t tag; // virtual address >> 39
+    uint64_t entry;
+    uint32_t space;
+    uint32_t generation; // generation of the address space when the entry was cached
+    uint32_t stamp;
+    uint8_t valid;
+} TaggedPML4E;
+
+// Struct represents a cached translation, tagged with the PDPT it was reached through instead of the root
+typedef struct {
+    uint64_t table; // physical address of the PDPT the PML4E above the translation references
+    uint64_t vpn;
+    uint64_t frame;
+    uint32_t space; // address space that filled the entry, it is charged for it
+    uint32_t generation; // generation of that address space, the entry is stale once it changes
+    uint32_t stamp;
+    uint8_t page_shift;
+    uint8_t valid;
+} TaggedEntry;
+
+// Struct represents a long mode translation cache for many roots at once, switching roots drops nothing
+typedef struct {
+    TaggedSpace *spaces; // space_sets * ways address spaces
+    unsigned int space_sets;
+    TaggedPML4E *pml4es; // pml4e_sets * ways PML4Es
+    unsigned int pml4e_sets;
+    TaggedEntry *entries; // sets * ways translations
+    unsigned int sets;
+    unsigned int ways; // associativity of all three
+    uint32_t clock;
+    uint64_t page_shifts; // bit N is set if entries with page_shift N may be cached
+    uint64_t hits, misses;
+} TaggedCache;
+
+// Function frees a cache created by tagcache_create()
+void tagcache_destroy(TaggedCache *tc) {
+    if (tc == NULL) {
+        return;
+    }
+
+    free(tc->spaces);
+    free(tc->pml4es);
+    free(tc->entries);
+    free(tc);
+}
+
+/**
+ * @name tagcache_create
+ * @param entries
+ *  Total amount of translations the cache can hold (0 for TLB_DEFAULT_ENTRIES)
+ * @param ways
+ *  Amount of entries per set (0 for TLB_DEFAULT_WAYS)
+ * @param spaces
+ *  Amount of roots the cache tells apart (0 for TAGGED_DEFAULT_SPACES), the least recently used root of a set
+ *  is forgotten together with its entries when a new root needs its place
+ * @returns TaggedCache*
+ *  Returns a new empty cache or NULL if memory could not be allocated
+ * @description:
+ *  Function creates a translation cache to be passed to va2pa_64_tagged(). Every root gets an address space ID
+ *  the way PCIDs work, so translating for many processes in turn drops nothing. Translations are not tagged
+ *  with the root but with the PDPT they were reached through, so roots whose PML4Es reference the same PDPTs
+ *  (the kernel half every process maps) share them and they are cached once
+ */
+TaggedCache* tagcache_create(unsigned int entries, unsigned int ways, unsigned int spaces) {
+    entries = entries == 0 ? TLB_DEFAULT_ENTRIES : entries;
+    ways = ways == 0 ? TLB_DEFAULT_WAYS : ways;
+    spaces = spaces == 0 ? TAGGED_DEFAULT_SPACES : spaces;
+
+    TaggedCache *tc = calloc(1, sizeof(TaggedCache));
+    if (tc == NULL) {
+        return NULL;
+    }
+
+    tc->ways = ways;
+    tc->sets = tcache_sets_for(entries, ways);
+    tc->space_sets = tcache_sets_for(spaces, ways);
+    tc->pml4e_sets = tcache_sets_for(spaces > TAGGED_DEFAULT_PML4ES ? spaces : TAGGED_DEFAULT_PML4ES, ways);
+    tc->spaces = calloc((size_t) tc->space_sets * ways, sizeof(TaggedSpace));
+    tc->pml4es = calloc((size_t) tc->pml4e_sets * ways, sizeof(TaggedPML4E));
+    tc->entries = calloc((size_t) tc->sets * ways, sizeof(TaggedEntry));
+
+    if (tc->spaces == NULL || tc->pml4es == NULL || tc->entries == NULL) {
+        tagcache_destroy(tc);
+        return NULL;
+    }
+
+    return tc;
+}
+
+// Function returns the address space ID of a root, -1 if it has none and create is 0
+static int64_t tagcache_space(TaggedCache *tc, const uint64_t root, const uint8_t create) {
+    unsigned int set = (unsigned int)(tcache_salt(root, 0) & (tc->space_sets - 1));
+    TaggedSpace *spaces = &tc->spaces[set * tc->ways];
+    TaggedSpace *victim = &spaces[0];
+
+    for (unsigned int way = 0; way < tc->ways; way++) {
+        if (spaces[way].valid && spaces[way].root == root) {
+            spaces[way].stamp = tc->clock;
+            return set * tc->ways + way;
+        }
+
+        if (!spaces[way].valid) {
+            victim = &spaces[way];
+        } else if (victim->valid && (int32_t)(spaces[way].stamp - victim->stamp) < 0) {
+            victim = &spaces[way];
+        }
+    }
+
+    if (!create) {
+        return -1;
+    }
+
+    // The forgotten root keeps none of its entries, its ID starts over with a new generation
+    victim->root = root;
+    victim->generation++;
+    victim->occupancy = 0;
+    victim->stamp = tc->clock;
+    victim->valid = 1;
+    return victim - tc->spaces;
+}
+
+static inline TaggedPML4E* tagcache_pml4e_set(const TaggedCache *tc, const uint32_t space, const uint64_t tag) {
+    unsigned int set = (unsigned int)((tag ^ tcache_salt(tc->spaces[space].root, PSC_PML4E)) & (tc->pml4e_sets - 1));
+    return &tc->pml4es[set * tc->ways];
+}
+
+static inline TaggedEntry* tagcache_set(const TaggedCache *tc, const uint64_t table, const uint64_t vpn, const uint8_t page_shift) {
+    unsigned int set = (unsigned int)((vpn ^ tcache_salt(table, page_shift)) & (tc->sets - 1));
+    return &tc->entries[set * tc->ways];
+}
+
+// Function returns the cached PML4E of an address space that covers a given virtual address, NULL if there is none
+static TaggedPML4E* tagcache_pml4e(TaggedCache *tc, const uint32_t space, const uint64_t virt_addr) {
+    uint64_t tag = virt_addr >> 39;
+    TaggedPML4E *set = tagcache_pml4e_set(tc, space, tag);
+
+    for (unsigned int way = 0; way < tc->ways; way++) {
+        if (set[way].valid && set[way].tag == tag && set[way].space == space && 
+            set[way].generation == tc->spaces[space].generation) {
+            set[way].stamp = tc->clock;
+            return &set[way];
+        }
+    }
+
+    return NULL;
+}
+
+static void tagcache_pml4e_fill(TaggedCache *tc, const uint32_t space, const uint64_t virt_addr, const uint64_t pml4e) {
+    uint64_t tag = virt_addr >> 39;
+    TaggedPML4E *set = tagcache_pml4e_set(tc, space, tag);
+    TaggedPML4E *victim = &set[0];
+
+    for (unsigned int way = 0; way < tc->ways; way++) {
+        if (!set[way].valid || set[way].generation != tc->spaces[set[way].space].generation) {
+            victim = &set[way];
+            break;
+        }
+
+        if ((int32_t)(set[way].stamp - victim->stamp) < 0) {
+            victim = &set[way];
+        }
+    }
+
+    victim->tag = tag;
+    victim->entry = pml4e;
+    victim->space = space;
+    victim->generation = tc->spaces[space].generation;
+    victim->stamp = tc->clock;
+    victim->valid = 1;
+}
+
+// Function returns 1 if a cached translation still belongs to the current generation of the address space that filled it
+static inline int tagcache_current(const TaggedCache *tc, const TaggedEntry *entry) {
+    return entry->valid && entry->generation == tc->spaces[entry->space].generation;
+}
+
+// Function looks up a translation reached through a given PDPT, returns 1 and sets phys_addr and page_shift on a hit
+static int tagcache_lookup(TaggedCache *tc, const uint64_t table, const uint64_t virt_addr, uint64_t *phys_addr, uint8_t *page_shift_out) {
+    for (int i = 0; i < 4 && TLBPageShifts[4][i] != 0; i++) {
+        uint8_t page_shift = TLBPageShifts[4][i];
+
+        if (!(tc->page_shifts & (1ULL << page_shift))) {
+            continue;
+        }
+
+        uint64_t vpn = virt_addr >> page_shift;
+        TaggedEntry *set = tagcache_set(tc, table, vpn, page_shift);
+
+        for (unsigned int way = 0; way < tc->ways; way++) {
+            TaggedEntry *entry = &set[way];
+
+            if (entry->vpn == vpn && entry->table == table && entry->page_shift == page_shift && tagcache_current(tc, entry)) {
+                entry->stamp = tc->clock;
+                *phys_addr = entry->frame + (virt_addr & ((1ULL << page_shift) - 1));
+                *page_shift_out = page_shift;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Function caches a translation for an address space. A full set evicts from the address space that holds
+// the most translations, least recently used first, so one busy root cannot push every other root out
+static void tagcache_fill(
+    TaggedCache *tc, const uint32_t space, const uint64_t table, const uint64_t virt_addr, const uint64_t phys_addr, const uint8_t page_shift
+) {
+    uint64_t vpn = virt_addr >> page_shift;
+    TaggedEntry *set = tagcache_set(tc, table, vpn, page_shift);
+    TaggedEntry *victim = NULL;
+
+    for (unsigned int way = 0; way < tc->ways; way++) {
+        TaggedEntry *entry = &set[way];
+
+        if (!tagcache_current(tc, entry)) {
+            victim = entry;
+            break;
+        }
+
+        size_t occupancy = tc->spaces[entry->space].occupancy;
+        size_t victim_occupancy = victim != NULL ? tc->spaces[victim->space].occupancy : 0;
+
+        if (victim == NULL || occupancy > victim_occupancy || 
+            (occupancy == victim_occupancy && (int32_t)(entry->stamp - victim->stamp) < 0)) {
+            victim = entry;
+        }
+    }
+
+    if (tagcache_current(tc, victim)) {
+        tc->spaces[victim->space].occupancy--;
+    }
+
+    victim->table = table;
+    victim->vpn = vpn;
+    victim->frame = phys_addr & ~((1ULL << page_shift) - 1);
+    victim->space = space;
+    victim->generation = tc->spaces[space].generation;
+    victim->stamp = tc->clock;
+    victim->page_shift = page_shift;
+    victim->valid = 1;
+
+    tc->spaces[space].occupancy++;
+    tc->page_shifts |= 1ULL << page_shift;
+}
+
+/**
+ * @name tagcache_flush_root
+ * @description:
+ *  Function drops the cached PML4Es of a given root and every translation it filled, in constant time.
+ *  Translations other roots filled through PDPTs the root shares with them are kept, the same way a PCID
+ *  flush keeps global pages: after changing shared paging structures use tagcache_flush_page()
+ */
+void tagcache_flush_root(TaggedCache *tc, const uint64_t root_addr) {
+    int64_t space = tagcache_space(tc, root_addr, 0);
+
+    if (space >= 0) {
+        tc->spaces[space].generation++;
+        tc->spaces[space].occupancy = 0;
+    }
+}
+
+/**
+ * @name tagcache_flush_page
+ * @description:
+ *  Function drops the cached PML4E of a given root that covers a given virtual address and the translations
+ *  of the address, for every root that shares the paging structures of the address with the given one
+ */
+void tagcache_flush_page(TaggedCache *tc, const uint64_t root_addr, const uint64_t virt_addr) {
+    int64_t space = tagcache_space(tc, root_addr, 0);
+    TaggedPML4E *pml4e = space >= 0 ? tagcache_pml4e(tc, (uint32_t) space, virt_addr) : NULL;
+    uint64_t table = pml4e != NULL ? pml4e->entry & WalkMode64.level[1].table_mask : 0;
+
+    if (pml4e != NULL) {
+        pml4e->valid = 0;
+    }
+
+    for (uint8_t page_shift = 12; page_shift <= 30; page_shift++) {
+        if (!(tc->page_shifts & (1ULL << page_shift))) {
+            continue;
+        }
+
+        uint64_t vpn = virt_addr >> page_shift;
+
+        // Without the PML4E the PDPT is unknown and every PDPT has to be searched
+        TaggedEntry *entries = pml4e != NULL ? tagcache_set(tc, table, vpn, page_shift) : tc->entries;
+        size_t count = pml4e != NULL ? tc->ways : (size_t) tc->sets * tc->ways;
+
+        for (size_t i = 0; i < count; i++) {
+            TaggedEntry *entry = &entries[i];
+
+            if (entry->vpn == vpn && entry->page_shift == page_shift && (pml4e == NULL || entry->table == table) && 
+                tagcache_current(tc, entry)) {
+                tc->spaces[entry->space].occupancy--;
+                entry->valid = 0;
+            }
+        }
+    }
+}
+
+// Function drops every cached PML4E and translation, the roots keep their address space IDs
+void tagcache_flush_all(TaggedCache *tc) {
+    for (size_t i = 0; i < (size_t) tc->space_sets * tc->ways; i++) {
+        tc->spaces[i].generation++;
+        tc->spaces[i].occupancy = 0;
+    }
+
+    tc->page_shifts = 0;
+}
+
+/**
+ * @name va2pa_64_tagged
+ * @param tc
+ *  Cache created by tagcache_create() or NULL to always walk the tables
+ * @description:
+ *  Same as va2pa_64_cached, but the cache keeps translations of many roots apart by address space ID and
+ *  shares the ones reached through the same PDPT. A lookup needs the PML4E of the root, a root without it
+ *  cached reads it and then looks the translation up, so the kernel half of a new process is usually a hit
+ */
+uint8_t va2pa_64_tagged(
+    TaggedCache *tc,
+    const uint64_t virt_addr_64, 
+    const uint64_t root_addr_64, 
+    const PREAD_FUNC_64 read_func_64, 
+    uint64_t *phys_addr_64
+) {
+    if (tc == NULL) {
+        return va2pa_64(virt_addr_64, root_addr_64, read_func_64, phys_addr_64);
+    }
+
+    uint8_t page_shift = 0;
+    STATS_CALL_BEGIN();
+
+    tc->clock++;
+    uint32_t space = (uint32_t) tagcache_space(tc, root_addr_64, 1);
+    TaggedPML4E *pml4e = tagcache_pml4e(tc, space, virt_addr_64);
+    WalkState walk;
+    uint8_t reading = walk_begin(&walk, &WalkMode64, virt_addr_64, root_addr_64), lookup = pml4e != NULL;
+    uint64_t table = 0; // PDPT the walk goes through
+
+    if (pml4e != NULL) { // the walk starts below the cached PML4E
+        STATS_ADD(hits[STATS_PSC_PML4E], 1);
+        walk.entry = pml4e->entry;
+        walk.depth = 1;
+        reading = walk_request(&walk, &WalkMode64);
+    } else {
+        STATS_ADD(misses[STATS_PSC_PML4E], 1);
+    }
+
+    while (reading) {
+        if (lookup) { // the translation is looked up as soon as the PDPT is known
+            table = walk.entry & WalkMode64.level[1].table_mask;
+            lookup = 0;
+
+            if (tagcache_lookup(tc, table, virt_addr_64, phys_addr_64, &page_shift)) {
+                tc->hits++;
+                STATS_ADD(hits[STATS_TAGGED], 1);
+                STATS_CALL_END(STATS_CALL_CACHED, ST_SUCCESS_32, page_shift);
+                return ST_SUCCESS_32;
+            }
+
+            tc->misses++;
+            STATS_ADD(misses[STATS_TAGGED], 1);
+        }
+
+        reading = walk_advance(&walk, &WalkMode64, (*read_func_64)(walk.buf, walk.size, walk.addr));
+
+        if (reading && walk.depth == 1) { // the PML4E was read and passed its checks
+            tagcache_pml4e_fill(tc, space, virt_addr_64, walk.entry);
+            lookup = 1;
+        }
+    }
+
+    if (walk.state == ST_SUCCESS_32) {
+        *phys_addr_64 = walk.phys_addr;
+        tagcache_fill(tc, space, table, virt_addr_64, walk.phys_addr, walk.page_shift);
+    }
+
+    // walk_advance() has counted the translation already
+    STATS_LATENCY(STATS_CALL_CACHED);
+    return (uint8_t) walk.state;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                             RANGE TRANSLATION                              */
+/* -------------------------------------------------------------------------- */
+
+// Struct represents a physically contiguous piece of a translated virtual range
+typedef struct {
+    uint64_t virt_addr;
+    uint64_t phys_addr;
+    uint64_t length;
+    uint8_t page_shift; // smallest page size the extent is made of (12, 21 or 30)
+} PhysExtent;
+
+// Struct holds the output of a range translation while it is being built
+typedef struct {
+    PhysExtent *extents;
+    size_t max_extents;
+    size_t count;
+    uint64_t max_segment; // maximum extent length, 0 for no limit
+} ExtentList;
+
+// Function appends a translated piece to the extent list, returns the amount of bytes that fit into it
+static uint64_t extent_append(ExtentList *list, uint64_t virt_addr, uint64_t phys_addr, uint64_t length, uint8_t page_shift) {
+    uint64_t max_segment = list->max_segment ? list->max_segment : UINT64_MAX;
+    uint64_t appended = 0;
+
+    while (appended < length) {
+        PhysExtent *last = list->count ? &list->extents[list->count - 1] : NULL;
+        uint64_t left = length - appended;
+        uint64_t take;
+
+        if (last != NULL && last->virt_addr + last->length == virt_addr && 
+            last->phys_addr + last->length == phys_addr && last->length < max_segment) {
+            // Physically contiguous with the previous extent, growing it
+            take = left < max_segment - last->length ? left : max_segment - last->length;
+            last->length += take;
+
+            if (page_shift < last->page_shift) {
+                last->page_shift = page_shift;
+            }
+        } else {
+            if (list->count == list->max_extents) {
+                break;
+            }
+
+            take = left < max_segment ? left : max_segment;
+            list->extents[list->count++] = (PhysExtent) { virt_addr, phys_addr, take, page_shift };
+        }
+
+        virt_addr += take;
+        phys_addr += take;
+        appended += take;
+    }
+
+    return appended;
+}
+
+// Function translates a virtual range reading the entries through any kind of backend, see va2pa_64_range()
+static uint8_t range_64(
+    const PhysReader *reader,
+    const uint64_t virt_addr_64,
+    const uint64_t length,
+    const uint64_t root_addr_64,
+    const uint64_t max_segment,
+    PhysExtent *extents,
+    const size_t max_extents,
+    size_t *n_extents,
+    uint64_t *covered
+) {
+    ExtentList list = { extents, max_extents, 0, max_segment };
+    BatchMemo memo[3] = { 0 };
+    uint64_t ptes[512];
+    uint64_t va = virt_addr_64;
+    const uint64_t end = virt_addr_64 + length;
+    TranslationState32 state = ST_SUCCESS_32;
+
+    *n_extents = 0;
+    *covered = 0;
+
+    while (va < end) {
+        uint64_t pml4e, pdpte, pde;
+        uint64_t piece, phys;
+        uint8_t page_shift;
+
+        state = batch_entry(&memo[0], 0, reader, pml4e_addr_64(root_addr_64, va), check_pml4e, "pml4e", &pml4e);
+        if (state != ST_SUCCESS_32) {
+            break;
+        }
+
+        state = batch_entry(&memo[1], 1, reader, pdpte_addr_64(pml4e, va), check_pdpte_64, "pdpte", &pdpte);
+        if (state != ST_SUCCESS_32) {
+            break;
+        }
+
+        if (pdpte & (1 << PDPTEBits.pse)) { // 1Gb page, taken in one step
+            page_shift = 30;
+            phys = (pdpte & 0xFFFFFC0000000) + (va & 0x3FFFFFFF);
+        } else {
+            state = batch_entry(&memo[2], 2, reader, pde_addr_64(pdpte, va), check_pde_64, "pde", &pde);
+            if (state != ST_SUCCESS_32) {
+                break;
+            }
+
+            if (pde & (1 << PDEBitsPAE.pse)) { // 2Mb page, taken in one step
+                page_shift = 21;
+                phys = (pde & 0xFFFFFFFE00000) + (va & 0x1FFFFF);
+            } else {
+                // Reading every PTE the range needs from this page table at once
+                uint64_t first = (va >> 12) & 0x1FF;
+                uint64_t last = ((end - 1) >> 21) == (va >> 21) ? ((end - 1) >> 12) & 0x1FF : 0x1FF;
+                unsigned int size = (unsigned int)((last - first + 1) * sizeof(uint64_t));
+                uint64_t pte_addr = pte_addr_64(pde, va);
+                unsigned int read = reader_read(reader, ptes, size, pte_addr);
+
+                for (uint64_t i = 0; i <= last - first; i++) {
+                    if (read < (i + 1) * sizeof(uint64_t)) {
+                        REPORT_READ_ERROR("pte", pte_addr + i * sizeof(uint64_t), sizeof(uint64_t));
+                        state = ST_RAM_READ_ERROR_32;
+                    } else if ((state = check_pte_64(ptes[i])) != ST_SUCCESS_32) {
+                        REPORT_ENTRY_ERROR(state, "pte", pte_addr + i * sizeof(uint64_t), ptes[i]);
+                    }
+
+                    if (state != ST_SUCCESS_32) {
+                        break;
+                    }
+
+                    REPORT_NOT_DIRTY(pte_addr + i * sizeof(uint64_t), ptes[i], sizeof(uint64_t));
+
+                    piece = 0x1000 - (va & 0xFFF);
+                    piece = piece < end - va ? piece : end - va;
+                    phys = (ptes[i] & 0xFFFFFFFFFFFFF000) + (va & 0xFFF);
+
+                    uint64_t appended = extent_append(&list, va, phys, piece, 12);
+                    va += appended;
+                    *covered += appended;
+
+                    if (appended < piece) { // Out of extents
+                        *n_extents = list.count;
+                        return ST_SUCCESS_32;
+                    }
+                }
+
+                if (state != ST_SUCCESS_32) {
+                    break;
+                }
+
+                continue;
+            }
+        }
+
+        // Rest of the large page or rest of the range, whichever ends first
+        piece = (1ULL << page_shift) - (va & ((1ULL << page_shift) - 1));
+        piece = piece < end - va ? piece : end - va;
+
+        uint64_t appended = extent_append(&list, va, phys, piece, page_shift);
+        va += appended;
+        *covered += appended;
+
+        if (appended < piece) { // Out of extents
+            break;
+        }
+    }
+
+    *n_extents = list.count;
+    return state;
+}
+
+/**
+ * @name va2pa_64_range
+ * @param virt_addr_64
+ *  First virtual address of the range
+ * @param length
+ *  Length of the range in bytes
+ * @param root_addr_64
+ *  Root address (CR3) the range is translated with
+ * @param read_func_64
+ *  Function that reads physical memory, same as for va2pa_64
+ * @param max_segment
+ *  Maximum length of a single extent in bytes (e.g. of a scatter-gather segment), 0 for no limit
+ * @param extents
+ *  Output array of extents, ascending by virtual address
+ * @param max_extents
+ *  Amount of elements in the extents array
+ * @param n_extents
+ *  Amount of extents written to the array
+ * @param covered
+ *  Amount of bytes from the beginning of the range covered by the written extents
+ * @returns uint8_t
+ *  Returns the result code of the first page that failed to translate (*covered stops right before it)
+ *  or ST_SUCCESS_32. If extents ran out the result is ST_SUCCESS_32 and *covered is less than length,
+ *  the rest of the range can be translated with another call starting at virt_addr_64 + *covered
+ * @description:
+ *  Function translates a virtual range into physical extents. Physically contiguous pages are merged 
+ *  into one extent. Every paging-structure entry the range goes through is read once, 1 GiB and 2 MiB
+ *  pages are consumed in one step and the PTEs of a page table are read in one call of read_func_64
+ */
+uint8_t va2pa_64_range(
+    const uint64_t virt_addr_64,
+    const uint64_t length,
+    const uint64_t root_addr_64,
+    const PREAD_FUNC_64 read_func_64,
+    const uint64_t max_segment,
+    PhysExtent *extents,
+    const size_t max_extents,
+    size_t *n_extents,
+    uint64_t *covered
+) {
+    PhysReader reader = { NULL, read_func_64, NULL, NULL };
+    return range_64(&reader, virt_addr_64, length, root_addr_64, max_segment, extents, max_extents, n_extents, covered);
+}
+
+/**
+ * @name va2pa_64_range_backend
+ * @description:
+ *  Same as va2pa_64_range, but physical memory is read through a PhysBackend
+ */
+uint8_t va2pa_64_range_backend(
+    const uint64_t virt_addr_64,
+    const uint64_t length,
+    const uint64_t root_addr_64,
+    const PhysBackend *backend,
+    const uint64_t max_segment,
+    PhysExtent *extents,
+    const size_t max_extents,
+    size_t *n_extents,
+    uint64_t *covered
+) {
+    PhysReader reader = { NULL, NULL, NULL, backend };
+    return range_64(&reader, virt_addr_64, length, root_addr_64, max_segment, extents, max_extents, n_extents, covered);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            TABLE CLASSIFICATION                            */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Struct describes the entries of one paging structure level that pass the integrity checks of the walks.
+ * An entry passes if all of the "set" bits are set and none of the "reserved" bits are, entries with the
+ * PS bit set are checked against the page masks, the others against the table masks
+ */
+typedef struct {
+    uint8_t ps_bit; // bit that makes an entry map a large page, 0 if the level has no large pages
+    uint64_t next_mask; // bits of an entry that hold the next table or the page frame address
+    uint64_t table_set, table_reserved;
+    uint64_t page_set, page_reserved;
+} ClassRule;
+
+// PAE paging structures from the PDPT down (same quirks as check_pdpte_pae, check_pde_pae and check_pte_pae)
+static const ClassRule ClassRulesPAE[] = {
+    { 0, 0x000FFFFFFFFFF000, 0x1, 0xFFF00000000001E6, 0, 0 },
+    { 7, 0x000FFFFFFFFFF000, 0x5, 0xFFF0000000000000, 0x1085, 0xFFF00000001FE000 },
+    { 0, 0x000FFFFFFFFFF000, 0x85, 0xFFF0000000000000, 0, 0 }
+};
+
+// Long mode paging structures from the PML4 down (same quirks as check_pml4e, check_pdpte_64, check_pde_64 and check_pte_64)
+static const ClassRule ClassRules64[] = {
+    { 0, 0x000FFFFFFFFFF000, 0x5, 0x300, 0, 0 },
+    { 7, 0x000FFFFFFFFFF000, 0x1, 0, 0x81, 0x3FFFE000 },
+    { 7, 0x000FFFFFFFFFF000, 0x5, 0xFFF0000000000000, 0x85, 0xFFF00000001FE000 },
+    { 0, 0x000FFFFFFFFFF000, 0x85, 0xFFF0000000000000, 0, 0 }
+};
+
+#define CLASS_WORDS (512 / 64) // Words of a TableClass bitmap
+
+// Struct holds the classification of a paging structure, bit i of every bitmap describes entry i
+typedef struct {
+    uint64_t present[CLASS_WORDS]; // present bit is set
+    uint64_t user[CLASS_WORDS]; // user access bit is set
+    uint64_t large[CLASS_WORDS]; // entry maps a large page
+    uint64_t reserved[CLASS_WORDS]; // reserved (MustBeZero) bits are set
+    uint64_t valid[CLASS_WORDS]; // entry passes all integrity checks, exactly the entries a walk would follow
+    uint64_t next[512]; // entry masked with next_mask: address of the next table or of the page frame
+} TableClass;
+
+typedef void (*CLASSIFY_FUNC)(const uint64_t *table, const unsigned int count, const ClassRule *rule, TableClass *cls);
+
+// Function classifies entries [start, count) one by one
+static void classify_tail(const uint64_t *table, const unsigned int start, const unsigned int count, const ClassRule *rule, TableClass *cls) {
+    for (unsigned int i = start; i < count; i++) {
+        uint64_t entry = table[i], bit = 1ULL << (i & 63);
+        int large = rule->ps_bit != 0 && (entry & (1ULL << rule->ps_bit));
+        uint64_t set = large ? rule->page_set : rule->table_set;
+        uint64_t reserved = large ? rule->page_reserved : rule->table_reserved;
+
+        cls->present[i >> 6] |= entry & 1 ? bit : 0;
+        cls->user[i >> 6] |= entry & 4 ? bit : 0;
+        cls->large[i >> 6] |= large ? bit : 0;
+        cls->reserved[i >> 6] |= entry & reserved ? bit : 0;
+        cls->valid[i >> 6] |= (entry & set) == set && !(entry & reserved) ? bit : 0;
+        cls->next[i] = entry & rule->next_mask;
+    }
+}
+
+static void classify_scalar(const uint64_t *table, const unsigned int count, const ClassRule *rule, TableClass *cls) {
+    classify_tail(table, 0, count, rule, cls);
+}
+
+#ifdef VA2PA_X86
+// SSE2 has no 64-bit compare, lanes are equal when both of their 32-bit halves are
+__attribute__((target("sse2")))
+static inline __m128i sse2_cmpeq_epi64(const __m128i a, const __m128i b) {
+    __m128i eq = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+// Function returns a bit per 64-bit lane that is all ones
+__attribute__((target("sse2")))
+static inline uint64_t sse2_lanes(const __m128i mask) {
+    return (uint64_t) _mm_movemask_pd(_mm_castsi128_pd(mask));
+}
+
+__attribute__((target("sse2")))
+static void classify_sse2(const uint64_t *table, const unsigned int count, const ClassRule *rule, TableClass *cls) {
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi32(-1);
+    const __m128i present = _mm_set1_epi64x(1), user = _mm_set1_epi64x(4);
+    const __m128i ps = _mm_set1_epi64x(rule->ps_bit != 0 ? (long long)(1ULL << rule->ps_bit) : 0);
+    const __m128i next_mask = _mm_set1_epi64x((long long) rule->next_mask);
+    const __m128i table_set = _mm_set1_epi64x((long long) rule->table_set), page_set = _mm_set1_epi64x((long long) rule->page_set);
+    const __m128i table_reserved = _mm_set1_epi64x((long long) rule->table_reserved);
+    const __m128i page_reserved = _mm_set1_epi64x((long long) rule->page_reserved);
+    unsigned int i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128i entry = _mm_loadu_si128((const __m128i*)(table + i));
+        __m128i large = _mm_xor_si128(sse2_cmpeq_epi64(_mm_and_si128(entry, ps), zero), ones);
+        __m128i set = _mm_or_si128(_mm_and_si128(large, page_set), _mm_andnot_si128(large, table_set));
+        __m128i reserved = _mm_or_si128(_mm_and_si128(large, page_reserved), _mm_andnot_si128(large, table_reserved));
+        __m128i clean = sse2_cmpeq_epi64(_mm_and_si128(entry, reserved), zero);
+        __m128i valid = _mm_and_si128(sse2_cmpeq_epi64(_mm_and_si128(entry, set), set), clean);
+        unsigned int shift = i & 63;
+
+        cls->present[i >> 6] |= sse2_lanes(sse2_cmpeq_epi64(_mm_and_si128(entry, present), present)) << shift;
+        cls->user[i >> 6] |= sse2_lanes(sse2_cmpeq_epi64(_mm_and_si128(entry, user), user)) << shift;
+        cls->large[i >> 6] |= sse2_lanes(large) << shift;
+        cls->reserved[i >> 6] |= (sse2_lanes(clean) ^ 0x3) << shift;
+        cls->valid[i >> 6] |= sse2_lanes(valid) << shift;
+        _mm_storeu_si128((__m128i*)(cls->next + i), _mm_and_si128(entry, next_mask));
+    }
+
+    classify_tail(table, i, count, rule, cls);
+}
+
+// Function returns a bit per 64-bit lane that is all ones
+__attribute__((target("avx2")))
+static inline uint64_t avx2_lanes(const __m256i mask) {
+    return (uint64_t) _mm256_movemask_pd(_mm256_castsi256_pd(mask));
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const uint64_t *table, const unsigned int count, const ClassRule *rule, TableClass *cls) {
+    const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi64x(-1);
+    const __m256i present = _mm256_set1_epi64x(1), user = _mm256_set1_epi64x(4);
+    const __m256i ps = _mm256_set1_epi64x(rule->ps_bit != 0 ? (long long)(1ULL << rule->ps_bit) : 0);
+    const __m256i next_mask = _mm256_set1_epi64x((long long) rule->next_mask);
+    const __m256i table_set = _mm256_set1_epi64x((long long) rule->table_set), page_set = _mm256_set1_epi64x((long long) rule->page_set);
+    const __m256i table_reserved = _mm256_set1_epi64x((long long) rule->table_reserved);
+    const __m256i page_reserved = _mm256_set1_epi64x((long long) rule->page_reserved);
+    unsigned int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256i entry = _mm256_loadu_si256((const __m256i*)(table + i));
+        __m256i large = _mm256_xor_si256(_mm256_cmpeq_epi64(_mm256_and_si256(entry, ps), zero), ones);
+        __m256i set = _mm256_blendv_epi8(table_set, page_set, large);
+        __m256i reserved = _mm256_blendv_epi8(table_reserved, page_reserved, large);
+        __m256i clean = _mm256_cmpeq_epi64(_mm256_and_si256(entry, reserved), zero);
+        __m256i valid = _mm256_and_si256(_mm256_cmpeq_epi64(_mm256_and_si256(entry, set), set), clean);
+        unsigned int shift = i & 63;
+
+        cls->present[i >> 6] |= avx2_lanes(_mm256_cmpeq_epi64(_mm256_and_si256(entry, present), present)) << shift;
+        cls->user[i >> 6] |= avx2_lanes(_mm256_cmpeq_epi64(_mm256_and_si256(entry, user), user)) << shift;
+        cls->large[i >> 6] |= avx2_lanes(large) << shift;
+        cls->reserved[i >> 6] |= (avx2_lanes(clean) ^ 0xF) << shift;
+        cls->valid[i >> 6] |= avx2_lanes(valid) << shift;
+        _mm256_storeu_si256((__m256i*)(cls->next + i), _mm256_and_si256(entry, next_mask));
+    }
+
+    classify_tail(table, i, count, rule, cls);
+}
+#endif
+
+// Function picks the widest classification kernel the CPU supports
+static CLASSIFY_FUNC classify_select(void) {
+#ifdef VA2PA_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        return classify_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        return classify_sse2;
+    }
+#endif
+
+    return classify_scalar;
+}
+
+// Function classifies the first count entries of a paging structure with the kernel picked on first use
+static void classify_table(const uint64_t *table, const unsigned int count, const ClassRule *rule, TableClass *cls) {
+    static CLASSIFY_FUNC cached = NULL; // every thread that races here stores the same kernel
+    CLASSIFY_FUNC kernel = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+
+    if (kernel == NULL) {
+        kernel = classify_select();
+        __atomic_store_n(&cached, kernel, __ATOMIC_RELAXED);
+    }
+
+    memset(cls, 0, offsetof(TableClass, next));
+    (*kernel)(table, count, rule, cls);
+}
+
+/**
+ * @name va2pa_classify_table
+ * @param level
+ *  Paging mode w/ values 3 or 4 which stand for PAE and long mode respectively
+ * @param table_level
+ *  Level of the paging structure: 4 for a PML4, 3 for a PDPT, 2 for a page directory and 1 for a page table
+ * @param table
+ *  Entries of the paging structure
+ * @param count
+ *  Amount of entries, at most 512 (4 for a PAE PDPT)
+ * @param cls
+ *  Output buffer for the classification, bits and addresses past count are left zero
+ * @returns uint8_t
+ *  Returns ST_SUCCESS_32 or ST_INCORRECT_LEVEL_32 if there is no such paging structure in the given mode
+ * @description:
+ *  Function validates and classifies a whole paging structure in one pass with the widest SIMD kernel
+ *  the CPU supports (AVX2, SSE2 or scalar). An entry is valid if the walks of va2pa and va2pa_64 would accept it
+ */
+uint8_t va2pa_classify_table(
+    const unsigned int level,
+    const unsigned int table_level,
+    const uint64_t *table,
+    const unsigned int count,
+    TableClass *cls
+) {
+    if ((level != 3 && level != 4) || table_level < 1 || table_level > level || count > 512) {
+        return ST_INCORRECT_LEVEL_32;
+    }
+
+    const ClassRule *rules = level == 3 ? ClassRulesPAE : ClassRules64;
+    classify_table(table, count, &rules[level - table_level], cls);
+    return ST_SUCCESS_32;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                         ADDRESS SPACE ENUMERATION                          */
+/* -------------------------------------------------------------------------- */
+
+#define PAGING_TABLE_SIZE 4096 // Size of a page directory / page table frame in bytes
+
+/**
+ * @name ENUM_FUNC
+ * @param extent
+ *  Mapped page: its virtual address, physical address, size in bytes and log2 of the size
+ * @param leaf_entry
+ *  Paging-structure entry that maps the page (PTE, or PDE / PDPTE for large pages)
+ * @param ctx
+ *  Pointer passed to the enumeration function
+ * @returns int
+ *  Returns 0 to continue the enumeration or any other value to stop it
+ */
+typedef int (*ENUM_FUNC)(const PhysExtent *extent, const uint64_t leaf_entry, void *ctx);
+
+// Struct describes one level of paging structures for the enumerator
+typedef struct {
+    uint8_t shift; // virtual address bits below the ones an entry of this level translates
+    uint16_t entries; // amount of entries in a table of this level
+    uint8_t leaf_bit; // bit that makes an entry map a page instead of the next table (0 if never, 1 if always)
+    const ClassRule *rule; // integrity checks and address bits of the entries
+} EnumLevel;
+
+// PAE paging structures from the PDPT down
+static const EnumLevel EnumLevelsPAE[] = {
+    { 30, 4, 0, &ClassRulesPAE[0] },
+    { 21, 512, 7, &ClassRulesPAE[1] },
+    { 12, 512, 1, &ClassRulesPAE[2] }
+};
+
+// Long mode paging structures from the PML4 down
+static const EnumLevel EnumLevels64[] = {
+    { 39, 512, 0, &ClassRules64[0] },
+    { 30, 512, 7, &ClassRules64[1] },
+    { 21, 512, 7, &ClassRules64[2] },
+    { 12, 512, 1, &ClassRules64[3] }
+};
+
+// Struct holds the state of an address space enumeration
+typedef struct {
+    PREAD_FUNC read_func; // used for Legacy and PAE tables
+    PREAD_FUNC_64 read_func_64; // used for long mode tables
+    ENUM_FUNC callback;
+    void *ctx;
+    TranslationState32 state; // ST_RAM_READ_ERROR_32 once a table could not be read
+    int stopped; // callback asked to stop
+    const PhysBackend *backend; // used instead of the callbacks if set
+} EnumWalk;
+
+// Function records a read of a whole paging structure that came up short
+static void enum_check_read(EnumWalk *walk, const unsigned int read, const unsigned int size, const uint64_t addr) {
+    if (read < size) {
+        walk->state = ST_RAM_READ_ERROR_32;
+        REPORT_READ_ERROR(NULL, addr + read, size - read);
+    }
+}
+
+// Function reads a whole paging structure, returns the amount of entries that were read
+static unsigned int enum_read_table(EnumWalk *walk, void *table, const unsigned int size, const uint64_t addr, const unsigned int entry_size) {
+    unsigned int read = walk->backend != NULL ? (*walk->backend->read)(walk->backend->ctx, table, size, addr) :
+        walk->read_func_64 != NULL ? (*walk->read_func_64)(table, size, addr) : (*walk->read_func)(table, size, (unsigned int) addr);
+
+    enum_check_read(walk, read, size, addr);
+    return read / entry_size;
+}
+
+// Function reads every next level table of a classified paging structure with one vectored read of the backend,
+// returns the requests in entry order or NULL if the tables are to be read one by one
+static PhysRead *enum_read_children(EnumWalk *walk, const EnumLevel *level, const TableClass *cls) {
+    unsigned int size = (level + 1)->entries * sizeof(uint64_t);
+    size_t count = 0, k = 0;
+
+    if (walk->backend == NULL || walk->backend->readv == NULL) {
+        return NULL;
+    }
+
+    for (unsigned int word = 0; word < CLASS_WORDS; word++) {
+        count += __builtin_popcountll(cls->valid[word] & ~cls->large[word]);
+    }
+
+    PhysRead *reads = count != 0 ? malloc(count * (sizeof(PhysRead) + size)) : NULL;
+    uint8_t *data = (uint8_t *) (reads + count);
+
+    if (reads == NULL) {
+        return NULL;
+    }
+
+    for (unsigned int word = 0; word < CLASS_WORDS; word++) {
+        for (uint64_t tables = cls->valid[word] & ~cls->large[word]; tables != 0; tables &= tables - 1, k++) {
+            reads[k].physical_addr = cls->next[word * 64 + __builtin_ctzll(tables)];
+            reads[k].buf = data + k * size;
+            reads[k].size = size;
+            reads[k].read = 0;
+        }
+    }
+
+    phys_readv(walk->backend, reads, count);
+    return reads;
+}
+
+// Function passes a mapped page to the callback
+static void enum_emit(EnumWalk *walk, const uint64_t virt_addr, const uint64_t phys_addr, const uint8_t page_shift, const uint64_t entry) {
+    PhysExtent extent = { virt_addr, phys_addr, 1ULL << page_shift, page_shift };
+    walk->stopped = (*walk->callback)(&extent, entry, walk->ctx) != 0;
+}
+
+// Function enumerates the count entries of a paging structure with 8-byte entries and everything below them
+static void enum_entries_64(
+    EnumWalk *walk, const EnumLevel *level, const int depth, const uint64_t *table, const unsigned int count, const uint64_t virt_base, const int canonical
+) {
+    uint64_t child[512]; // next level table when the tables are read one by one
+    TableClass cls;
+    PhysRead *children = NULL;
+    size_t next_child = 0;
+
+    // Only entries that are present and accessible are followed, the subtrees of the others are skipped
+    classify_table(table, count, level->rule, &cls);
+
+    if (depth > 1) { // A vectored backend gets the whole next level at once
+        children = enum_read_children(walk, level, &cls);
+    }
+
+    for (unsigned int word = 0; word < CLASS_WORDS && !walk->stopped; word++) {
+        for (uint64_t valid = cls.valid[word]; valid != 0 && !walk->stopped; valid &= valid - 1) {
+            unsigned int i = word * 64 + __builtin_ctzll(valid);
+            uint64_t virt_addr = virt_base + ((uint64_t) i << level->shift);
+
+            if (canonical && (virt_addr & (1ULL << 47))) { // Sign extending upper half long mode addresses
+                virt_addr |= 0xFFFF000000000000;
+            }
+
+            if (level->leaf_bit == 1 || (cls.large[word] & (valid & -valid))) {
+                uint64_t frame = cls.next[i] & ~((1ULL << level->shift) - 1);
+                enum_emit(walk, virt_addr, frame, level->shift, table[i]);
+            } else if (depth > 1 && children != NULL) {
+                PhysRead *read = &children[next_child++];
+                enum_check_read(walk, read->read, read->size, read->physical_addr);
+                enum_entries_64(walk, level + 1, depth - 1, read->buf, read->read / sizeof(uint64_t), virt_addr, canonical);
+            } else if (depth > 1) {
+                unsigned int child_count = enum_read_table(walk, child, (level + 1)->entries * sizeof(uint64_t), cls.next[i], sizeof(uint64_t));
+                enum_entries_64(walk, level + 1, depth - 1, child, child_count, virt_addr, canonical);
+            }
+        }
+    }
+
+    free(children);
+}
+
+// Function enumerates a paging structure with 8-byte entries and everything below it
+static void enum_table_64(EnumWalk *walk, const EnumLevel *level, const int depth, const uint64_t table_addr, const uint64_t virt_base, const int canonical) {
+    uint64_t table[512];
+    unsigned int count = enum_read_table(walk, table, level->entries * sizeof(uint64_t), table_addr, sizeof(uint64_t));
+
+    enum_entries_64(walk, level, depth, table, count, virt_base, canonical);
+}
+
+/**
+ * @name va2pa_enumerate
+ * @param level
+ *  Level of indirection w/ values 2 or 3, same as for va2pa
+ * @param root_addr
+ *  Page directory root address (similar to CR3 register value in x86 architecture)
+ * @param read_func
+ *  Function that reads physical memory, same as for va2pa
+ * @param callback
+ *  Function that is called for every mapped page in ascending virtual address order
+ * @param ctx
+ *  Pointer passed to the callback
+ * @returns int
+ *  Returns ST_SUCCESS_32, ST_INCORRECT_LEVEL_32 or ST_RAM_READ_ERROR_32 if any of the tables could not be read 
+ *  (the rest of the address space is still enumerated)
+ * @description:
+ *  Function enumerates every page va2pa would successfully translate. Each page directory and page table is read 
+ *  with a single read_func call and only entries that are present and pass their integrity checks are followed
+ */
+int va2pa_enumerate(
+    const unsigned int level,
+    const unsigned int root_addr,
+    const PREAD_FUNC read_func,
+    const ENUM_FUNC callback,
+    void *ctx
+) {
+    EnumWalk walk = { read_func, NULL, callback, ctx, ST_SUCCESS_32, 0, NULL };
+
+    if (level == 3) {
+        enum_table_64(&walk, EnumLevelsPAE, 3, pdpte_addr_pae(root_addr, 0), 0, 0);
+        return walk.state;
+    } else if (level != 2) {
+        return ST_INCORRECT_LEVEL_32;
+    }
+
+    uint32_t pd[1024], pt[1024];
+    unsigned int pd_count = enum_read_table(&walk, pd, sizeof(pd), pde_addr_32(root_addr, 0), sizeof(uint32_t));
+
+    for (unsigned int i = 0; i < pd_count && !walk.stopped; i++) {
+        uint32_t virt_addr = i << 22;
+
+        if (!(pd[i] & (1 << PDEBits.present)) || check_pde_legacy(pd[i]) != ST_SUCCESS_32) {
+            continue;
+        }
+
+        if (pd[i] & (1 << PDEBits.pse)) { // 4Mb page
+            enum_emit(&walk, virt_addr, pd[i] & 0xFFC00000, 22, pd[i]);
+            continue;
+        }
+
+        unsigned int pt_count = enum_read_table(&walk, pt, sizeof(pt), pte_addr_32(pd[i], 0), sizeof(uint32_t));
+
+        for (unsigned int j = 0; j < pt_count && !walk.stopped; j++) {
+            if ((pt[j] & (1 << PTEBits.present)) && check_pte_legacy(pt[j]) == ST_SUCCESS_32) {
+                enum_emit(&walk, virt_addr + (j << 12), pt[j] & 0xFFFFF000, 12, pt[j]);
+            }
+        }
+    }
+
+    return walk.state;
+}
+
+/**
+ * @name va2pa_64_enumerate
+ * @description:
+ *  Same as va2pa_enumerate, only for va2pa_64 translations. Virtual addresses of the upper half
+ *  of the address space are reported in their canonical (sign extended) form
+ */
+uint8_t va2pa_64_enumerate(
+    const uint64_t root_addr_64,
+    const PREAD_FUNC_64 read_func_64,
+    const ENUM_FUNC callback,
+    void *ctx
+) {
+    EnumWalk walk = { NULL, read_func_64, callback, ctx, ST_SUCCESS_32, 0, NULL };
+    enum_table_64(&walk, EnumLevels64, 4, pml4e_addr_64(root_addr_64, 0), 0, 1);
+    return walk.state;
+}
+
+/**
+ * @name va2pa_64_enumerate_backend
+ * @description:
+ *  Same as va2pa_64_enumerate, but physical memory is read through a PhysBackend. If the backend has a vectored
+ *  read, all the tables of the next level below a paging structure are requested with a single call of it
+ */
+uint8_t va2pa_64_enumerate_backend(
+    const uint64_t root_addr_64,
+    const PhysBackend *backend,
+    const ENUM_FUNC callback,
+    void *ctx
+) {
+    EnumWalk walk = { NULL, NULL, callback, ctx, ST_SUCCESS_32, 0, backend };
+    enum_table_64(&walk, EnumLevels64, 4, pml4e_addr_64(root_addr_64, 0), 0, 1);
+    return walk.state;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            PARALLEL ENUMERATION                            */
+/* -------------------------------------------------------------------------- */
+
+#define SCAN_SPLIT UINT32_MAX // ScanTask.pdpt of a PML4 slot that still has to be split into PDPT slots
+
+// Struct represents a page found by a scan worker, it is passed to the callback later
+typedef struct {
+    PhysExtent extent;
+    uint64_t leaf_entry;
+} ScanPage;
+
+// Struct holds the pages of one PDPT slot (1 GiB of virtual address space) in ascending virtual address order
+typedef struct {
+    ScanPage *pages;
+    size_t count, capacity;
+    uint64_t entry; // PDPTE of the slot
+    TranslationState32 state;
+    uint8_t expected; // PDPTE is valid, the slot is either a 1 GiB page or a task
+    uint8_t overflow; // pages could not be stored, the slot is enumerated again by the calling thread
+    uint8_t done;
+} ScanResult;
+
+// Struct holds the results of one PML4 slot (512 GiB of virtual address space)
+typedef struct {
+    ScanResult *pdpt; // 512 results, NULL if they could not be allocated
+    uint64_t entry; // PML4E of the slot
+    TranslationState32 state; // ST_RAM_READ_ERROR_32 if the PDPT could not be read
+    uint8_t expected; // PML4E is valid
+    uint8_t split; // PDPT was read and its tasks were queued
+} ScanSlot;
+
+typedef struct {
+    uint32_t pml4, pdpt; // slot indices, pdpt is SCAN_SPLIT for a whole PML4 slot
+} ScanTask;
+
+// Struct represents the task deque of a worker, the owner works at the tail and thieves take from the head
+typedef struct {
+    pthread_mutex_t lock;
+    ScanTask *tasks;
+    size_t head, tail, capacity;
+} ScanDeque;
+
+// Struct holds the state shared by the workers of a parallel scan
+typedef struct {
+    PREAD_FUNC_64 read_func_64;
+    const MemImage *image; // memimage_bind() binding of the calling thread, workers inherit it
+    ScanSlot slots[512];
+    ScanDeque *deques;
+    unsigned int workers;
+    size_t pending; // tasks that are queued or running
+    int stop; // callback asked to stop, workers drop the remaining tasks
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond; // signaled whenever a slot is split or a result is done
+} ParallelScan;
+
+typedef struct {
+    ParallelScan *scan;
+    unsigned int id;
+} ScanWorker;
+
+typedef struct {
+    ParallelScan *scan;
+    ScanResult *result;
+} ScanCollect;
+
+// Function queues a task at the tail of a deque, returns 0 if memory could not be allocated
+static int scan_push(ScanDeque *deque, const ScanTask task) {
+    int pushed = 1;
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail == deque->capacity) {
+        size_t queued = deque->tail - deque->head;
+
+        if (deque->head != 0) { // reusing the room stolen from the head first
+            memmove(deque->tasks, deque->tasks + deque->head, queued * sizeof(ScanTask));
+            deque->head = 0;
+            deque->tail = queued;
+        } else {
+            size_t capacity = deque->capacity != 0 ? deque->capacity * 2 : 64;
+            ScanTask *tasks = realloc(deque->tasks, capacity * sizeof(ScanTask));
+
+            if (tasks != NULL) {
+                deque->tasks = tasks;
+                deque->capacity = capacity;
+            } else {
+                pushed = 0;
+            }
+        }
+    }
+
+    if (pushed) {
+        deque->tasks[deque->tail++] = task;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return pushed;
+}
+
+// Function takes a task from the tail (owner) or the head (thief) of a deque, returns 0 if it is empty
+static int scan_take(ScanDeque *deque, ScanTask *task, const int steal) {
+    int taken = 0;
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail > deque->head) {
+        *task = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+        taken = 1;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+// Function marks a slot or a result done and wakes the calling thread up
+static void scan_finish(ParallelScan *scan, uint8_t *flag) {
+    pthread_mutex_lock(&scan->done_lock);
+    *flag = 1;
+    pthread_cond_broadcast(&scan->done_cond);
+    pthread_mutex_unlock(&scan->done_lock);
+}
+
+// Function appends a page to a result, it is the ENUM_FUNC of the workers
+static int scan_collect(const PhysExtent *extent, const uint64_t leaf_entry, void *ctx) {
+    ScanCollect *collect = ctx;
+    ScanResult *result = collect->result;
+
+    if (result->count == result->capacity) {
+        size_t capacity = result->capacity != 0 ? result->capacity * 2 : 256;
+        ScanPage *pages = realloc(result->pages, capacity * sizeof(ScanPage));
+
+        if (pages == NULL) {
+            result->overflow = 1;
+            return 1;
+        }
+
+        result->pages = pages;
+        result->capacity = capacity;
+    }
+
+    result->pages[result->count].extent = *extent;
+    result->pages[result->count].leaf_entry = leaf_entry;
+    result->count++;
+
+    return __atomic_load_n(&collect->scan->stop, __ATOMIC_RELAXED);
+}
+
+// Function returns the canonical virtual address of a PML4 / PDPT slot
+static inline uint64_t scan_virt_addr(const uint32_t pml4, const uint32_t pdpt) {
+    uint64_t virt_addr = ((uint64_t) pml4 << 39) | ((uint64_t) pdpt << 30);
+    return pml4 >= 256 ? virt_addr | 0xFFFF000000000000 : virt_addr;
+}
+
+// Function enumerates the pages of a PDPT slot below a valid PDPTE that references a page directory
+static void scan_walk(ParallelScan *scan, const ScanTask task) {
+    ScanResult *result = &scan->slots[task.pml4].pdpt[task.pdpt];
+
+    if (!__atomic_load_n(&scan->stop, __ATOMIC_RELAXED)) {
+        ScanCollect collect = { scan, result };
+        EnumWalk walk = { NULL, scan->read_func_64, scan_collect, &collect, ST_SUCCESS_32, 0, NULL };
+
+        enum_table_64(&walk, &EnumLevels64[2], 2, result->entry & ClassRules64[1].next_mask, 
+            scan_virt_addr(task.pml4, task.pdpt), 1);
+        result->state = walk.state;
+    }
+
+    scan_finish(scan, &result->done);
+}
+
+// Function reads the PDPT of a PML4 slot, stores its 1 GiB pages and queues a task for every page directory
+static void scan_split(ParallelScan *scan, ScanDeque *deque, const ScanTask task) {
+    ScanSlot *slot = &scan->slots[task.pml4];
+    uint64_t pdpt[512];
+    TableClass cls;
+    unsigned int count = 0;
+
+    ScanResult *results = __atomic_load_n(&scan->stop, __ATOMIC_RELAXED) ? NULL : calloc(512, sizeof(ScanResult));
+
+    if (results != NULL) {
+        uint64_t pdpt_addr = slot->entry & ClassRules64[0].next_mask;
+        count = (*scan->read_func_64)(pdpt, sizeof(pdpt), pdpt_addr) / sizeof(uint64_t);
+
+        if (count < 512) {
+            slot->state = ST_RAM_READ_ERROR_32;
+            REPORT_READ_ERROR("pdpte", pdpt_addr + count * sizeof(uint64_t), sizeof(pdpt) - count * sizeof(uint64_t));
+        }
+
+        classify_table(pdpt, count, &ClassRules64[1], &cls);
+    }
+
+    slot->pdpt = results;
+
+    for (unsigned int i = 0; i < count; i++) {
+        ScanResult *result = &results[i];
+
+        if (!(cls.valid[i >> 6] & (1ULL << (i & 63)))) {
+            continue;
+        }
+
+        result->entry = pdpt[i];
+        result->expected = 1;
+
+        if (cls.large[i >> 6] & (1ULL << (i & 63))) { // 1 GiB page
+            PhysExtent extent = { scan_virt_addr(task.pml4, i), cls.next[i] & ~((1ULL << 30) - 1), 1ULL << 30, 30 };
+            ScanCollect collect = { scan, result };
+
+            scan_collect(&extent, pdpt[i], &collect);
+            result->done = 1;
+            continue;
+        }
+
+        ScanTask walk_task = { task.pml4, i };
+        __atomic_add_fetch(&scan->pending, 1, __ATOMIC_RELAXED);
+
+        if (!scan_push(deque, walk_task)) { // no room to queue it, walking it right away
+            __atomic_sub_fetch(&scan->pending, 1, __ATOMIC_RELAXED);
+            scan_walk(scan, walk_task);
+        }
+    }
+
+    scan_finish(scan, &slot->split);
+}
+
+// Function takes a task from a given deque or steals one from the others, returns 0 if all of them are empty
+static int scan_next(ParallelScan *scan, const unsigned int id, ScanTask *task) {
+    int found = scan_take(&scan->deques[id], task, 0);
+
+    for (unsigned int i = 1; !found && i < scan->workers; i++) {
+        found = scan_take(&scan->deques[(id + i) % scan->workers], task, 1);
+    }
+
+    return found;
+}
+
+// Function runs a task, the tasks it creates are queued to a given deque
+static void scan_run(ParallelScan *scan, ScanDeque *deque, const ScanTask task) {
+    if (task.pdpt == SCAN_SPLIT) {
+        scan_split(scan, deque, task);
+    } else {
+        scan_walk(scan, task);
+    }
+
+    __atomic_sub_fetch(&scan->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Function runs tasks of its own deque and steals from the others until every task is done
+static void* scan_worker(void *arg) {
+    ScanWorker *worker = arg;
+    ParallelScan *scan = worker->scan;
+    ScanTask task;
+
+    memimage_bound = scan->image;
+
+    for (;;) {
+        if (scan_next(scan, worker->id, &task)) {
+            scan_run(scan, &scan->deques[worker->id], task);
+        } else if (__atomic_load_n(&scan->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else {
+            sched_yield(); // the remaining tasks are running, they may still queue new ones
+        }
+    }
+
+    return NULL;
+}
+
+// Function waits until a slot or a result is done, the calling thread runs queued tasks in the meantime
+static void scan_wait(ParallelScan *scan, const uint8_t *flag) {
+    ScanTask task;
+    pthread_mutex_lock(&scan->done_lock);
+
+    while (!*flag) {
+        pthread_mutex_unlock(&scan->done_lock);
+
+        if (scan_next(scan, 0, &task)) {
+            scan_run(scan, &scan->deques[0], task);
+            pthread_mutex_lock(&scan->done_lock);
+        } else {
+            pthread_mutex_lock(&scan->done_lock);
+
+            if (!*flag) {
+                pthread_cond_wait(&scan->done_cond, &scan->done_lock);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&scan->done_lock);
+}
+
+// Function passes the pages of a result to the callback, returns the state of the result
+static TranslationState32 scan_emit(
+    ParallelScan *scan,
+    ScanResult *result,
+    const uint32_t pml4,
+    const uint32_t pdpt,
+    const ENUM_FUNC callback,
+    void *ctx
+) {
+    if (scan->stop) {
+        return ST_SUCCESS_32;
+    }
+
+    if (result->overflow) { // walking the slot again and passing its pages straight to the callback
+        EnumWalk walk = { NULL, scan->read_func_64, callback, ctx, ST_SUCCESS_32, 0, NULL };
+        enum_table_64(&walk, &EnumLevels64[2], 2, result->entry & ClassRules64[1].next_mask, scan_virt_addr(pml4, pdpt), 1);
+        __atomic_store_n(&scan->stop, walk.stopped, __ATOMIC_RELAXED);
+        return walk.state;
+    }
+
+    for (size_t i = 0; i < result->count; i++) {
+        if ((*callback)(&result->pages[i].extent, result->pages[i].leaf_entry, ctx) != 0) {
+            __atomic_store_n(&scan->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    return result->state;
+}
+
+/**
+ * @name va2pa_64_enumerate_parallel
+ * @param threads
+ *  Amount of worker threads, 0 to use one per online CPU
+ * @description:
+ *  Same as va2pa_64_enumerate, but the page tables are walked by a pool of worker threads. The address space
+ *  is split into PML4 slots, which workers split further into PDPT slots (1 GiB each), and idle workers steal
+ *  slots from the busy ones. The callback is still called from the calling thread only and in ascending
+ *  virtual address order, the pages of a slot are kept until all slots below it were passed to the callback.
+ *  While the calling thread waits for the next slot it runs queued slots itself.
+ *  read_func_64 is called from the workers concurrently and has to be thread-safe, memimage_read_func_64()
+ *  reads the image bound to the calling thread. Frame caches are not thread-safe, do not pass fcache_read_func_64()
+ */
+uint8_t va2pa_64_enumerate_parallel(
+    const uint64_t root_addr_64,
+    const PREAD_FUNC_64 read_func_64,
+    const ENUM_FUNC callback,
+    void *ctx,
+    unsigned int threads
+) {
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned int) cpus : 1;
+    }
+
+    ParallelScan *scan = calloc(1, sizeof(ParallelScan));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    ScanWorker *workers = calloc(threads, sizeof(ScanWorker));
+
+    if (scan == NULL || tids == NULL || workers == NULL || (scan->deques = calloc(threads, sizeof(ScanDeque))) == NULL) {
+        free(scan != NULL ? scan->deques : NULL);
+        free(scan);
+        free(tids);
+        free(workers);
+        return va2pa_64_enumerate(root_addr_64, read_func_64, callback, ctx);
+    }
+
+    scan->read_func_64 = read_func_64;
+    scan->image = memimage_bound;
+    scan->workers = threads;
+    pthread_mutex_init(&scan->done_lock, NULL);
+    pthread_cond_init(&scan->done_cond, NULL);
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_mutex_init(&scan->deques[i].lock, NULL);
+    }
+
+    TranslationState32 state = ST_SUCCESS_32;
+    uint64_t pml4[512];
+    TableClass cls;
+    uint64_t pml4_addr = pml4e_addr_64(root_addr_64, 0);
+    unsigned int count = (*read_func_64)(pml4, sizeof(pml4), pml4_addr) / sizeof(uint64_t);
+
+    if (count < 512) {
+        state = ST_RAM_READ_ERROR_32;
+        REPORT_READ_ERROR("pml4e", pml4_addr + count * sizeof(uint64_t), sizeof(pml4) - count * sizeof(uint64_t));
+    }
+
+    classify_table(pml4, count, &ClassRules64[0], &cls);
+
+    // Dealing the PML4 slots out round-robin, the workers balance them by stealing
+    unsigned int queued = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        ScanSlot *slot = &scan->slots[i];
+
+        if (cls.valid[i >> 6] & (1ULL << (i & 63))) {
+            ScanTask task = { i, SCAN_SPLIT };
+
+            slot->entry = pml4[i];
+            slot->expected = 1;
+            scan->pending++;
+
+            if (!scan_push(&scan->deques[queued++ % threads], task)) {
+                scan->pending--;
+                slot->split = 1; // pdpt stays NULL, the calling thread enumerates the slot itself
+            }
+        }
+    }
+
+    unsigned int started = 0;
+    for (unsigned int i = 0; i < threads; i++) {
+        workers[i].scan = scan;
+        workers[i].id = i;
+
+        if (pthread_create(&tids[started], NULL, scan_worker, &workers[i]) == 0) {
+            started++;
+        }
+    }
+
+    // Passing the pages to the callback in ascending virtual address order as soon as their slots are done
+    for (unsigned int i = 0; i < count; i++) {
+        ScanSlot *slot = &scan->slots[i];
+
+        if (!slot->expected) {
+            continue;
+        }
+
+        scan_wait(scan, &slot->split);
+
+        if (slot->pdpt == NULL) {
+            if (!scan->stop) {
+                EnumWalk walk = { NULL, read_func_64, callback, ctx, ST_SUCCESS_32, 0, NULL };
+                enum_table_64(&walk, &EnumLevels64[1], 3, slot->entry & ClassRules64[0].next_mask, scan_virt_addr(i, 0), 1);
+                state = walk.state != ST_SUCCESS_32 ? walk.state : state;
+                __atomic_store_n(&scan->stop, walk.stopped, __ATOMIC_RELAXED);
+            }
+
+            continue;
+        }
+
+        state = slot->state != ST_SUCCESS_32 ? slot->state : state;
+
+        for (unsigned int j = 0; j < 512; j++) {
+            ScanResult *result = &slot->pdpt[j];
+
+            if (result->expected) {
+                scan_wait(scan, &result->done);
+
+                TranslationState32 result_state = scan_emit(scan, result, i, j, callback, ctx);
+                state = result_state != ST_SUCCESS_32 ? result_state : state;
+
+                free(result->pages);
+                result->pages = NULL;
+            }
+        }
+
+        free(slot->pdpt);
+    }
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&scan->deques[i].lock);
+        free(scan->deques[i].tasks);
+    }
+
+    pthread_mutex_destroy(&scan->done_lock);
+    pthread_cond_destroy(&scan->done_cond);
+    free(scan->deques);
+    free(scan);
+    free(tids);
+    free(workers);
+
+    return state;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                 REVERSE MAP                                */
+/* -------------------------------------------------------------------------- */
+
+#define RMAP_MAGIC "VA2PARM" // First bytes of a reverse map file
+#define RMAP_VERSION 1
+#define RMAP_CLASSES 4 // Page sizes in a reverse map: 4 KiB, 2 MiB, 4 MiB and 1 GiB
+
+// Struct represents the data of a map that is written to a file as is and mapped back from it
+typedef struct {
+    void *data;
+    size_t length;
+    int mapped; // data is a file mapping, not an allocation
+} MapBlob;
+
+// Function frees the data of a map, mapped or allocated
+static void mapblob_release(MapBlob *blob) {
+    if (blob->mapped) {
+        munmap(blob->data, blob->length);
+    } else {
+        free(blob->data);
+    }
+}
+
+// Function writes the data of a map to a file, returns 1 on success and 0 otherwise
+static int mapblob_save(const MapBlob *blob, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    int written = fwrite(blob->data, 1, blob->length, file) == blob->length;
+    return fclose(file) == 0 && written;
+}
+
+// Function maps a file as the data of a map, returns 0 if the file could not be mapped
+static int mapblob_load(MapBlob *blob, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (data != MAP_FAILED) {
+            blob->data = data;
+            blob->length = (size_t) st.st_size;
+            blob->mapped = 1;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return blob->data != NULL;
+}
+
+// Struct represents a page of the reverse map, a large page is a single entry that covers its whole range
+typedef struct {
+    uint64_t phys_addr; // physical address of the page
+    uint64_t virt_addr; // virtual address the page is mapped at
+    uint32_t root; // index of the root in the root table
+    uint8_t page_shift;
+    uint8_t pad[3];
+} RmapEntry;
+
+// Struct represents the entries of one page size, they are sorted by physical address
+typedef struct {
+    uint8_t page_shift;
+    uint8_t pad[7];
+    uint64_t first, count;
+} RmapClass;
+
+// Struct represents the beginning of a reverse map, it is followed by the root table and the entries
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t root_count;
+    uint64_t entry_count;
+    RmapClass classes[RMAP_CLASSES];
+} RmapHeader;
+
+// Struct represents a reverse map, the layout in memory is the same as in a file
+typedef struct {
+    const RmapHeader *header;
+    const uint64_t *roots;
+    const RmapEntry *entries;
+    MapBlob blob; // header, root table and entries
+} ReverseMap;
+
+// Struct represents a virtual address a physical address is mapped at
+typedef struct {
+    uint64_t root; // root_addr / root_addr_64 of the address space
+    uint64_t virt_addr; // virtual address of the physical address itself, not of the page
+    uint8_t page_shift; // log2 of the size of the page that maps it
+} RmapHit;
+
+static const uint8_t RmapShifts[RMAP_CLASSES] = { 12, 21, 22, 30 };
+
+// Struct holds the entries collected by rmap_build()
+typedef struct {
+    RmapEntry *entries;
+    size_t count, capacity;
+    uint32_t root;
+    int failed;
+} RmapBuild;
+
+// Function adds a page to the reverse map under construction, it is the ENUM_FUNC of rmap_build()
+static int rmap_collect(const PhysExtent *extent, const uint64_t leaf_entry, void *ctx) {
+    RmapBuild *build = ctx;
+    (void) leaf_entry;
+
+    if (build->count == build->capacity) {
+        size_t capacity = build->capacity != 0 ? build->capacity * 2 : 1024;
+        RmapEntry *entries = realloc(build->entries, capacity * sizeof(RmapEntry));
+
+        if (entries == NULL) {
+            build->failed = 1;
+            return 1;
+        }
+
+        build->entries = entries;
+        build->capacity = capacity;
+    }
+
+    RmapEntry entry = { extent->phys_addr, extent->virt_addr, build->root, extent->page_shift, { 0 } };
+    build->entries[build->count++] = entry;
+    return 0;
+}
+
+static int rmap_entry_cmp(const void *a, const void *b) {
+    const RmapEntry *ea = a, *eb = b;
+
+    if (ea->page_shift != eb->page_shift) {
+        return ea->page_shift < eb->page_shift ? -1 : 1;
+    } else if (ea->phys_addr != eb->phys_addr) {
+        return ea->phys_addr < eb->phys_addr ? -1 : 1;
+    } else if (ea->root != eb->root) {
+        return ea->root < eb->root ? -1 : 1;
+    }
+
+    return (ea->virt_addr > eb->virt_addr) - (ea->virt_addr < eb->virt_addr);
+}
+
+// Function frees a reverse map created by rmap_build() or rmap_load()
+void rmap_destroy(ReverseMap *rmap) {
+    if (rmap == NULL) {
+        return;
+    }
+
+    mapblob_release(&rmap->blob);
+    free(rmap);
+}
+
+// Function points a reverse map into its data, returns 0 if the data is not a valid reverse map
+static int rmap_attach(ReverseMap *rmap) {
+    const RmapHeader *header = rmap->blob.data;
+
+    if (rmap->blob.length < sizeof(RmapHeader) || memcmp(header->magic, RMAP_MAGIC, sizeof(RMAP_MAGIC)) != 0 || 
+        header->version != RMAP_VERSION) {
+        return 0;
+    }
+
+    // Root table and entries have to fill the rest of the data exactly
+    size_t payload = rmap->blob.length - sizeof(RmapHeader);
+    if (header->root_count > payload / sizeof(uint64_t)) {
+        return 0;
+    }
+
+    payload -= (size_t) header->root_count * sizeof(uint64_t);
+    if (payload % sizeof(RmapEntry) != 0 || header->entry_count != payload / sizeof(RmapEntry)) {
+        return 0;
+    }
+
+    for (int i = 0; i < RMAP_CLASSES; i++) {
+        const RmapClass *cls = &header->classes[i];
+
+        if (cls->first > header->entry_count || cls->count > header->entry_count - cls->first || cls->page_shift >= 64) {
+            return 0;
+        }
+    }
+
+    rmap->header = header;
+    rmap->roots = (const uint64_t*)(header + 1);
+    rmap->entries = (const RmapEntry*)(rmap->roots + header->root_count);
+    return 1;
+}
+
+/**
+ * @name rmap_build
+ * @param level
+ *  Level of indirection w/ values 2, 3 or 4 (4 stands for long mode translations of va2pa_64)
+ * @param roots
+ *  Roots of the address spaces that are indexed (values of CR3)
+ * @param root_count
+ *  Amount of roots
+ * @param read_func
+ *  Function that reads physical memory for levels 2 and 3, NULL for level 4
+ * @param read_func_64
+ *  Function that reads physical memory for level 4, NULL for levels 2 and 3
+ * @param state
+ *  Output buffer for the result of the enumerations: ST_SUCCESS_32, ST_INCORRECT_LEVEL_32 or ST_RAM_READ_ERROR_32
+ *  if any of the tables could not be read (the index holds the rest of the pages). May be NULL
+ * @returns ReverseMap*
+ *  Returns the reverse map or NULL if memory could not be allocated or the arguments are wrong
+ * @description:
+ *  Function enumerates every given address space once and indexes the pages by physical address. Large pages
+ *  are stored as one entry per page, so a mapping of a 1 GiB page costs as much as a 4 KiB one
+ */
+ReverseMap* rmap_build(
+    const unsigned int level,
+    const uint64_t *roots,
+    const size_t root_count,
+    const PREAD_FUNC read_func,
+    const PREAD_FUNC_64 read_func_64,
+    uint8_t *state
+) {
+    RmapBuild build = { NULL, 0, 0, 0, 0 };
+    uint8_t result = ST_SUCCESS_32;
+
+    if (level < 2 || level > 4 || (level == 4 ? read_func_64 == NULL : read_func == NULL) || root_count > UINT32_MAX) {
+        result = ST_INCORRECT_LEVEL_32;
+    }
+
+    for (size_t i = 0; i < root_count && result != ST_INCORRECT_LEVEL_32 && !build.failed; i++) {
+        uint8_t root_state;
+        build.root = (uint32_t) i;
+
+        if (level == 4) {
+            root_state = va2pa_64_enumerate(roots[i], read_func_64, rmap_collect, &build);
+        } else {
+            root_state = (uint8_t) va2pa_enumerate(level, (unsigned int) roots[i], read_func, rmap_collect, &build);
+        }
+
+        result = root_state != ST_SUCCESS_32 ? root_state : result;
+    }
+
+    if (state != NULL) {
+        *state = result;
+    }
+
+    ReverseMap *rmap = NULL;
+    size_t length = sizeof(RmapHeader) + root_count * sizeof(uint64_t) + build.count * sizeof(RmapEntry);
+
+    if (result != ST_INCORRECT_LEVEL_32 && !build.failed && (rmap = calloc(1, sizeof(ReverseMap))) != NULL) {
+        rmap->blob.data = calloc(1, length);
+        rmap->blob.length = length;
+    }
+
+    if (rmap == NULL || rmap->blob.data == NULL) {
+        free(rmap);
+        free(build.entries);
+        return NULL;
+    }
+
+    qsort(build.entries, build.count, sizeof(RmapEntry), rmap_entry_cmp);
+
+    RmapHeader *header = rmap->blob.data;
+    memcpy(header->magic, RMAP_MAGIC, sizeof(RMAP_MAGIC));
+    header->version = RMAP_VERSION;
+    header->root_count = (uint32_t) root_count;
+    header->entry_count = build.count;
+
+    size_t first = 0;
+    for (int i = 0; i < RMAP_CLASSES; i++) {
+        RmapClass *cls = &header->classes[i];
+        cls->page_shift = RmapShifts[i];
+        cls->first = first;
+
+        while (first < build.count && build.entries[first].page_shift == RmapShifts[i]) {
+            first++;
+        }
+
+        cls->count = first - cls->first;
+    }
+
+    memcpy(header + 1, roots, root_count * sizeof(uint64_t));
+    memcpy((uint64_t*)(header + 1) + root_count, build.entries, build.count * sizeof(RmapEntry));
+    free(build.entries);
+
+    rmap_attach(rmap);
+    return rmap;
+}
+
+/**
+ * @name rmap_lookup
+ * @param rmap
+ *  Reverse map
+ * @param phys_addr
+ *  Physical address
+ * @param hits
+ *  Output buffer for the virtual addresses the physical address is mapped at, sorted by page size, root and 
+ *  virtual address. May be NULL if max_hits is 0
+ * @param max_hits
+ *  Size of the output buffer
+ * @returns size_t
+ *  Returns the amount of virtual addresses the physical address is mapped at, hits holds the first max_hits of them
+ * @description:
+ *  Function answers which virtual addresses in which address spaces map a physical address. Every page size
+ *  is a sorted array of its own, so the query is a binary search per page size
+ */
+size_t rmap_lookup(const ReverseMap *rmap, const uint64_t phys_addr, RmapHit *hits, const size_t max_hits) {
+    size_t found = 0;
+
+    for (int i = 0; i < RMAP_CLASSES; i++) {
+        const RmapClass *cls = &rmap->header->classes[i];
+        const RmapEntry *entries = rmap->entries + cls->first;
+        uint64_t offset = phys_addr & ((1ULL << cls->page_shift) - 1);
+        uint64_t page = phys_addr - offset;
+        size_t lo = 0, hi = cls->count;
+
+        while (lo < hi) { // first entry of the page
+            size_t mid = lo + (hi - lo) / 2;
+
+            if (entries[mid].phys_addr < page) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        for (; lo < cls->count && entries[lo].phys_addr == page; lo++, found++) {
+            if (found < max_hits) {
+                hits[found].root = rmap->roots[entries[lo].root];
+                hits[found].virt_addr = entries[lo].virt_addr + offset;
+                hits[found].page_shift = cls->page_shift;
+            }
+        }
+    }
+
+    return found;
+}
+
+// Function writes a reverse map to a file that rmap_load() maps back, returns 1 on success and 0 otherwise
+int rmap_save(const ReverseMap *rmap, const char *path) {
+    return mapblob_save(&rmap->blob, path);
+}
+
+/**
+ * @name rmap_load
+ * @param path
+ *  File written by rmap_save()
+ * @returns ReverseMap*
+ *  Returns the reverse map or NULL if the file could not be mapped or is not a reverse map
+ * @description:
+ *  Function maps a saved reverse map, queries read it in place without loading or parsing the entries
+ */
+ReverseMap* rmap_load(const char *path) {
+    ReverseMap *rmap = calloc(1, sizeof(ReverseMap));
+    if (rmap == NULL) {
+        return NULL;
+    }
+
+    if (!mapblob_load(&rmap->blob, path) || !rmap_attach(rmap)) {
+        rmap_destroy(rmap);
+        return NULL;
+    }
+
+    // Lookups binary search all over the entries
+    madvise(rmap->blob.data, rmap->blob.length, MADV_RANDOM);
+    return rmap;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            FLAT TRANSLATION MAP                            */
+/* -------------------------------------------------------------------------- */
+
+#define FMAP_MAGIC "VA2PAFM" // First bytes of a flat translation map file
+#define FMAP_VERSION 1
+
+// Struct represents a virtually and physically contiguous range of a flat map
+typedef struct {
+    uint64_t virt_addr;
+    uint64_t phys_addr;
+    uint64_t length;
+    uint8_t page_shift; // smallest page size the extent is made of
+    uint8_t pad[7];
+} FlatExtent;
+
+// Struct represents the beginning of a flat map, it is followed by the extents sorted by virtual address,
+// their virtual addresses in Eytzinger order (1-based, the first key is unused) and the position of every key
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t level; // 2, 3 or 4, same as for rmap_build()
+    uint64_t root; // root the map was built from
+    uint64_t extent_count;
+    uint64_t pages; // pages the extents were coalesced from
+} FlatHeader;
+
+// Struct represents a flat translation map, the layout in memory is the same as in a file
+typedef struct {
+    const FlatHeader *header;
+    const FlatExtent *extents;
+    const uint64_t *keys; // extent_count + 1 virtual addresses
+    const uint32_t *pos; // extent_count + 1 positions in extents
+    MapBlob blob; // header, extents and index
+} FlatMap;
+
+// Struct holds the extents collected by fmap_build()
+typedef struct {
+    FlatExtent *extents;
+    size_t count, capacity;
+    uint64_t pages;
+    int failed;
+} FmapBuild;
+
+// Function adds a page to the flat map under construction, growing the last extent if it continues it. It is the ENUM_FUNC of fmap_build()
+static int fmap_collect(const PhysExtent *extent, const uint64_t leaf_entry, void *ctx) {
+    FmapBuild *build = ctx;
+    FlatExtent *last = build->count != 0 ? &build->extents[build->count - 1] : NULL;
+    (void) leaf_entry;
+
+    build->pages++;
+
+    if (last != NULL && last->virt_addr + last->length == extent->virt_addr && last->phys_addr + last->length == extent->phys_addr) {
+        last->length += extent->length;
+        last->page_shift = extent->page_shift < last->page_shift ? extent->page_shift : last->page_shift;
+        return 0;
+    }
+
+    if (build->count == build->capacity) {
+        size_t capacity = build->capacity != 0 ? build->capacity * 2 : 1024;
+        FlatExtent *extents = realloc(build->extents, capacity * sizeof(FlatExtent));
+
+        if (extents == NULL) {
+            build->failed = 1;
+            return 1;
+        }
+
+        build->extents = extents;
+        build->capacity = capacity;
+    }
+
+    FlatExtent flat = { extent->virt_addr, extent->phys_addr, extent->length, extent->page_shift, { 0 } };
+    build->extents[build->count++] = flat;
+    return 0;
+}
+
+// Function lays out the extent addresses of a flat map in Eytzinger order, returns the next extent to be placed
+static size_t fmap_index_fill(FlatMap *map, uint64_t *keys, uint32_t *pos, size_t next, const size_t k) {
+    if (k <= map->header->extent_count) {
+        next = fmap_index_fill(map, keys, pos, next, 2 * k);
+        keys[k] = map->extents[next].virt_addr;
+        pos[k] = (uint32_t) next++;
+        next = fmap_index_fill(map, keys, pos, next, 2 * k + 1);
+    }
+
+    return next;
+}
+
+// Function returns the size of the data of a flat map with a given amount of extents
+static size_t fmap_length(const uint64_t extent_count) {
+    return sizeof(FlatHeader) + extent_count * sizeof(FlatExtent) + (extent_count + 1) * (sizeof(uint64_t) + sizeof(uint32_t));
+}
+
+// Function frees a flat map created by fmap_build() or fmap_load()
+void fmap_destroy(FlatMap *map) {
+    if (map == NULL) {
+        return;
+    }
+
+    mapblob_release(&map->blob);
+    free(map);
+}
+
+// Function points a flat map into its data, returns 0 if the data is not a valid flat map
+static int fmap_attach(FlatMap *map) {
+    const FlatHeader *header = map->blob.data;
+
+    if (map->blob.length < sizeof(FlatHeader) || memcmp(header->magic, FMAP_MAGIC, sizeof(FMAP_MAGIC)) != 0 || 
+        header->version != FMAP_VERSION || header->extent_count >= UINT32_MAX || 
+        fmap_length(header->extent_count) != map->blob.length) {
+        return 0;
+    }
+
+    map->header = header;
+    map->extents = (const FlatExtent*)(header + 1);
+    map->keys = (const uint64_t*)(map->extents + header->extent_count);
+    map->pos = (const uint32_t*)(map->keys + header->extent_count + 1);
+    return 1;
+}
+
+static int fmap_extent_cmp(const void *a, const void *b) {
+    uint64_t va = ((const FlatExtent*) a)->virt_addr, vb = ((const FlatExtent*) b)->virt_addr;
+    return (va > vb) - (va < vb);
+}
+
+/**
+ * @name fmap_build
+ * @param level
+ *  Level of indirection w/ values 2, 3 or 4 (4 stands for long mode translations of va2pa_64)
+ * @param root_addr
+ *  Root of the address space (value of CR3)
+ * @param read_func
+ *  Function that reads physical memory for levels 2 and 3, NULL for level 4
+ * @param read_func_64
+ *  Function that reads physical memory for level 4, NULL for levels 2 and 3
+ * @param state
+ *  Output buffer for the result of the enumeration, same as for rmap_build(). May be NULL
+ * @returns FlatMap*
+ *  Returns the flat map or NULL if memory could not be allocated or the arguments are wrong
+ * @description:
+ *  Function enumerates an address space once and stores every translation of it as a table of extents:
+ *  pages that follow each other both virtually and physically become one extent. fmap_translate() then
+ *  answers translations of the address space without a read function. Save it with fmap_save() so that
+ *  later jobs only have to map it with fmap_load()
+ */
+FlatMap* fmap_build(
+    const unsigned int level,
+    const uint64_t root_addr,
+    const PREAD_FUNC read_func,
+    const PREAD_FUNC_64 read_func_64,
+    uint8_t *state
+) {
+    FmapBuild build = { NULL, 0, 0, 0, 0 };
+    uint8_t result;
+
+    if (level < 2 || level > 4 || (level == 4 ? read_func_64 == NULL : read_func == NULL)) {
+        result = ST_INCORRECT_LEVEL_32;
+    } else if (level == 4) {
+        result = va2pa_64_enumerate(root_addr, read_func_64, fmap_collect, &build);
+    } else {
+        result = (uint8_t) va2pa_enumerate(level, (unsigned int) root_addr, read_func, fmap_collect, &build);
+    }
+
+    if (state != NULL) {
+        *state = result;
+    }
+
+    FlatMap *map = NULL;
+    if (result != ST_INCORRECT_LEVEL_32 && !build.failed && build.count < UINT32_MAX && (map = calloc(1, sizeof(FlatMap))) != NULL) {
+        map->blob.length = fmap_length(build.count);
+        map->blob.data = calloc(1, map->blob.length);
+    }
+
+    if (map == NULL || map->blob.data == NULL) {
+        free(map);
+        free(build.extents);
+        return NULL;
+    }
+
+    // Enumerations report pages in ascending order, sorting only keeps the map independent of that
+    if (build.count != 0) {
+        qsort(build.extents, build.count, sizeof(FlatExtent), fmap_extent_cmp);
+        memcpy((FlatHeader*) map->blob.data + 1, build.extents, build.count * sizeof(FlatExtent));
+    }
+
+    FlatHeader *header = map->blob.data;
+    memcpy(header->magic, FMAP_MAGIC, sizeof(FMAP_MAGIC));
+    header->version = FMAP_VERSION;
+    header->level = level;
+    header->root = root_addr;
+    header->extent_count = build.count;
+    header->pages = build.pages;
+
+    free(build.extents);
+    fmap_attach(map);
+
+    fmap_index_fill(map, (uint64_t*) map->keys, (uint32_t*) map->pos, 0, 1);
+    return map;
+}
+
+/**
+ * @name fmap_translate
+ * @param map
+ *  Flat map built by fmap_build() or loaded by fmap_load()
+ * @param virt_addr
+ *  Virtual address, bits 63:48 of long mode addresses are ignored the same way va2pa_64() ignores them
+ * @param phys_addr
+ *  Output buffer for the physical address
+ * @returns uint8_t
+ *  Returns 1 if the address is mapped and 0 otherwise, why a translation fails is not kept in the map
+ * @description:
+ *  Function translates an address with the map alone. The extent that starts at or below the address is
+ *  found by a branch-free descent through the Eytzinger ordered starts, the first levels of which share
+ *  cache lines and are prefetched ahead of the descent
+ */
+uint8_t fmap_translate(const FlatMap *map, uint64_t virt_addr, uint64_t *phys_addr) {
+    const uint64_t *keys = map->keys;
+    uint64_t count = map->header->extent_count;
+    size_t k = 1;
+
+    if (map->header->level == 4) { // enumerations report long mode addresses sign extended
+        virt_addr = (uint64_t)((int64_t)(virt_addr << 16) >> 16);
+    }
+
+    while (k <= count) {
+        __builtin_prefetch(keys + 8 * k);
+        k = 2 * k + (keys[k] <= virt_addr);
+    }
+
+    // k is past a leaf now, dropping the trailing right turns and the left turn above them leads to the first key above the address
+    k >>= __builtin_ffsll(~(long long) k);
+    size_t above = k != 0 ? map->pos[k] : count;
+
+    if (above == 0 || above > count) {
+        return 0;
+    }
+
+    const FlatExtent *extent = &map->extents[above - 1];
+    if (virt_addr - extent->virt_addr >= extent->length) {
+        return 0;
+    }
+
+    *phys_addr = extent->phys_addr + (virt_addr - extent->virt_addr);
+    return 1;
+}
+
+// Function writes a flat map to a file that fmap_load() maps back, returns 1 on success and 0 otherwise
+int fmap_save(const FlatMap *map, const char *path) {
+    return mapblob_save(&map->blob, path);
+}
+
+/**
+ * @name fmap_load
+ * @param path
+ *  File written by fmap_save()
+ * @returns FlatMap*
+ *  Returns the flat map or NULL if the file could not be mapped or is not a flat map
+ * @description:
+ *  Function maps a saved flat map, translations read it in place without loading or parsing the extents
+ */
+FlatMap* fmap_load(const char *path) {
+    FlatMap *map = calloc(1, sizeof(FlatMap));
+    if (map == NULL) {
+        return NULL;
+    }
+
+    if (!mapblob_load(&map->blob, path) || !fmap_attach(map)) {
+        fmap_destroy(map);
+        return NULL;
+    }
+
+    // Descents touch the top of the index on every translation and single lines everywhere else
+    madvise(map->blob.data, map->blob.length, MADV_RANDOM);
+    return map;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                              PAGE TABLE IMAGE                              */
+/* -------------------------------------------------------------------------- */
+
+#define PTIMAGE_MAGIC "VA2PAPT" // First bytes of a page table image file
+#define PTIMAGE_VERSION 1
+#define PTIMAGE_FRAME 4096 // Frames are stored in slots of this size, the header takes the first slot
+
+// Struct represents a root a page table image is captured from
+typedef struct {
+    uint64_t root_addr; // CR3
+    uint8_t level; // 2 for legacy, 3 for PAE and 4 for long mode
+    uint8_t pad[7];
+} PtImageRoot;
+
+// Struct represents a frame stored in a page table image, the index of an image is sorted by physical address
+typedef struct {
+    uint64_t phys_addr; // address of the frame
+    uint64_t file_offset; // slot of the frame in the file
+    uint32_t length; // bytes of the frame that could be read when it was captured, the rest of the slot is padding
+    uint8_t table; // frame holds a paging structure, otherwise it is one of the selected data frames
+    uint8_t pad[3];
+} PtImageFrame;
+
+// Struct represents the header of a page table image file, the file is laid out as
+// header slot | frame slots | PtImageRoot array | PtImageFrame index
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t root_count;
+    uint64_t frame_count;
+    uint64_t table_count; // frames that hold paging structures
+    uint64_t roots_offset;
+    uint64_t index_offset;
+} PtImageHeader;
+
+// Struct holds the state of a capture
+typedef struct {
+    PREAD_FUNC read_func;
+    PREAD_FUNC_64 read_func_64;
+    FILE *file;
+    PtImageFrame *frames; // in the order they were written
+    size_t count, capacity;
+    uint64_t *seen; // open addressing set of frame addresses | 1 once stored and table addresses | 2 once walked
+    size_t seen_mask, seen_count;
+    uint64_t table_count;
+    TranslationState32 state; // ST_RAM_READ_ERROR_32 once a frame could not be read
+    int failed; // out of memory or the file could not be written
+} PtCapture;
+
+// Function returns the slot of a key in the seen set, either the one holding it or the empty one it goes to
+static size_t ptcap_slot(const uint64_t *seen, const size_t mask, const uint64_t key) {
+    size_t slot = (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 24) & mask;
+
+    while (seen[slot] != 0 && seen[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+// Function adds a key to the seen set, returns 1 if it was not there before
+static int ptcap_insert(PtCapture *cap, const uint64_t key) {
+    if ((cap->seen_count + 1) * 2 > cap->seen_mask + 1) { // Keeping the set at most half full
+        size_t mask = cap->seen_mask * 2 + 1;
+        uint64_t *seen = calloc(mask + 1, sizeof(uint64_t));
+
+        if (seen == NULL) {
+            cap->failed = 1;
+            return 0;
+        }
+
+        for (size_t i = 0; cap->seen != NULL && i <= cap->seen_mask; i++) {
+            if (cap->seen[i] != 0) {
+                seen[ptcap_slot(seen, mask, cap->seen[i])] = cap->seen[i];
+            }
+        }
+
+        free(cap->seen);
+        cap->seen = seen;
+        cap->seen_mask = mask;
+    }
+
+    size_t slot = ptcap_slot(cap->seen, cap->seen_mask, key);
+
+    if (cap->seen[slot] == key) {
+        return 0;
+    }
+
+    cap->seen[slot] = key;
+    cap->seen_count++;
+    return 1;
+}
+
+// Function reads the frame holding a given address into buf and stores it unless it is stored already, returns the amount read
+static unsigned int ptcap_frame(PtCapture *cap, const uint64_t addr, uint8_t *buf, const int table) {
+    uint64_t frame = addr & ~(uint64_t) (PTIMAGE_FRAME - 1);
+    unsigned int read = cap->read_func_64 != NULL ? 
+        (*cap->read_func_64)(buf, PTIMAGE_FRAME, frame) : (*cap->read_func)(buf, PTIMAGE_FRAME, (unsigned int) frame);
+
+    read = read < PTIMAGE_FRAME ? read : PTIMAGE_FRAME;
+    memset(buf + read, 0, PTIMAGE_FRAME - read);
+
+    if (read == 0 || !ptcap_insert(cap, frame | 1)) {
+        return read;
+    }
+
+    if (cap->count == cap->capacity) {
+        size_t capacity = cap->capacity == 0 ? 1024 : cap->capacity * 2;
+        PtImageFrame *frames = realloc(cap->frames, capacity * sizeof(PtImageFrame));
+
+        if (frames == NULL) {
+            cap->failed = 1;
+            return read;
+        }
+
+        cap->frames = frames;
+        cap->capacity = capacity;
+    }
+
+    PtImageFrame *stored = &cap->frames[cap->count++];
+    memset(stored, 0, sizeof(PtImageFrame));
+    stored->phys_addr = frame;
+    stored->file_offset = (uint64_t) cap->count * PTIMAGE_FRAME; // slot 0 is the header
+    stored->length = read;
+    stored->table = (uint8_t) table;
+    cap->table_count += table != 0;
+
+    if (fwrite(buf, 1, PTIMAGE_FRAME, cap->file) != PTIMAGE_FRAME) {
+        cap->failed = 1;
+    }
+
+    return read;
+}
+
+// Function records that fewer entries of a paging structure than it has could be read
+static void ptcap_check_read(PtCapture *cap, const uint64_t addr, const unsigned int read, const unsigned int size) {
+    if (read < size) {
+        cap->state = ST_RAM_READ_ERROR_32;
+        REPORT_READ_ERROR(NULL, addr + read, size - read);
+    }
+}
+
+// Function captures a paging structure with 8-byte entries and every paging structure below it
+static void ptcap_table_64(PtCapture *cap, const EnumLevel *level, const int depth, const uint64_t table_addr) {
+    uint64_t frame[PTIMAGE_FRAME / sizeof(uint64_t)];
+    unsigned int offset = table_addr & (PTIMAGE_FRAME - 1), size = level->entries * sizeof(uint64_t);
+    TableClass cls;
+
+    // Subtrees shared by several roots and self-referencing entries are walked once
+    if (cap->failed || !ptcap_insert(cap, table_addr | 2)) {
+        return;
+    }
+
+    unsigned int read = ptcap_frame(cap, table_addr, (uint8_t*) frame, 1);
+    read = read > offset ? read - offset : 0;
+    read = read < size ? read : size;
+    ptcap_check_read(cap, table_addr, read, size);
+
+    if (depth == 1) { // Page tables only point at data frames
+        return;
+    }
+
+    // Exactly the entries the walks would follow to another paging structure
+    classify_table(frame + offset / sizeof(uint64_t), read / sizeof(uint64_t), level->rule, &cls);
+
+    for (unsigned int word = 0; word < CLASS_WORDS; word++) {
+        for (uint64_t tables = cls.valid[word] & ~cls.large[word]; tables != 0; tables &= tables - 1) {
+            ptcap_table_64(cap, level + 1, depth - 1, cls.next[word * 64 + __builtin_ctzll(tables)]);
+        }
+    }
+}
+
+// Function captures a legacy page directory and its page tables
+static void ptcap_legacy(PtCapture *cap, const uint32_t root_addr) {
+    uint32_t pd[1024], pt[1024];
+    uint64_t pd_addr = pde_addr_32(root_addr, 0);
+
+    if (cap->failed || !ptcap_insert(cap, pd_addr | 2)) {
+        return;
+    }
+
+    unsigned int read = ptcap_frame(cap, pd_addr, (uint8_t*) pd, 1);
+    ptcap_check_read(cap, pd_addr, read, sizeof(pd));
+
+    for (unsigned int i = 0; i < read / sizeof(uint32_t) && !cap->failed; i++) {
+        if (!(pd[i] & (1 << PDEBits.present)) || check_pde_legacy(pd[i]) != ST_SUCCESS_32 || (pd[i] & (1 << PDEBits.pse))) {
+            continue;
+        }
+
+        uint64_t pt_addr = pte_addr_32(pd[i], 0);
+
+        if (ptcap_insert(cap, pt_addr | 2)) {
+            ptcap_check_read(cap, pt_addr, ptcap_frame(cap, pt_addr, (uint8_t*) pt, 1), sizeof(pt));
+        }
+    }
+}
+
+static int ptimage_frame_cmp(const void *a, const void *b) {
+    uint64_t pa = ((const PtImageFrame*) a)->phys_addr, pb = ((const PtImageFrame*) b)->phys_addr;
+    return (pa > pb) - (pa < pb);
+}
+
+/**
+ * @name ptimage_capture
+ * @param path
+ *  Page table image file to be written
+ * @param roots
+ *  Array of root_count roots, each one with its paging mode
+ * @param read_func, read_func_64
+ *  Functions that read physical memory, read_func_64 is used if both are given
+ * @param data_addrs
+ *  Array of data_count physical addresses whose frames are stored as well, NULL if data_count is 0
+ * @param state
+ *  ST_SUCCESS_32, ST_RAM_READ_ERROR_32 if any of the frames could not be fully read (what could be read is
+ *  stored) or ST_INCORRECT_LEVEL_32 if any of the roots has a wrong level (it is skipped). May be NULL, it is
+ *  not written if the file could not be created since nothing was captured then
+ * @returns int
+ *  Returns 1 if the image was written and 0 if it could not be written or memory could not be allocated
+ * @description:
+ *  Function writes a sparse image that holds every paging structure reachable from the roots and the selected
+ *  data frames. Entries are followed exactly when va2pa / va2pa_64 would follow them (same integrity checks as
+ *  the enumeration), so translations from the image give the same results as from the memory it was captured
+ *  from, at a fraction of its size. Open it with memimage_open_ptimage()
+ */
+int ptimage_capture(
+    const char *path,
+    const PtImageRoot *roots,
+    const size_t root_count,
+    const PREAD_FUNC read_func,
+    const PREAD_FUNC_64 read_func_64,
+    const uint64_t *data_addrs,
+    const size_t data_count,
+    uint8_t *state
+) {
+    PtCapture cap = { 0 };
+    PtImageHeader header = { 0 };
+    uint8_t slot[PTIMAGE_FRAME] = { 0 };
+    uint8_t level_error = 0; // a root with a wrong level was skipped
+
+    cap.read_func = read_func;
+    cap.read_func_64 = read_func_64;
+    cap.state = ST_SUCCESS_32;
+
+    if ((cap.file = fopen(path, "wb")) == NULL) {
+        return 0;
+    }
+
+    cap.failed = fwrite(slot, 1, PTIMAGE_FRAME, cap.file) != PTIMAGE_FRAME; // header goes here at the end
+
+    for (size_t i = 0; i < root_count && !cap.failed; i++) {
+        if (roots[i].level == 4) {
+            ptcap_table_64(&cap, EnumLevels64, 4, pml4e_addr_64(roots[i].root_addr, 0));
+        } else if (roots[i].level == 3) {
+            ptcap_table_64(&cap, EnumLevelsPAE, 3, pdpte_addr_pae((uint32_t) roots[i].root_addr, 0));
+        } else if (roots[i].level == 2) {
+            ptcap_legacy(&cap, (uint32_t) roots[i].root_addr);
+        } else {
+            level_error = 1;
+        }
+    }
+
+    for (size_t i = 0; i < data_count && !cap.failed; i++) {
+        unsigned int read = ptcap_frame(&cap, data_addrs[i], slot, 0);
+        ptcap_check_read(&cap, data_addrs[i] & ~(uint64_t) (PTIMAGE_FRAME - 1), read, PTIMAGE_FRAME);
+    }
+
+    if (cap.count != 0) {
+        qsort(cap.frames, cap.count, sizeof(PtImageFrame), ptimage_frame_cmp);
+    }
+
+    memcpy(header.magic, PTIMAGE_MAGIC, sizeof(header.magic));
+    header.version = PTIMAGE_VERSION;
+    header.root_count = (uint32_t) root_count;
+    header.frame_count = cap.count;
+    header.table_count = cap.table_count;
+    header.roots_offset = (uint64_t) (cap.count + 1) * PTIMAGE_FRAME;
+    header.index_offset = header.roots_offset + root_count * sizeof(PtImageRoot);
+
+    int written = !cap.failed &&
+        (root_count == 0 || fwrite(roots, sizeof(PtImageRoot), root_count, cap.file) == root_count) &&
+        (cap.count == 0 || fwrite(cap.frames, sizeof(PtImageFrame), cap.count, cap.file) == cap.count) &&
+        fseek(cap.file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, cap.file) == 1;
+
+    written = fclose(cap.file) == 0 && written;
+    free(cap.frames);
+    free(cap.seen);
+
+    if (state != NULL) {
+        *state = level_error ? ST_INCORRECT_LEVEL_32 : cap.state;
+    }
+
+    return written;
+}
+
+/**
+ * @name memimage_open_ptimage
+ * @param path
+ *  Page table image written by ptimage_capture()
+ * @param roots
+ *  If not NULL, receives a copy of the roots the image was captured from (free it with free())
+ * @param root_count
+ *  If not NULL, receives the amount of roots
+ * @returns MemImage*
+ *  Returns the image or NULL if the file could not be mapped or is not a valid page table image
+ * @description:
+ *  Function maps a page table image as a sparse memory image, it is used like any other MemImage
+ *  (memimage_read_func_64, phys_image_init, va2pa_64_image). Memory that was not captured cannot be read,
+ *  so only walks of the captured roots and reads of the captured data frames succeed
+ */
+MemImage* memimage_open_ptimage(const char *path, PtImageRoot **roots, size_t *root_count) {
+    MemImage *image = memimage_alloc(0);
+    struct stat st;
+
+    if (image == NULL) {
+        return NULL;
+    }
+
+    image->fd = open(path, O_RDONLY);
+    if (image->fd < 0 || fstat(image->fd, &st) != 0 || (uint64_t) st.st_size < PTIMAGE_FRAME ||
+        (image->mapping = memimage_map(image->fd, (size_t) st.st_size)) == NULL) {
+        memimage_close(image);
+        return NULL;
+    }
+
+    image->mapping_length = (size_t) st.st_size;
+    close(image->fd);
+    image->fd = -1;
+
+    const uint8_t *data = image->mapping;
+    const PtImageHeader *header = (const PtImageHeader*) data;
+    uint64_t size = (uint64_t) st.st_size;
+
+    // Every offset and count is checked against the file before it is used
+    if (memcmp(header->magic, PTIMAGE_MAGIC, sizeof(header->magic)) != 0 || header->version != PTIMAGE_VERSION ||
+        header->frame_count > size / PTIMAGE_FRAME || header->roots_offset > size || header->index_offset > size ||
+        (size - header->roots_offset) / sizeof(PtImageRoot) < header->root_count ||
+        (size - header->index_offset) / sizeof(PtImageFrame) < header->frame_count || header->index_offset % sizeof(uint64_t) != 0) {
+        memimage_close(image);
+        return NULL;
+    }
+
+    const PtImageFrame *frames = (const PtImageFrame*) (data + header->index_offset);
+    MemSegment *segments = calloc(header->frame_count ? header->frame_count : 1, sizeof(MemSegment));
+    size_t kept = 0;
+
+    if (segments == NULL) {
+        memimage_close(image);
+        return NULL;
+    }
+
+    free(image->segments);
+    image->segments = segments;
+
+    for (uint64_t i = 0; i < header->frame_count; i++) {
+        const PtImageFrame *frame = &frames[i];
+
+        // Frames have to be aligned, in bounds and sorted without overlaps for the segment ends not to wrap
+        if (frame->length > PTIMAGE_FRAME || frame->file_offset > size - PTIMAGE_FRAME || 
+            (frame->phys_addr & (PTIMAGE_FRAME - 1)) != 0 || frame->phys_addr > UINT64_MAX - PTIMAGE_FRAME ||
+            (kept != 0 && segments[kept - 1].phys_start + segments[kept - 1].length > frame->phys_addr)) {
+            memimage_close(image);
+            return NULL;
+        }
+
+        if (frame->length == 0) {
+            continue;
+        }
+
+        // Frames that follow each other both in memory and in the file make one segment
+        MemSegment *prev = kept != 0 ? &segments[kept - 1] : NULL;
+        if (prev != NULL && prev->length % PTIMAGE_FRAME == 0 && prev->phys_start + prev->length == frame->phys_addr &&
+            prev->file_offset + prev->length == frame->file_offset) {
+            prev->length += frame->length;
+            continue;
+        }
+
+        segments[kept].phys_start = frame->phys_addr;
+        segments[kept].length = frame->length;
+        segments[kept].file_offset = frame->file_offset;
+        segments[kept].data = data + frame->file_offset;
+        kept++;
+    }
+
+    image->count = kept;
+
+    if (roots != NULL) {
+        *roots = malloc(header->root_count ? header->root_count * sizeof(PtImageRoot) : 1);
+
+        if (*roots == NULL) {
+            memimage_close(image);
+            return NULL;
+        }
+
+        memcpy(*roots, data + header->roots_offset, header->root_count * sizeof(PtImageRoot));
+    }
+
+    if (root_count != NULL) {
+        *root_count = header->root_count;
+    }
+
+    if (!memimage_build_index(image)) {
+        if (roots != NULL) {
+            free(*roots);
+            *roots = NULL;
+        }
+
+        memimage_close(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                SNAPSHOT DIFF                               */
+/* -------------------------------------------------------------------------- */
+
+// Struct represents the content of a paging structure, identical contents are stored once
+typedef struct SnapFrame {
+    uint64_t hash; // hash of the entries and the level
+    uint32_t refs;
+    uint8_t level; // index into EnumLevels64, 0 for a PML4
+    uint64_t valid[CLASS_WORDS], large[CLASS_WORDS]; // classification of the entries, see TableClass
+    uint64_t entries[512];
+    struct SnapFrame *next; // hash chain
+} SnapFrame;
+
+// Struct represents a paging structure and everything below it, identical subtrees are stored once
+typedef struct SnapTable {
+    uint64_t hash; // hash of the frame and of the subtrees of its entries (Merkle hash)
+    uint32_t refs;
+    SnapFrame *frame;
+    struct SnapTable **children; // subtree of every entry that references a paging structure, NULL for page tables
+    struct SnapTable *next; // hash chain
+} SnapTable;
+
+// Struct represents a content-addressed store of paging structures shared by snapshots
+typedef struct {
+    SnapFrame **frame_buckets;
+    SnapTable **table_buckets;
+    size_t frame_mask, table_mask; // amount of buckets - 1, power of two
+    size_t frames, tables; // amount of stored frames and subtrees
+    size_t reused; // subtrees a walk found in the store instead of building them
+} SnapStore;
+
+/**
+ * @name SNAP_DIFF_FUNC
+ * @param old_page
+ *  Page of the old snapshot or NULL if the page was added
+ * @param old_entry
+ *  Leaf entry of the old page
+ * @param new_page
+ *  Page of the new snapshot or NULL if the page was removed
+ * @param new_entry
+ *  Leaf entry of the new page
+ * @param ctx
+ *  Pointer passed to snap_diff()
+ * @returns int
+ *  Returns 0 to continue or any other value to stop
+ */
+typedef int (*SNAP_DIFF_FUNC)(const PhysExtent *old_page, const uint64_t old_entry, const PhysExtent *new_page, const uint64_t new_entry, void *ctx);
+
+// Function mixes a value into a hash
+static inline uint64_t snap_mix(uint64_t hash, const uint64_t value) {
+    hash ^= value + 0x9E3779B97F4A7C15 + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 31;
+    hash *= 0xBF58476D1CE4E5B9;
+    return hash ^ (hash >> 29);
+}
+
+// Function doubles the amount of buckets of a hash table once it holds more items than buckets
+static int snap_grow(void ***buckets, size_t *mask, const size_t items, const size_t next_offset) {
+    if (*buckets != NULL && items <= *mask) {
+        return 1;
+    }
+
+    size_t count = *buckets != NULL ? (*mask + 1) * 2 : 1024;
+    void **grown = calloc(count, sizeof(void*));
+
+    if (grown == NULL) {
+        return *buckets != NULL; // a full table still works, only slower
+    }
+
+    for (size_t i = 0; *buckets != NULL && i <= *mask; i++) {
+        for (void *item = (*buckets)[i], *next; item != NULL; item = next) {
+            next = *(void**)((char*) item + next_offset);
+            uint64_t hash = *(uint64_t*) item; // hash is the first member of the items
+            *(void**)((char*) item + next_offset) = grown[hash & (count - 1)];
+            grown[hash & (count - 1)] = item;
+        }
+    }
+
+    free(*buckets);
+    *buckets = grown;
+    *mask = count - 1;
+    return 1;
+}
+
+// Function creates an empty store
+SnapStore* snapstore_create(void) {
+    return calloc(1, sizeof(SnapStore));
+}
+
+// Function drops a reference to a frame
+static void snap_frame_release(SnapStore *store, SnapFrame *frame) {
+    if (--frame->refs != 0) {
+        return;
+    }
+
+    SnapFrame **link = &store->frame_buckets[frame->hash & store->frame_mask];
+    while (*link != frame) {
+        link = &(*link)->next;
+    }
+
+    *link = frame->next;
+    store->frames--;
+    free(frame);
+}
+
+// Function drops a reference to a snapshot or a subtree of it, subtrees no other snapshot uses are freed
+void snap_release(SnapStore *store, SnapTable *table) {
+    if (table == NULL || --table->refs != 0) {
+        return;
+    }
+
+    SnapTable **link = &store->table_buckets[table->hash & store->table_mask];
+    while (*link != table) {
+        link = &(*link)->next;
+    }
+
+    *link = table->next;
+    store->tables--;
+
+    for (unsigned int i = 0; table->children != NULL && i < 512; i++) {
+        snap_release(store, table->children[i]);
+    }
+
+    snap_frame_release(store, table->frame);
+    free(table->children);
+    free(table);
+}
+
+// Function frees a store, every snapshot walked with it is freed as well
+void snapstore_destroy(SnapStore *store) {
+    if (store == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; store->table_buckets != NULL && i <= store->table_mask; i++) {
+        for (SnapTable *table = store->table_buckets[i], *next; table != NULL; table = next) {
+            next = table->next;
+            free(table->children);
+            free(table);
+        }
+    }
+
+    for (size_t i = 0; store->frame_buckets != NULL && i <= store->frame_mask; i++) {
+        for (SnapFrame *frame = store->frame_buckets[i], *next; frame != NULL; frame = next) {
+            next = frame->next;
+            free(frame);
+        }
+    }
+
+    free(store->table_buckets);
+    free(store->frame_buckets);
+    free(store);
+}
+
+// Function returns a referenced frame with given entries, returns NULL if memory could not be allocated
+static SnapFrame* snap_frame_get(SnapStore *store, const uint8_t level, const uint64_t *entries) {
+    uint64_t hash = level;
+    for (unsigned int i = 0; i < 512; i++) {
+        hash = snap_mix(hash, entries[i]);
+    }
+
+    if (!snap_grow((void***) &store->frame_buckets, &store->frame_mask, store->frames, offsetof(SnapFrame, next))) {
+        return NULL;
+    }
+
+    SnapFrame **bucket = &store->frame_buckets[hash & store->frame_mask];
+
+    for (SnapFrame *frame = *bucket; frame != NULL; frame = frame->next) {
+        if (frame->hash == hash && frame->level == level && memcmp(frame->entries, entries, sizeof(frame->entries)) == 0) {
+            frame->refs++;
+            return frame;
+        }
+    }
+
+    SnapFrame *frame = malloc(sizeof(SnapFrame));
+    if (frame == NULL) {
+        return NULL;
+    }
+
+    TableClass cls;
+    classify_table(entries, 512, EnumLevels64[level].rule, &cls);
+
+    frame->hash = hash;
+    frame->refs = 1;
+    frame->level = level;
+    memcpy(frame->valid, cls.valid, sizeof(frame->valid));
+    memcpy(frame->large, cls.large, sizeof(frame->large));
+    memcpy(frame->entries, entries, sizeof(frame->entries));
+    frame->next = *bucket;
+    *bucket = frame;
+    store->frames++;
+
+    return frame;
+}
+
+// Function returns a referenced subtree with a given frame and children, consuming the references passed in
+static SnapTable* snap_table_get(SnapStore *store, SnapFrame *frame, SnapTable **children) {
+    uint64_t hash = frame->hash;
+    for (unsigned int i = 0; children != NULL && i < 512; i++) {
+        hash = children[i] != NULL ? snap_mix(hash ^ i, children[i]->hash) : hash;
+    }
+
+    if (snap_grow((void***) &store->table_buckets, &store->table_mask, store->tables, offsetof(SnapTable, next))) {
+        for (SnapTable *table = store->table_buckets[hash & store->table_mask]; table != NULL; table = table->next) {
+            if (table->hash == hash && table->frame == frame && 
+                (children == NULL || memcmp(table->children, children, 512 * sizeof(SnapTable*)) == 0)) {
+                // Subtree is unchanged, the references to its parts are already held by the stored one
+                for (unsigned int i = 0; children != NULL && i < 512; i++) {
+                    snap_release(store, children[i]);
+                }
+
+                snap_frame_release(store, frame);
+                table->refs++;
+                store->reused++;
+                return table;
+            }
+        }
+    }
+
+    SnapTable *table = calloc(1, sizeof(SnapTable));
+    if (table == NULL || store->table_buckets == NULL || 
+        (children != NULL && (table->children = malloc(512 * sizeof(SnapTable*))) == NULL)) {
+        free(table);
+        return NULL;
+    }
+
+    if (children != NULL) {
+        memcpy(table->children, children, 512 * sizeof(SnapTable*));
+    }
+
+    SnapTable **bucket = &store->table_buckets[hash & store->table_mask];
+    table->hash = hash;
+    table->refs = 1;
+    table->frame = frame;
+    table->next = *bucket;
+    *bucket = table;
+    store->tables++;
+
+    return table;
+}
+
+// Struct holds the state of a snapshot walk
+typedef struct {
+    SnapStore *store;
+    PREAD_FUNC_64 read_func_64;
+    TranslationState32 state;
+    int failed; // memory could not be allocated
+} SnapWalk;
+
+// Function reads a paging structure and everything below it into the store, returns the referenced subtree or NULL
+static SnapTable* snap_walk_table(SnapWalk *walk, const uint8_t level, const uint64_t table_addr) {
+    uint64_t entries[512];
+    unsigned int count = (*walk->read_func_64)(entries, sizeof(entries), table_addr) / sizeof(uint64_t);
+
+    if (count < 512) { // entries that could not be read are treated as not present
+        walk->state = ST_RAM_READ_ERROR_32;
+        REPORT_READ_ERROR(NULL, table_addr + count * sizeof(uint64_t), sizeof(entries) - count * sizeof(uint64_t));
+        memset(entries + count, 0, sizeof(entries) - count * sizeof(uint64_t));
+    }
+
+    SnapFrame *frame = snap_frame_get(walk->store, level, entries);
+    if (frame == NULL) {
+        walk->failed = 1;
+        return NULL;
+    }
+
+    if (EnumLevels64[level].leaf_bit == 1) {
+        SnapTable *table = snap_table_get(walk->store, frame, NULL);
+
+        if (table == NULL) {
+            snap_frame_release(walk->store, frame);
+            walk->failed = 1;
+        }
+
+        return table;
+    }
+
+    SnapTable *children[512] = { NULL };
+
+    for (unsigned int i = 0; i < 512 && !walk->failed; i++) {
+        uint64_t bit = 1ULL << (i & 63);
+
+        if ((frame->valid[i >> 6] & bit) && !(frame->large[i >> 6] & bit)) {
+            children[i] = snap_walk_table(walk, level + 1, entries[i] & EnumLevels64[level].rule->next_mask);
+        }
+    }
+
+    SnapTable *table = walk->failed ? NULL : snap_table_get(walk->store, frame, children);
+
+    if (table == NULL) {
+        for (unsigned int i = 0; i < 512; i++) {
+            snap_release(walk->store, children[i]);
+        }
+
+        snap_frame_release(walk->store, frame);
+        walk->failed = 1;
+    }
+
+    return table;
+}
+
+/**
+ * @name snap_walk_64
+ * @param store
+ *  Store created by snapstore_create(), every snapshot walked with the same store shares unchanged paging structures
+ * @param root_addr_64
+ *  Page directory root address, same as for va2pa_64
+ * @param read_func_64
+ *  Function that reads the physical memory of the snapshot
+ * @param state
+ *  Output buffer, ST_SUCCESS_32 or ST_RAM_READ_ERROR_32 if any of the tables could not be read. May be NULL
+ * @returns SnapTable*
+ *  Returns the snapshot of the address space or NULL if memory could not be allocated, release it with snap_release()
+ * @description:
+ *  Function reads every paging structure reachable from a root and stores the address space by content: a paging
+ *  structure whose entries and subtrees are the same as in a snapshot already held by the store is not stored again.
+ *  The tables still have to be read to find out whether they changed, but only the changed ones are classified and
+ *  stored, and snap_diff() between two snapshots skips everything they share
+ */
+SnapTable* snap_walk_64(SnapStore *store, const uint64_t root_addr_64, const PREAD_FUNC_64 read_func_64, uint8_t *state) {
+    SnapWalk walk = { store, read_func_64, ST_SUCCESS_32, 0 };
+    SnapTable *root = snap_walk_table(&walk, 0, pml4e_addr_64(root_addr_64, 0));
+
+    if (state != NULL) {
+        *state = walk.state;
+    }
+
+    return root;
+}
+
+// Struct holds the state of a diff between two snapshots
+typedef struct {
+    SNAP_DIFF_FUNC callback;
+    void *ctx;
+    size_t changes;
+    int stopped;
+} SnapDiff;
+
+// Function reports a changed page, either side may be missing
+static void snap_diff_page(SnapDiff *diff, const uint64_t virt_addr, const uint8_t page_shift,
+    const SnapFrame *old_frame, const SnapFrame *new_frame, const unsigned int i) {
+    PhysExtent old_page = { virt_addr, 0, 1ULL << page_shift, page_shift }, new_page = old_page;
+    uint64_t mask = EnumLevels64[(old_frame != NULL ? old_frame : new_frame)->level].rule->next_mask & ~((1ULL << page_shift) - 1);
+
+    old_page.phys_addr = old_frame != NULL ? old_frame->entries[i] & mask : 0;
+    new_page.phys_addr = new_frame != NULL ? new_frame->entries[i] & mask : 0;
+
+    diff->changes++;
+    diff->stopped = (*diff->callback)(old_frame != NULL ? &old_page : NULL, old_frame != NULL ? old_frame->entries[i] : 0,
+        new_frame != NULL ? &new_page : NULL, new_frame != NULL ? new_frame->entries[i] : 0, diff->ctx) != 0;
+}
+
+// Function compares two subtrees of the same level, either one may be NULL
+static void snap_diff_table(SnapDiff *diff, const SnapTable *old_table, const SnapTable *new_table, const uint64_t virt_base) {
+    if (old_table == new_table) { // shared subtree, nothing changed below it
+        return;
+    }
+
+    const SnapFrame *old_frame = old_table != NULL ? old_table->frame : NULL;
+    const SnapFrame *new_frame = new_table != NULL ? new_table->frame : NULL;
+    const EnumLevel *level = &EnumLevels64[(old_frame != NULL ? old_frame : new_frame)->level];
+
+    for (unsigned int i = 0; i < 512 && !diff->stopped; i++) {
+        uint64_t bit = 1ULL << (i & 63);
+        int old_valid = old_frame != NULL && (old_frame->valid[i >> 6] & bit);
+        int new_valid = new_frame != NULL && (new_frame->valid[i >> 6] & bit);
+        int old_leaf = old_valid && (level->leaf_bit == 1 || (old_frame->large[i >> 6] & bit));
+        int new_leaf = new_valid && (level->leaf_bit == 1 || (new_frame->large[i >> 6] & bit));
+        uint64_t virt_addr = virt_base + ((uint64_t) i << level->shift);
+
+        if (!old_valid && !new_valid) {
+            continue;
+        }
+
+        if (level->shift == 39 && (virt_addr & (1ULL << 47))) { // Sign extending upper half long mode addresses
+            virt_addr |= 0xFFFF000000000000;
+        }
+
+        if (old_leaf && new_leaf) {
+            if (old_frame->entries[i] != new_frame->entries[i]) {
+                snap_diff_page(diff, virt_addr, level->shift, old_frame, new_frame, i);
+            }
+
+            continue;
+        }
+
+        // Subtrees are compared as a whole, a page that replaced a table (or the other way around) is a removal and an addition
+        const SnapTable *old_child = old_valid && !old_leaf ? old_table->children[i] : NULL;
+        const SnapTable *new_child = new_valid && !new_leaf ? new_table->children[i] : NULL;
+
+        if (old_leaf) {
+            snap_diff_page(diff, virt_addr, level->shift, old_frame, NULL, i);
+        }
+
+        if (old_child != NULL || new_child != NULL) {
+            snap_diff_table(diff, old_child, new_child, virt_addr);
+        }
+
+        if (new_leaf && !diff->stopped) {
+            snap_diff_page(diff, virt_addr, level->shift, NULL, new_frame, i);
+        }
+    }
+}
+
+/**
+ * @name snap_diff
+ * @param old_snapshot
+ *  Snapshot returned by snap_walk_64() or NULL for an empty address space
+ * @param new_snapshot
+ *  Snapshot returned by snap_walk_64() with the same store or NULL for an empty address space
+ * @param callback
+ *  Function that is called for every added, removed or changed page in ascending virtual address order
+ * @param ctx
+ *  Pointer passed to the callback
+ * @returns size_t
+ *  Returns the amount of changes passed to the callback
+ * @description:
+ *  Function compares two snapshots without reading memory. Subtrees shared by both snapshots are skipped
+ *  as a whole, so the cost is proportional to what changed rather than to the size of the address space.
+ *  A page is changed if its leaf entry differs (physical address or any of the flags)
+ */
+size_t snap_diff(const SnapTable *old_snapshot, const SnapTable *new_snapshot, const SNAP_DIFF_FUNC callback, void *ctx) {
+    SnapDiff diff = { callback, ctx, 0, 0 };
+    snap_diff_table(&diff, old_snapshot, new_snapshot, 0);
+    return diff.changes;
+}
+
+// Function passes an added page to an ENUM_FUNC, it is the SNAP_DIFF_FUNC of snap_enumerate()
+static int snap_enum_page(const PhysExtent *old_page, const uint64_t old_entry, const PhysExtent *new_page, const uint64_t new_entry, void *ctx) {
+    EnumWalk *walk = ctx;
+    (void) old_page, (void) old_entry;
+    return (*walk->callback)(new_page, new_entry, walk->ctx);
+}
+
+/**
+ * @name snap_enumerate
+ * @description:
+ *  Same as va2pa_64_enumerate, but the pages are enumerated from a snapshot without reading memory
+ */
+void snap_enumerate(const SnapTable *snapshot, const ENUM_FUNC callback, void *ctx) {
+    EnumWalk walk = { NULL, NULL, callback, ctx, ST_SUCCESS_32, 0, NULL };
+    snap_diff(NULL, snapshot, snap_enum_page, &walk);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                              TABLE PAGE CACHE                              */
+/* -------------------------------------------------------------------------- */
+
+#define FRAME_SIZE 4096 // Size of a physical frame held by the frame cache
+#define FCACHE_NONE UINT32_MAX // Empty link of the frame cache lists
+
+// Struct represents a physical frame held by the frame cache
+typedef struct {
+    uint64_t frame; // physical address of the frame
+    unsigned int valid_bytes; // amount of bytes from the beginning of the frame the backend could read
+    uint32_t hash_next; // next frame in the same hash bucket
+    uint32_t lru_prev, lru_next; // neighbours in the LRU list, most recently used first
+} FrameCacheEntry;
+
+// Struct represents a cache of whole physical frames in front of a PREAD_FUNC or PREAD_FUNC_64 backend
+typedef struct {
+    PREAD_FUNC read_func; // backend for 32-bit physical addresses (NULL if read_func_64 is used)
+    PREAD_FUNC_64 read_func_64; // backend for 64-bit physical addresses (NULL if read_func is used)
+    FrameCacheEntry *entries;
+    uint8_t *data; // capacity * FRAME_SIZE bytes, frame data of entries[i] is at data + i * FRAME_SIZE
+    uint32_t *buckets; // hash buckets, power of two amount
+    uint32_t bucket_mask;
+    uint32_t capacity, used;
+    uint32_t lru_head, lru_tail;
+    uint64_t hits, misses, evictions;
+} FrameCache;
+
+// Frame cache used by fcache_read_func() and fcache_read_func_64() in the calling thread
+static _Thread_local FrameCache *fcache_bound = NULL;
+
+// Function frees a cache created by fcache_create()
+void fcache_destroy(FrameCache *fc) {
+    if (fc == NULL) {
+        return;
+    }
+
+    if (fcache_bound == fc) {
+        fcache_bound = NULL;
+    }
+
+    free(fc->entries);
+    free(fc->data);
+    free(fc->buckets);
+    free(fc);
+}
+
+// Function drops every cached frame, e.g. after the backend switched to a new memory snapshot
+void fcache_flush(FrameCache *fc) {
+    for (uint32_t i = 0; i <= fc->bucket_mask; i++) {
+        fc->buckets[i] = FCACHE_NONE;
+    }
+
+    fc->used = 0;
+    fc->lru_head = fc->lru_tail = FCACHE_NONE;
+}
+
+/**
+ * @name fcache_create
+ * @param budget
+ *  Amount of memory in bytes the cached frames may take (at least one frame is always cached)
+ * @param read_func
+ *  32-bit backend the frames are read with or NULL
+ * @param read_func_64
+ *  64-bit backend the frames are read with or NULL, exactly one of the backends has to be given
+ * @returns FrameCache*
+ *  Returns a new empty cache or NULL if memory could not be allocated
+ * @description:
+ *  Function creates a frame cache. Reads through the cache fetch the whole 4 KiB frame around the requested
+ *  address from the backend on the first touch and serve later reads of the same frame from memory. The least
+ *  recently used frame is evicted when the budget is exhausted
+ */
+FrameCache* fcache_create(size_t budget, const PREAD_FUNC read_func, const PREAD_FUNC_64 read_func_64) {
+    if ((read_func == NULL) == (read_func_64 == NULL)) {
+        return NULL;
+    }
+
+    FrameCache *fc = calloc(1, sizeof(FrameCache));
+    if (fc == NULL) {
+        return NULL;
+    }
+
+    size_t capacity = budget / FRAME_SIZE;
+    fc->capacity = capacity == 0 ? 1 : capacity >= FCACHE_NONE ? FCACHE_NONE - 1 : (uint32_t) capacity;
+
+    uint32_t buckets = 1;
+    while (buckets < fc->capacity * 2 && buckets < (1U << 31)) {
+        buckets <<= 1;
+    }
+
+    fc->read_func = read_func;
+    fc->read_func_64 = read_func_64;
+    fc->bucket_mask = buckets - 1;
+    fc->entries = malloc((size_t) fc->capacity * sizeof(FrameCacheEntry));
+    fc->data = malloc((size_t) fc->capacity * FRAME_SIZE);
+    fc->buckets = malloc((size_t) buckets * sizeof(uint32_t));
+
+    if (fc->entries == NULL || fc->data == NULL || fc->buckets == NULL) {
+        fcache_destroy(fc);
+        return NULL;
+    }
+
+    fcache_flush(fc);
+    return fc;
+}
+
+static inline uint32_t fcache_bucket(const FrameCache *fc, const uint64_t frame) {
+    return (uint32_t)(((frame >> 12) * 0x9E3779B97F4A7C15ULL) >> 32) & fc->bucket_mask;
+}
+
+// Function removes an entry from the LRU list
+static void fcache_lru_unlink(FrameCache *fc, const uint32_t index) {
+    FrameCacheEntry *entry = &fc->entries[index];
+
+    if (entry->lru_prev != FCACHE_NONE) {
+        fc->entries[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        fc->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next != FCACHE_NONE) {
+        fc->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        fc->lru_tail = entry->lru_prev;
+    }
+}
+
+// Function puts an entry to the front of the LRU list
+static void fcache_lru_push(FrameCache *fc, const uint32_t index) {
+    FrameCacheEntry *entry = &fc->entries[index];
+
+    entry->lru_prev = FCACHE_NONE;
+    entry->lru_next = fc->lru_head;
+
+    if (fc->lru_head != FCACHE_NONE) {
+        fc->entries[fc->lru_head].lru_prev = index;
+    } else {
+        fc->lru_tail = index;
+    }
+
+    fc->lru_head = index;
+}
+
+// Function removes the least recently used entry from its hash bucket and returns its index for reuse
+static uint32_t fcache_evict(FrameCache *fc) {
+    uint32_t index = fc->lru_tail;
+    uint32_t *link = &fc->buckets[fcache_bucket(fc, fc->entries[index].frame)];
+
+    while (*link != index) {
+        link = &fc->entries[*link].hash_next;
+    }
+
+    *link = fc->entries[index].hash_next;
+    fcache_lru_unlink(fc, index);
+    fc->evictions++;
+    return index;
+}
+
+// Function returns the cache entry holding a given frame, reading the frame from the backend on a miss
+static FrameCacheEntry* fcache_frame(FrameCache *fc, const uint64_t frame) {
+    uint32_t bucket = fcache_bucket(fc, frame);
+
+    for (uint32_t index = fc->buckets[bucket]; index != FCACHE_NONE; index = fc->entries[index].hash_next) {
+        if (fc->entries[index].frame == frame) {
+            if (fc->lru_head != index) {
+                fcache_lru_unlink(fc, index);
+                fcache_lru_push(fc, index);
+            }
+
+            fc->hits++;
+            STATS_ADD(hits[STATS_FCACHE], 1);
+            return &fc->entries[index];
+        }
+    }
+
+    fc->misses++;
+    STATS_ADD(misses[STATS_FCACHE], 1);
+
+    uint32_t index = fc->used < fc->capacity ? fc->used++ : fcache_evict(fc);
+    FrameCacheEntry *entry = &fc->entries[index];
+    uint8_t *data = fc->data + (size_t) index * FRAME_SIZE;
+
+    entry->frame = frame;
+    entry->valid_bytes = fc->read_func_64 != NULL ? 
+        (*fc->read_func_64)(data, FRAME_SIZE, frame) : (*fc->read_func)(data, FRAME_SIZE, (unsigned int) frame);
+
+    if (entry->valid_bytes > FRAME_SIZE) {
+        entry->valid_bytes = FRAME_SIZE;
+    }
+
+    entry->hash_next = fc->buckets[bucket];
+    fc->buckets[bucket] = index;
+    fcache_lru_push(fc, index);
+    return entry;
+}
+
+/**
+ * @name fcache_read
+ * @description:
+ *  Same as PREAD_FUNC_64, but reads through a given frame cache. Reads may span several frames,
+ *  the amount of bytes returned stops at the first byte the backend could not read
+ */
+unsigned int fcache_read(FrameCache *fc, void *buf, const unsigned int size, const uint64_t physical_addr) {
+    unsigned int done = 0;
+
+    while (done < size) {
+        uint64_t addr = physical_addr + done;
+        unsigned int offset = (unsigned int)(addr & (FRAME_SIZE - 1));
+        FrameCacheEntry *entry = fcache_frame(fc, addr - offset);
+        unsigned int chunk = FRAME_SIZE - offset < size - done ? FRAME_SIZE - offset : size - done;
+
+        if (offset >= entry->valid_bytes) {
+            break;
+        }
+
+        if (offset + chunk > entry->valid_bytes) {
+            chunk = entry->valid_bytes - offset;
+        }
+
+        memcpy((uint8_t*) buf + done, fc->data + (size_t)(entry - fc->entries) * FRAME_SIZE + offset, chunk);
+        done += chunk;
+
+        if (offset + chunk < FRAME_SIZE) { // backend could not read the rest of the frame
+            break;
+        }
+    }
+
+    return done;
+}
+
+// Function makes fcache_read_func() and fcache_read_func_64() read through a given cache in the calling thread
+void fcache_bind(FrameCache *fc) {
+    fcache_bound = fc;
+}
+
+/**
+ * @name fcache_read_func
+ * @description:
+ *  PREAD_FUNC that reads through the frame cache bound to the calling thread with fcache_bind(),
+ *  so the cache can be passed to va2pa() and the other functions that take a PREAD_FUNC as is
+ */
+unsigned int fcache_read_func(void *buf, const unsigned int size, const unsigned int physical_addr) {
+    return fcache_bound != NULL ? fcache_read(fcache_bound, buf, size, physical_addr) : 0;
+}
+
+/**
+ * @name fcache_read_func_64
+ * @description:
+ *  Same as fcache_read_func, only a PREAD_FUNC_64 for va2pa_64() and the other 64-bit functions
+ */
+unsigned int fcache_read_func_64(void *buf, const unsigned int size, const uint64_t physical_addr) {
+    return fcache_bound != NULL ? fcache_read(fcache_bound, buf, size, physical_addr) : 0;
+}
+
+#ifdef VA2PA_BENCH
+/* -------------------------------------------------------------------------- */
+/*                               BENCHMARK SUITE                              */
+/* -------------------------------------------------------------------------- */
+
+// Build: cc -O2 -DVA2PA_BENCH va2pa_v2.c -o va2pa_bench -pthread -lm (the Zipfian address streams need libm)
+
+#define BENCH_DEFAULT_PAGES 16384 // Pages mapped by every layout
+#define BENCH_DEFAULT_TRANSLATIONS (1 << 20) // Translations per measurement
+#define BENCH_DEFAULT_REPEAT 3 // Measurements per run, the fastest one is reported
+#define BENCH_DEFAULT_ZIPF 0.99 // Skew of the Zipfian pattern
+#define BENCH_BATCH 256 // Addresses per va2pa_64_batch() call
+
+// Struct describes how the benchmark builds the paging structures of a paging mode
+typedef struct {
+    const char *name;
+    uint8_t level; // level argument of va2pa(), 4 for the va2pa_64() family
+    uint8_t entry_size;
+    uint8_t virt_bits; // mapped virtual addresses are below 1 << virt_bits
+    uint8_t phys_bits; // mapped physical addresses are below 1 << phys_bits
+    uint8_t shifts[4];
+    uint64_t table_flags[4]; // flags of an entry referencing the next structure
+    uint64_t page_flags[4]; // flags of an entry mapping a page, 0 if the benchmark maps no pages at the level
+} BenchMode;
+
+static const BenchMode BenchModes[] = {
+    { "legacy", 2, sizeof(uint32_t), 32, 32, { 22, 12 }, { 0x7 }, { 0, 0x47 } },
+    { "pae", 3, sizeof(uint64_t), 32, 36, { 30, 21, 12 }, { 0x1, 0x7 }, { 0, 0x10C7, 0xC7 } },
+    { "long", 4, sizeof(uint64_t), 47, 46, { 39, 30, 21, 12 }, { 0x7, 0x7, 0x7 }, { 0, 0xC7, 0xC7, 0xC7 } }
+};
+
+// Address space layouts: consecutive 4 KiB pages, 4 KiB pages scattered over the whole address space
+// and large pages only (2 MiB, a quarter of them 1 GiB in long mode). Legacy mode has no huge layout
+typedef enum { LAYOUT_DENSE, LAYOUT_SPARSE, LAYOUT_HUGE, BENCH_LAYOUTS } BenchLayout;
+static const char *BenchLayoutNames[] = { "dense", "sparse", "huge" };
+
+// Access patterns: mapped pages in address order, uniformly at random and Zipf distributed over a random
+// ranking of the pages. The classify pattern times the classification kernels on every table of the layout
+typedef enum { PATTERN_SEQUENTIAL, PATTERN_UNIFORM, PATTERN_ZIPF, PATTERN_CLASSIFY, BENCH_PATTERNS } BenchPattern;
+static const char *BenchPatternNames[] = { "sequential", "uniform", "zipf", "classify" };
+
+// Translation backends, batch and interleaved are only available in long mode
+typedef enum {
+    BACKEND_CALLBACK, BACKEND_IMAGE, BACKEND_SPECIALIZED, BACKEND_CACHED, BACKEND_SHARED, BACKEND_BATCH, BACKEND_INTERLEAVED,
+    BACKEND_FLAT, BENCH_BACKENDS
+} BenchBackend;
+static const char *BenchBackendNames[] = { "callback", "image", "specialized", "cached", "shared", "batch", "interleaved", "flat" };
+
+typedef enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } BenchFormat;
+
+// Struct represents a page mapped by the benchmark
+typedef struct {
+    uint64_t virt_addr;
+    uint8_t shift;
+} BenchPage;
+
+// Struct represents the paging structures of one layout
+typedef struct {
+    const BenchMode *mode;
+    uint64_t root;
+    uint64_t next_frame;
+    BenchPage *pages; // sorted by virtual address
+    size_t count;
+} BenchSpace;
+
+// Struct represents the outcome of one run
+typedef struct {
+    double ns; // per operation, fastest measurement
+    double reads; // backend reads per operation, negative if the backend does not count them
+    size_t failures;
+    uint64_t checksum;
+} BenchResult;
+
+// Struct holds the command line of the benchmark
+typedef struct {
+    const char *modes, *layouts, *patterns, *backends; // comma separated names, NULL selects all
+    size_t pages;
+    size_t translations;
+    unsigned int repeat;
+    double zipf;
+    unsigned int group; // walks va2pa_64_image_batch() interleaves
+    uint64_t seed;
+    BenchFormat format;
+} BenchOptions;
+
+// Struct holds what the backends of a measurement translate with besides the read functions
+typedef struct {
+    const MemImage *image;
+    TranslationCache *tc;
+    SharedCache *sc;
+    const FlatMap *flat; // built once per layout, NULL if the flat backend is not selected
+    unsigned int group; // walks va2pa_64_image_batch() interleaves
+} BenchTargets;
+
+static uint8_t *bench_memory;
+static uint64_t bench_memory_size;
+static uint64_t bench_reads;
+static uint64_t bench_state;
+
+// PREAD_FUNC and PREAD_FUNC_64 of the benchmark, both read from memory allocated by the benchmark and count the reads
+unsigned int bench_read_func_64(void *buf, const unsigned int size, const uint64_t physical_addr) {
+    if (physical_addr > bench_memory_size - size) {
+        return 0;
+    }
+
+    bench_reads++;
+    memcpy(buf, bench_memory + physical_addr, size);
+    return size;
+}
+
+unsigned int bench_read_func(void *buf, const unsigned int size, const unsigned int physical_addr) {
+    return bench_read_func_64(buf, size, physical_addr);
+}
+
+// va2pa() and va2pa_64() with the benchmark backend inlined into the walks
+static VA2PA_SPECIALIZE(bench_va2pa, bench_read_func)
+static VA2PA_64_SPECIALIZE(bench_va2pa_64, bench_read_func_64)
+
+// xorshift64*, the same seed builds the same tables and address sequences on every platform
+static uint64_t bench_random(void) {
+    bench_state ^= bench_state >> 12;
+    bench_state ^= bench_state << 25;
+    bench_state ^= bench_state >> 27;
+    return bench_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Function returns 1 if a name is one of the comma separated names of a list or if there is no list
+static uint8_t bench_selected(const char *list, const char *name) {
+    size_t length = strlen(name);
+
+    if (list == NULL) {
+        return 1;
+    }
+
+    for (;;) {
+        const char *end = strchr(list, ',');
+        size_t token = end != NULL ? (size_t)(end - list) : strlen(list);
+
+        if (token == length && memcmp(list, name, length) == 0) {
+            return 1;
+        } else if (end == NULL) {
+            return 0;
+        }
+
+        list = end + 1;
+    }
+}
+
+static int bench_page_cmp(const void *a, const void *b) {
+    uint64_t x = ((const BenchPage*) a)->virt_addr, y = ((const BenchPage*) b)->virt_addr;
+    return (x > y) - (x < y);
+}
+
+// Function maps a page whose entry is at a given level of the paging structures, allocating missing structures
+static void bench_map(BenchSpace *space, const unsigned int leaf, const uint64_t virt_addr, const uint64_t phys_addr) {
+    const BenchMode *mode = space->mode;
+    uint64_t table = space->root;
+
+    for (unsigned int i = 0; i <= leaf; i++) {
+        uint64_t index = (virt_addr >> mode->shifts[i]) & (mode->entry_size == sizeof(uint32_t) ? 0x3FF : 0x1FF);
+        uint8_t *slot = bench_memory + table + index * mode->entry_size;
+        uint64_t entry = 0;
+        memcpy(&entry, slot, mode->entry_size);
+
+        if (i == leaf) {
+            entry = (phys_addr & ~((1ULL << mode->shifts[i]) - 1)) | mode->page_flags[i];
+        } else if (entry == 0) {
+            entry = space->next_frame | mode->table_flags[i];
+            space->next_frame += 0x1000;
+        }
+
+        memcpy(slot, &entry, mode->entry_size);
+        table = entry & 0xFFFFFFFFFF000;
+    }
+}
+
+static void bench_space_free(BenchSpace *space) {
+    free(space->pages);
+    free(bench_memory);
+    bench_memory = NULL;
+    space->pages = NULL;
+}
+
+// Function returns 1 if a layout of a given amount of pages can be built in a paging mode
+static uint8_t bench_space_available(const BenchMode *mode, const BenchLayout layout, const size_t pages) {
+    if (layout == LAYOUT_HUGE) {
+        return mode->page_flags[mode->level - 2] != 0;
+    } else if (layout == LAYOUT_DENSE) {
+        return pages <= (1ULL << (mode->virt_bits - 14)); // dense pages start at a quarter of the address space
+    }
+
+    return 1;
+}
+
+/**
+ * @name bench_space_build
+ * @description:
+ *  Function builds the paging structures of a layout in freshly allocated benchmark memory. Virtual addresses
+ *  of the sparse and huge layouts are drawn with replacement, a drawn address that is already mapped is remapped.
+ *  Physical addresses of the pages are random, only the paging structures are backed by memory.
+ *  Returns 0 if there is not enough memory
+ */
+static uint8_t bench_space_build(BenchSpace *space, const BenchMode *mode, const BenchLayout layout, const size_t pages) {
+    unsigned int levels = mode->level;
+    uint64_t virt_mask = (1ULL << mode->virt_bits) - 1, phys_mask = (1ULL << mode->phys_bits) - 1;
+
+    // Every mapping allocates at most one structure below the root per level
+    bench_memory_size = ((uint64_t) pages * (levels - 1) + 2) * 0x1000;
+    bench_memory = calloc(1, bench_memory_size);
+    space->pages = malloc(pages * sizeof(BenchPage));
+    if (bench_memory == NULL || space->pages == NULL) {
+        bench_space_free(space);
+        return 0;
+    }
+
+    space->mode = mode;
+    space->root = 0x1000;
+    space->next_frame = 0x2000;
+    space->count = pages;
+
+    for (size_t i = 0; i < pages; i++) {
+        uint64_t virt_addr, phys_addr = bench_random() & phys_mask;
+        unsigned int leaf = levels - 1;
+
+        if (layout == LAYOUT_DENSE) {
+            virt_addr = ((virt_mask + 1) >> 2) + i * 0x1000;
+        } else if (layout == LAYOUT_SPARSE) {
+            virt_addr = bench_random() & virt_mask;
+        } else if (levels == 4 && i % 4 == 0) {
+            leaf = 1; // 1 GiB pages in the upper half keep clear of the page directories of the 2 MiB pages
+            virt_addr = (bench_random() & (virt_mask >> 1)) | ((virt_mask + 1) >> 1);
+        } else {
+            leaf = levels - 2;
+            virt_addr = bench_random() & (levels == 4 ? virt_mask >> 1 : virt_mask);
+        }
+
+        space->pages[i].shift = mode->shifts[leaf];
+        space->pages[i].virt_addr = virt_addr & ~((1ULL << mode->shifts[leaf]) - 1);
+        bench_map(space, leaf, space->pages[i].virt_addr, phys_addr);
+    }
+
+    qsort(space->pages, pages, sizeof(BenchPage), bench_page_cmp);
+    return 1;
+}
+
+/**
+ * @name bench_sequence
+ * @description:
+ *  Function fills an array with the virtual addresses a run translates, each one is a random address inside
+ *  of a page picked by the pattern. Returns 0 if there is not enough memory for the Zipfian distribution
+ */
+static uint8_t bench_sequence(
+    const BenchSpace *space, const BenchPattern pattern, const double zipf, uint64_t *virt_addrs, const size_t n
+) {
+    double *cdf = NULL;
+    size_t *ranks = NULL;
+
+    if (pattern == PATTERN_ZIPF) {
+        cdf = malloc(space->count * sizeof(double));
+        ranks = malloc(space->count * sizeof(size_t));
+        if (cdf == NULL || ranks == NULL) {
+            free(cdf);
+            free(ranks);
+            return 0;
+        }
+
+        double sum = 0;
+        for (size_t rank = 0; rank < space->count; rank++) {
+            sum += 1.0 / pow(rank + 1, zipf);
+            cdf[rank] = sum;
+            ranks[rank] = rank;
+        }
+
+        for (size_t rank = space->count - 1; rank > 0; rank--) {
+            size_t other = bench_random() % (rank + 1), page = ranks[rank];
+            ranks[rank] = ranks[other];
+            ranks[other] = page;
+        }
+
+        for (size_t rank = 0; rank < space->count; rank++) {
+            cdf[rank] /= sum;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        size_t page = i % space->count;
+
+        if (pattern == PATTERN_UNIFORM) {
+            page = bench_random() % space->count;
+        } else if (pattern == PATTERN_ZIPF) {
+            double u = (bench_random() >> 11) * 0x1.0p-53;
+            size_t low = 0, high = space->count - 1;
+
+            while (low < high) {
+                size_t mid = (low + high) / 2;
+                if (cdf[mid] < u) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+
+            page = ranks[low];
+        }
+
+        virt_addrs[i] = space->pages[page].virt_addr | (bench_random() & ((1ULL << space->pages[page].shift) - 1));
+    }
+
+    free(cdf);
+    free(ranks);
+    return 1;
+}
+
+// Every loop counts the failed translations and sums the successful ones, which keeps them from being optimized out
+#define BENCH_LOOP(translate) do { \
+        for (size_t i = 0; i < n; i++) { \
+            if ((translate) == ST_SUCCESS_32) { \
+                checksum += phys_addr; \
+            } else { \
+                failures++; \
+            } \
+        } \
+    } while (0)
+
+// Function translates every address of a sequence once with a given backend and returns the elapsed nanoseconds
+static double bench_pass(
+    const BenchSpace *space, const BenchBackend backend, const BenchTargets *targets,
+    const uint64_t *virt_addrs, const size_t n, BenchResult *result
+) {
+    static uint64_t batch_phys[BENCH_BATCH];
+    static TranslationState32 batch_states[BENCH_BATCH];
+    uint64_t checksum = 0, phys_addr = 0, root = space->root;
+    unsigned int level = space->mode->level;
+    size_t failures = 0;
+    double start = bench_now();
+
+    switch (backend) {
+        case BACKEND_CALLBACK:
+            if (level == 4) {
+                BENCH_LOOP(va2pa_64(virt_addrs[i], root, bench_read_func_64, &phys_addr));
+            } else {
+                BENCH_LOOP(va2pa(virt_addrs[i], level, root, bench_read_func, &phys_addr));
+            }
+            break;
+        case BACKEND_IMAGE:
+            if (level == 4) {
+                BENCH_LOOP(va2pa_64_image(targets->image, virt_addrs[i], root, &phys_addr));
+            } else {
+                BENCH_LOOP(va2pa_image(targets->image, virt_addrs[i], level, root, &phys_addr));
+            }
+            break;
+        case BACKEND_SPECIALIZED:
+            if (level == 4) {
+                BENCH_LOOP(bench_va2pa_64(virt_addrs[i], root, &phys_addr));
+            } else {
+                BENCH_LOOP(bench_va2pa(virt_addrs[i], level, root, &phys_addr));
+            }
+            break;
+        case BACKEND_CACHED:
+            if (level == 4) {
+                BENCH_LOOP(va2pa_64_cached(targets->tc, virt_addrs[i], root, bench_read_func_64, &phys_addr));
+            } else {
+                BENCH_LOOP(va2pa_cached(targets->tc, virt_addrs[i], level, root, bench_read_func, &phys_addr));
+            }
+            break;
+        case BACKEND_SHARED:
+            if (level == 4) {
+                BENCH_LOOP(va2pa_64_shared(targets->sc, virt_addrs[i], root, bench_read_func_64, &phys_addr));
+            } else {
+                BENCH_LOOP(va2pa_shared(targets->sc, virt_addrs[i], level, root, bench_read_func, &phys_addr));
+            }
+            break;
+        case BACKEND_BATCH:
+        case BACKEND_INTERLEAVED:
+            for (size_t i = 0; i < n; i += BENCH_BATCH) {
+                size_t count = n - i < BENCH_BATCH ? n - i : BENCH_BATCH;
+
+                if (backend == BACKEND_BATCH) {
+                    va2pa_64_batch(virt_addrs + i, count, root, bench_read_func_64, batch_phys, batch_states);
+                } else {
+                    va2pa_64_image_batch(targets->image, virt_addrs + i, count, root, targets->group, batch_phys, batch_states);
+                }
+
+                for (size_t j = 0; j < count; j++) {
+                    if (batch_states[j] == ST_SUCCESS_32) {
+                        checksum += batch_phys[j];
+                    } else {
+                        failures++;
+                    }
+                }
+            }
+            break;
+        case BACKEND_FLAT:
+            for (size_t i = 0; i < n; i++) {
+                if (fmap_translate(targets->flat, virt_addrs[i], &phys_addr)) {
+                    checksum += phys_addr;
+                } else {
+                    failures++;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    double elapsed = bench_now() - start;
+    result->checksum = checksum;
+    result->failures = failures;
+    return elapsed;
+}
+
+// Function classifies every paging structure of a layout once as a long mode page directory, returns nanoseconds
+static double bench_classify_pass(const BenchSpace *space, const CLASSIFY_FUNC kernel, BenchResult *result) {
+    TableClass cls;
+    uint64_t checksum = 0;
+    double start = bench_now();
+
+    for (uint64_t frame = space->root; frame < space->next_frame; frame += 0x1000) {
+        memset(&cls, 0, offsetof(TableClass, next));
+        (*kernel)((const uint64_t*)(bench_memory + frame), 512, &ClassRules64[2], &cls);
+        checksum += cls.valid[0] ^ cls.large[7] ^ cls.next[511];
+    }
+
+    double elapsed = bench_now() - start;
+    result->checksum = checksum;
+    result->failures = 0;
+    return elapsed;
+}
+
+static void bench_report(
+    const BenchOptions *opts, const BenchSpace *space, const char *layout, const char *pattern, const char *backend,
+    const char *op, const size_t ops, const BenchResult *result
+) {
+    static uint8_t header;
+    double mops = 1e3 / result->ns;
+    char reads[32] = "";
+
+    if (result->reads >= 0) {
+        snprintf(reads, sizeof(reads), "%.3f", result->reads);
+    }
+
+    if (opts->format == FORMAT_JSON) {
+        printf("{\"mode\":\"%s\",\"layout\":\"%s\",\"pattern\":\"%s\",\"backend\":\"%s\",\"op\":\"%s\","
+            "\"pages\":%zu,\"ops\":%zu,\"seed\":%llu,\"ns_per_op\":%.3f,\"reads_per_op\":%s,\"mops\":%.3f,"
+            "\"failures\":%zu,\"checksum\":\"%016llx\"}\n",
+            space->mode->name, layout, pattern, backend, op, space->count, ops, (unsigned long long) opts->seed,
+            result->ns, result->reads >= 0 ? reads : "null", mops, result->failures, (unsigned long long) result->checksum);
+        return;
+    }
+
+    if (opts->format == FORMAT_CSV) {
+        if (!header) {
+            printf("mode,layout,pattern,backend,op,pages,ops,seed,ns_per_op,reads_per_op,mops,failures,checksum\n");
+        }
+        printf("%s,%s,%s,%s,%s,%zu,%zu,%llu,%.3f,%s,%.3f,%zu,%016llx\n",
+            space->mode->name, layout, pattern, backend, op, space->count, ops, (unsigned long long) opts->seed,
+            result->ns, reads, mops, result->failures, (unsigned long long) result->checksum);
+    } else {
+        if (!header) {
+            printf("%-6s %-6s %-10s %-11s %10s %9s %9s %8s\n",
+                "mode", "layout", "pattern", "backend", "ns/op", "reads/op", "Mops/s", "failures");
+        }
+        printf("%-6s %-6s %-10s %-11s %10.1f %9s %9.2f %8zu\n",
+            space->mode->name, layout, pattern, backend, result->ns, result->reads >= 0 ? reads : "-", mops, result->failures);
+    }
+
+    header = 1;
+}
+
+/**
+ * @name bench_layout
+ * @description:
+ *  Function runs every selected pattern and backend on the paging structures of one layout. Each run translates
+ *  the address sequence once to warm up the CPU and translation caches and then measures it opts->repeat times
+ */
+static uint8_t bench_layout(const BenchOptions *opts, const BenchSpace *space, const char *layout, uint64_t *virt_addrs) {
+    MemSegment segment = { .phys_start = 0, .length = bench_memory_size, .data = bench_memory };
+    MemImage image = { .segments = &segment, .count = 1, .fd = -1 };
+    BenchTargets targets = { .image = &image, .group = opts->group };
+    uint8_t built = 1;
+
+    if (bench_selected(opts->backends, BenchBackendNames[BACKEND_FLAT])) { // the map is built outside of the measurements
+        targets.flat = fmap_build(space->mode->level, space->root, bench_read_func, bench_read_func_64, NULL);
+        built = targets.flat != NULL;
+    }
+
+    for (BenchPattern pattern = 0; pattern < BENCH_PATTERNS && built; pattern++) {
+        if (!bench_selected(opts->patterns, BenchPatternNames[pattern])) {
+            continue;
+        }
+
+        if (pattern == PATTERN_CLASSIFY) {
+            static const struct { const char *name; CLASSIFY_FUNC kernel; } kernels[] = {
+                { "scalar", classify_scalar },
+#ifdef VA2PA_X86
+                { "sse2", classify_sse2 },
+                { "avx2", classify_avx2 }
+#endif
+            };
+
+            if (space->mode->level != 4) {
+                continue;
+            }
+
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+#ifdef VA2PA_X86
+                if ((k == 1 && !__builtin_cpu_supports("sse2")) || (k == 2 && !__builtin_cpu_supports("avx2"))) {
+                    continue;
+                }
+#endif
+                if (!bench_selected(opts->backends, kernels[k].name)) {
+                    continue;
+                }
+
+                size_t tables = (space->next_frame - space->root) / 0x1000;
+                BenchResult result = { .reads = -1 };
+                double best = bench_classify_pass(space, kernels[k].kernel, &result);
+
+                for (unsigned int r = 0; r < opts->repeat; r++) {
+                    double elapsed = bench_classify_pass(space, kernels[k].kernel, &result);
+                    best = elapsed < best ? elapsed : best;
+                }
+
+                result.ns = best / tables;
+                bench_report(opts, space, layout, BenchPatternNames[pattern], kernels[k].name, "table", tables, &result);
+            }
+
+            continue;
+        }
+
+        if (!(built = bench_sequence(space, pattern, opts->zipf, virt_addrs, opts->translations))) {
+            break;
+        }
+
+        for (BenchBackend backend = 0; backend < BENCH_BACKENDS && built; backend++) {
+            if (!bench_selected(opts->backends, BenchBackendNames[backend])
+                || ((backend == BACKEND_BATCH || backend == BACKEND_INTERLEAVED) && space->mode->level != 4)) {
+                continue;
+            }
+
+            targets.tc = backend == BACKEND_CACHED ? tcache_create(0, 0, PSC_DEFAULT_ENTRIES) : NULL;
+            targets.sc = backend == BACKEND_SHARED ? tcache_shared_create(0, 0) : NULL;
+
+            if ((backend == BACKEND_CACHED && targets.tc == NULL) || (backend == BACKEND_SHARED && targets.sc == NULL)) {
+                built = 0;
+                break;
+            }
+
+            BenchResult result = { 0 };
+            double best = bench_pass(space, backend, &targets, virt_addrs, opts->translations, &result);
+
+            for (unsigned int r = 0; r < opts->repeat; r++) {
+                bench_reads = 0;
+                double elapsed = bench_pass(space, backend, &targets, virt_addrs, opts->translations, &result);
+                best = elapsed < best ? elapsed : best;
+            }
+
+            tcache_destroy(targets.tc);
+            tcache_shared_destroy(targets.sc);
+
+            // The image and flat backends do not go through bench_read_func_64()
+            result.ns = best / opts->translations;
+            result.reads = backend == BACKEND_IMAGE || backend == BACKEND_INTERLEAVED || backend == BACKEND_FLAT ? 
+                -1 : (double) bench_reads / opts->translations;
+            bench_report(opts, space, layout, BenchPatternNames[pattern], BenchBackendNames[backend],
+                "translation", opts->translations, &result);
+        }
+    }
+
+    fmap_destroy((FlatMap*) targets.flat);
+    return built;
+}
+
+static void bench_usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --mode LIST         legacy,pae,long\n"
+        "  --layout LIST       dense,sparse,huge\n"
+        "  --pattern LIST      sequential,uniform,zipf,classify\n"
+        "  --backend LIST      callback,image,specialized,cached,shared,batch,\n"
+        "                      interleaved,flat,scalar,sse2,avx2\n"
+        "  --pages N           pages mapped by every layout (%d)\n"
+        "  --translations N    translations per measurement (%d)\n"
+        "  --repeat N          measurements per run, the fastest is reported (%d)\n"
+        "  --zipf S            skew of the zipf pattern (%.2f)\n"
+        "  --group N           walks the interleaved backend keeps going at once (%d)\n"
+        "  --seed N            seed of the tables and address sequences (1)\n"
+        "  --format FORMAT     text, csv or json (one object per line)\n"
+        "Lists are comma separated, everything is run by default\n",
+        name, BENCH_DEFAULT_PAGES, BENCH_DEFAULT_TRANSLATIONS, BENCH_DEFAULT_REPEAT, BENCH_DEFAULT_ZIPF, INTERLEAVE_GROUP);
+}
+
+// Function parses the command line, returns 0 on an unknown option or a malformed value
+static uint8_t bench_options(int argc, char *argv[], BenchOptions *opts) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+        char *end = NULL;
+
+        if (value == NULL) {
+            return 0;
+        }
+
+        if (strcmp(arg, "--mode") == 0) {
+            opts->modes = value;
+        } else if (strcmp(arg, "--layout") == 0) {
+            opts->layouts = value;
+        } else if (strcmp(arg, "--pattern") == 0) {
+            opts->patterns = value;
+        } else if (strcmp(arg, "--backend") == 0) {
+            opts->backends = value;
+        } else if (strcmp(arg, "--pages") == 0) {
+            opts->pages = strtoull(value, &end, 0);
+        } else if (strcmp(arg, "--translations") == 0) {
+            opts->translations = strtoull(value, &end, 0);
+        } else if (strcmp(arg, "--repeat") == 0) {
+            opts->repeat = strtoul(value, &end, 0);
+        } else if (strcmp(arg, "--zipf") == 0) {
+            opts->zipf = strtod(value, &end);
+        } else if (strcmp(arg, "--group") == 0) {
+            opts->group = strtoul(value, &end, 0);
+        } else if (strcmp(arg, "--seed") == 0) {
+            opts->seed = strtoull(value, &end, 0);
+        } else if (strcmp(arg, "--format") == 0) {
+            if (strcmp(value, "text") == 0) {
+                opts->format = FORMAT_TEXT;
+            } else if (strcmp(value, "csv") == 0) {
+                opts->format = FORMAT_CSV;
+            } else if (strcmp(value, "json") == 0) {
+                opts->format = FORMAT_JSON;
+            } else {
+                return 0;
+            }
+        } else {
+            return 0;
+        }
+
+        if (end != NULL && (*end != '\0' || end == value)) {
+            return 0;
+        }
+
+        i++;
+    }
+
+    return opts->pages > 0 && opts->translations > 0 && opts->repeat > 0;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions opts = {
+        .pages = BENCH_DEFAULT_PAGES, .translations = BENCH_DEFAULT_TRANSLATIONS, .repeat = BENCH_DEFAULT_REPEAT,
+        .zipf = BENCH_DEFAULT_ZIPF, .group = INTERLEAVE_GROUP, .seed = 1, .format = FORMAT_TEXT
+    };
+
+    if (!bench_options(argc, argv, &opts)) {
+        bench_usage(argv[0]);
+        return 2;
+    }
+
+    uint64_t *virt_addrs = malloc(opts.translations * sizeof(uint64_t));
+    if (virt_addrs == NULL) {
+        return 1;
+    }
+
+    int status = 0;
+    for (size_t m = 0; m < sizeof(BenchModes) / sizeof(BenchModes[0]) && status == 0; m++) {
+        if (!bench_selected(opts.modes, BenchModes[m].name)) {
+            continue;
+        }
+
+        for (BenchLayout layout = 0; layout < BENCH_LAYOUTS && status == 0; layout++) {
+            BenchSpace space = { 0 };
+
+            if (!bench_selected(opts.layouts, BenchLayoutNames[layout])) {
+                continue;
+            }
+
+            if (!bench_space_available(&BenchModes[m], layout, opts.pages)) {
+                if (opts.layouts != NULL) {
+                    fprintf(stderr, "%s: no %s layout of %zu pages in %s mode\n",
+                        argv[0], BenchLayoutNames[layout], opts.pages, BenchModes[m].name);
+                }
+                continue;
+            }
+
+            // Every layout starts from the same seed so that a subset of the suite reproduces the full run
+            bench_state = (opts.seed + 1) * 0x9E3779B97F4A7C15ULL;
+            if (!bench_space_build(&space, &BenchModes[m], layout, opts.pages)
+                || !bench_layout(&opts, &space, BenchLayoutNames[layout], virt_addrs)) {
+                fprintf(stderr, "%s: out of memory\n", argv[0]);
+                status = 1;
+            }
+
+            bench_space_free(&space);
+        }
+    }
+
+    free(virt_addrs);
+    return status;
+}
+#endif
+
+#ifdef VA2PA_TOOL
+#ifdef VA2PA_BENCH
+    #error "VA2PA_TOOL and VA2PA_BENCH both define main()"
+#endif
+/* -------------------------------------------------------------------------- */
+/*                              TRANSLATION TOOL                              */
+/* -------------------------------------------------------------------------- */
+
+#define TOOL_DEFAULT_BATCH (1 << 16) // Addresses read, translated and written at a time
+#define TOOL_MAX_THREADS 256
+#define TOOL_IO_SIZE (1 << 20) // Size of the input buffer
+#define TOOL_TEXT_LINE 40 // Longest text result: 16 + 1 + 16 + 1 + 5 state digits + newline
+
+// Formats of the address and the result streams
+typedef enum {
+    TOOL_TEXT, // one hexadecimal address per line (0x prefix optional) / "virt_addr phys_addr state" lines
+    TOOL_BINARY // little-endian uint64_t addresses / ToolRecord results
+} ToolFormat;
+
+// Struct represents a result in the binary output format, results are in the order of the addresses
+typedef struct {
+    uint64_t phys_addr; // 0 if the translation failed
+    uint32_t state; // result code of the translation
+    uint32_t pad;
+} ToolRecord;
+
+// Struct holds the command line options of the tool
+typedef struct {
+    const char *image;
+    const char *input; // NULL for stdin
+    const char *output; // NULL for stdout
+    uint64_t root;
+    uint8_t root_set;
+    unsigned int level;
+    ToolFormat input_format, output_format;
+    unsigned int threads;
+    size_t batch;
+} ToolOptions;
+
+// Struct represents the buffered address stream
+typedef struct {
+    int fd;
+    char *buf; // TOOL_IO_SIZE bytes
+    size_t start, end; // unparsed bytes
+    size_t line; // text lines consumed, for error messages
+    uint8_t eof;
+} ToolInput;
+
+// Struct represents the part of a batch one thread translates and formats
+typedef struct {
+    const ToolOptions *opts;
+    const MemImage *image;
+    const uint64_t *virt_addrs;
+    uint64_t *phys_addrs;
+    TranslationState32 *states;
+    size_t count;
+    char *out; // formatted results
+    size_t out_length;
+} ToolSlice;
+
+static void tool_usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s --image PATH --root ADDR [options]\n"
+        "  --image PATH            raw image, ELF core or page table image of physical memory\n"
+        "  --root ADDR             root of the address space (CR3)\n"
+        "  --mode MODE             legacy, pae or long (long)\n"
+        "  --input PATH            addresses to translate (stdin)\n"
+        "  --output PATH           results (stdout)\n"
+        "  --input-format FORMAT   text (one hexadecimal address per line) or binary (uint64_t)\n"
+        "  --output-format FORMAT  text (\"virt_addr phys_addr state\" lines) or binary (16 byte records)\n"
+        "  --threads N             threads translating every batch (1)\n"
+        "  --batch N               addresses translated at a time (%d)\n"
+        "Failed translations have a physical address of 0 (\"-\" in text) and a non-zero state\n",
+        name, TOOL_DEFAULT_BATCH);
+}
+
+static uint8_t tool_format(const char *value, ToolFormat *format) {
+    if (strcmp(value, "text") == 0) {
+        *format = TOOL_TEXT;
+    } else if (strcmp(value, "binary") == 0) {
+        *format = TOOL_BINARY;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t tool_options(int argc, char *argv[], ToolOptions *opts) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+        char *end = NULL;
+
+        if (value == NULL) {
+            return 0;
+        }
+
+        if (strcmp(arg, "--image") == 0) {
+            opts->image = value;
+        } else if (strcmp(arg, "--root") == 0) {
+            opts->root = strtoull(value, &end, 0);
+            opts->root_set = 1;
+        } else if (strcmp(arg, "--mode") == 0) {
+            if (strcmp(value, "legacy") == 0) {
+                opts->level = 2;
+            } else if (strcmp(value, "pae") == 0) {
+                opts->level = 3;
+            } else if (strcmp(value, "long") == 0) {
+                opts->level = 4;
+            } else {
+                return 0;
+            }
+        } else if (strcmp(arg, "--input") == 0) {
+            opts->input = strcmp(value, "-") == 0 ? NULL : value;
+        } else if (strcmp(arg, "--output") == 0) {
+            opts->output = strcmp(value, "-") == 0 ? NULL : value;
+        } else if (strcmp(arg, "--input-format") == 0) {
+            if (!tool_format(value, &opts->input_format)) {
+                return 0;
+            }
+        } else if (strcmp(arg, "--output-format") == 0) {
+            if (!tool_format(value, &opts->output_format)) {
+                return 0;
+            }
+        } else if (strcmp(arg, "--threads") == 0) {
+            opts->threads = strtoul(value, &end, 0);
+        } else if (strcmp(arg, "--batch") == 0) {
+            opts->batch = strtoull(value, &end, 0);
+        } else {
+            return 0;
+        }
+
+        if (end != NULL && (*end != '\0' || end == value)) {
+            return 0;
+        }
+
+        i++;
+    }
+
+    return opts->image != NULL && opts->root_set && opts->threads > 0 && opts->threads <= TOOL_MAX_THREADS && opts->batch > 0;
+}
+
+// Function opens a memory image of the kind its first bytes tell
+static MemImage* tool_open_image(const char *path) {
+    char magic[8] = { 0 };
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    ssize_t got = read(fd, magic, sizeof(magic));
+    close(fd);
+
+    if (got >= 4 && memcmp(magic, ELFMAG, SELFMAG) == 0) {
+        return memimage_open_elfcore(path, 1);
+    } else if (got == sizeof(magic) && memcmp(magic, PTIMAGE_MAGIC, sizeof(magic)) == 0) {
+        return memimage_open_ptimage(path, NULL, NULL);
+    }
+
+    return memimage_open(path);
+}
+
+// Function moves the unparsed bytes to the beginning of the buffer and reads more, returns 0 on a read error
+static uint8_t tool_fill(ToolInput *in) {
+    memmove(in->buf, in->buf + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+
+    while (in->end < TOOL_IO_SIZE) {
+        ssize_t got = read(in->fd, in->buf + in->end, TOOL_IO_SIZE - in->end);
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0) {
+            return 0;
+        } else if (got == 0) {
+            in->eof = 1;
+        }
+
+        in->end += (size_t) got;
+        return 1;
+    }
+
+    return 1;
+}
+
+// Function parses a hexadecimal address surrounded by blanks, returns 0 if the text is not one
+static uint8_t tool_parse_hex(const char *text, const size_t length, uint64_t *value) {
+    size_t i = 0, digits = 0;
+    uint64_t result = 0;
+
+    while (i < length && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r')) {
+        i++;
+    }
+
+    if (i + 1 < length && text[i] == '0' && (text[i + 1] == 'x' || text[i + 1] == 'X')) {
+        i += 2;
+    }
+
+    for (; i < length; i++, digits++) {
+        char c = text[i];
+        unsigned int digit = c >= '0' && c <= '9' ? (unsigned int) (c - '0') : 
+            (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (unsigned int) ((c | 0x20) - 'a' + 10) : 16;
+
+        if (digit == 16) {
+            break;
+        }
+
+        result = (result << 4) | digit;
+    }
+
+    while (i < length && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r')) {
+        i++;
+    }
+
+    *value = result;
+    return digits > 0 && digits <= 16 && i == length;
+}
+
+// Function reads up to max text addresses, blank lines are skipped. Returns the amount read or -1 on an error
+static ssize_t tool_read_text(ToolInput *in, uint64_t *virt_addrs, const size_t max) {
+    size_t count = 0;
+
+    while (count < max) {
+        char *line = in->buf + in->start;
+        char *newline = memchr(line, '\n', in->end - in->start);
+
+        if (newline == NULL && !in->eof) { // A partial line, the rest of it has to be read first
+            if (in->start == 0 && in->end == TOOL_IO_SIZE) {
+                fprintf(stderr, "line %zu: too long\n", in->line + 1);
+                return -1;
+            }
+
+            if (!tool_fill(in)) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        size_t length = newline != NULL ? (size_t) (newline - line) : in->end - in->start;
+
+        if (newline == NULL && length == 0) { // End of the stream
+            break;
+        }
+
+        in->start += length + (newline != NULL);
+        in->line++;
+
+        size_t blank = 0;
+        while (blank < length && (line[blank] == ' ' || line[blank] == '\t' || line[blank] == '\r')) {
+            blank++;
+        }
+
+        if (blank == length) {
+            continue;
+        }
+
+        if (!tool_parse_hex(line, length, &virt_addrs[count])) {
+            fprintf(stderr, "line %zu: not a hexadecimal address\n", in->line);
+            return -1;
+        }
+
+        count++;
+    }
+
+    return (ssize_t) count;
+}
+
+// Function reads up to max binary addresses, returns the amount read or -1 on an error
+static ssize_t tool_read_binary(ToolInput *in, uint64_t *virt_addrs, const size_t max) {
+    size_t count = 0;
+
+    while (count < max) {
+        size_t available = (in->end - in->start) / sizeof(uint64_t);
+
+        if (available == 0) {
+            if (in->eof) {
+                if (in->end != in->start) {
+                    fprintf(stderr, "input ends in the middle of an address\n");
+                    return -1;
+                }
+
+                break;
+            }
+
+            if (!tool_fill(in)) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        available = available < max - count ? available : max - count;
+        memcpy(&virt_addrs[count], in->buf + in->start, available * sizeof(uint64_t));
+        in->start += available * sizeof(uint64_t);
+        count += available;
+    }
+
+    return (ssize_t) count;
+}
+
+// Function writes 16 hexadecimal digits of a value
+static inline char* tool_hex(char *out, uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 15; i >= 0; i--) {
+        out[i] = digits[value & 0xF];
+        value >>= 4;
+    }
+
+    return out + 16;
+}
+
+// Function translates a slice of a batch and formats its results
+static void* tool_slice(void *arg) {
+    ToolSlice *slice = arg;
+    const ToolOptions *opts = slice->opts;
+
+    if (opts->level == 4) {
+        va2pa_64_image_batch(slice->image, slice->virt_addrs, slice->count, opts->root, INTERLEAVE_GROUP, slice->phys_addrs, slice->states);
+    } else {
+        for (size_t i = 0; i < slice->count; i++) {
+            if (slice->virt_addrs[i] > UINT32_MAX) { // Not truncated, the result would be shown for the full address
+                slice->states[i] = ST_ADDRESS_WIDTH_32;
+                continue;
+            }
+
+            slice->states[i] = va2pa_image(slice->image, (unsigned int) slice->virt_addrs[i], opts->level, 
+                (unsigned int) opts->root, &slice->phys_addrs[i]);
+        }
+    }
+
+    if (opts->output_format == TOOL_BINARY) {
+        ToolRecord *records = (ToolRecord*) slice->out;
+
+        for (size_t i = 0; i < slice->count; i++) {
+            records[i].phys_addr = slice->states[i] == ST_SUCCESS_32 ? slice->phys_addrs[i] : 0;
+            records[i].state = slice->states[i];
+            records[i].pad = 0;
+        }
+
+        slice->out_length = slice->count * sizeof(ToolRecord);
+        return NULL;
+    }
+
+    char *out = slice->out;
+    for (size_t i = 0; i < slice->count; i++) {
+        unsigned int state = slice->states[i];
+
+        out = tool_hex(out, slice->virt_addrs[i]);
+        *out++ = ' ';
+
+        if (state == ST_SUCCESS_32) {
+            out = tool_hex(out, slice->phys_addrs[i]);
+        } else {
+            *out++ = '-';
+        }
+
+        *out++ = ' ';
+        if (state >= 10) {
+            *out++ = (char) ('0' + state / 10);
+        }
+
+        *out++ = (char) ('0' + state % 10);
+        *out++ = '\n';
+    }
+
+    slice->out_length = (size_t) (out - slice->out);
+    return NULL;
+}
+
+// Function writes a whole buffer, returns 0 on a write error
+static uint8_t tool_write(const int fd, const char *buf, size_t length) {
+    while (length > 0) {
+        ssize_t done = write(fd, buf, length);
+
+        if (done < 0 && errno == EINTR) {
+            continue;
+        } else if (done <= 0) {
+            return 0;
+        }
+
+        buf += done;
+        length -= (size_t) done;
+    }
+
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    ToolOptions opts = { .level = 4, .threads = 1, .batch = TOOL_DEFAULT_BATCH };
+
+    if (!tool_options(argc, argv, &opts)) {
+        tool_usage(argv[0]);
+        return 2;
+    }
+
+    if (opts.level != 4 && opts.root > UINT32_MAX) {
+        fprintf(stderr, "%s: root 0x%llx is above 4 GiB, legacy and PAE roots are 32-bit\n", argv[0], (unsigned long long) opts.root);
+        return 2;
+    }
+
+    MemImage *image = tool_open_image(opts.image);
+    if (image == NULL) {
+        fprintf(stderr, "%s: cannot open image %s\n", argv[0], opts.image);
+        return 1;
+    }
+
+    ToolInput in = { .fd = opts.input != NULL ? open(opts.input, O_RDONLY) : STDIN_FILENO };
+    int out_fd = opts.output != NULL ? open(opts.output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+
+    if (in.fd < 0 || out_fd < 0) {
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], in.fd < 0 ? opts.input : opts.output);
+        memimage_close(image);
+        return 1;
+    }
+
+    size_t per_slice = (opts.batch + opts.threads - 1) / opts.threads;
+    size_t line = opts.output_format == TOOL_BINARY ? sizeof(ToolRecord) : TOOL_TEXT_LINE;
+    uint64_t *virt_addrs = malloc(opts.batch * sizeof(uint64_t));
+    uint64_t *phys_addrs = malloc(opts.batch * sizeof(uint64_t));
+    TranslationState32 *states = malloc(opts.batch * sizeof(TranslationState32));
+    char *out = malloc(opts.threads * per_slice * line);
+    ToolSlice slices[TOOL_MAX_THREADS];
+    pthread_t threads[TOOL_MAX_THREADS];
+    uint8_t running[TOOL_MAX_THREADS] = { 0 }; // threads[t] was created and is not joined yet
+    int status = 0;
+
+    in.buf = malloc(TOOL_IO_SIZE);
+
+    if (virt_addrs == NULL || phys_addrs == NULL || states == NULL || out == NULL || in.buf == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        status = 1;
+    }
+
+    while (status == 0) {
+        ssize_t count = opts.input_format == TOOL_BINARY ? 
+            tool_read_binary(&in, virt_addrs, opts.batch) : tool_read_text(&in, virt_addrs, opts.batch);
+
+        if (count < 0) {
+            fprintf(stderr, "%s: cannot read addresses\n", argv[0]);
+            status = 1;
+            break;
+        } else if (count == 0) {
+            break;
+        }
+
+        // Every thread translates and formats a contiguous slice, the main thread takes the first one
+        size_t used = 0;
+        for (unsigned int t = 0; t < opts.threads && (size_t) count > t * per_slice; t++) {
+            size_t first = t * per_slice;
+            size_t length = (size_t) count - first < per_slice ? (size_t) count - first : per_slice;
+            ToolSlice slice = { &opts, image, virt_addrs + first, phys_addrs + first, states + first, length, out + first * line, 0 };
+
+            slices[t] = slice;
+            used = t + 1;
+
+            if (t != 0) {
+                running[t] = pthread_create(&threads[t], NULL, tool_slice, &slices[t]) == 0;
+            }
+
+            if (t != 0 && !running[t]) {
+                tool_slice(&slices[t]); // No thread, done right here
+            }
+        }
+
+        tool_slice(&slices[0]);
+
+        // Every thread is joined even after a write error, the results are written while nothing failed
+        for (size_t t = 0; t < used; t++) {
+            if (running[t]) {
+                pthread_join(threads[t], NULL);
+                running[t] = 0;
+            }
+
+            if (status == 0 && !tool_write(out_fd, slices[t].out, slices[t].out_length)) {
+                fprintf(stderr, "%s: cannot write results\n", argv[0]);
+                status = 1;
+            }
+        }
+    }
+
+    if (opts.input != NULL) {
+        close(in.fd);
+    }
+
+    if (opts.output != NULL && close(out_fd) != 0 && status == 0) {
+        fprintf(stderr, "%s: cannot write results\n", argv[0]);
+        status = 1;
+    }
+
+    free(in.buf);
+    free(virt_addrs);
+    free(phys_addrs);
+    free(states);
+    free(out);
+    memimage_close(image);
+    return status;
+}
+#endif